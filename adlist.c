@@ -31,6 +31,7 @@
 
 #include <stdlib.h>
 #include "adlist.h"
+#include "zmalloc.h"
 
 /*
  * һб
@@ -44,7 +45,7 @@ list *listCreate(void)
     struct list *list;
 
     // Ϊбṹڴ
-    if ((list = malloc(sizeof(*list))) == NULL)
+    if ((list = zmalloc(sizeof(*list))) == NULL)
         return NULL;
 
     // ʼ
@@ -53,10 +54,57 @@ list *listCreate(void)
     list->dup = NULL;
     list->free = NULL;
     list->match = NULL;
+    list->cache = NULL;
+    list->cache_len = 0;
+    list->cache_max = 0;
 
     return list;
 }
 
+/*
+ * Keep up to max deleted nodes in a free list and reuse them for the
+ * next additions, so a list with steady churn stops calling malloc.
+ * 0 (the default) disables the cache and frees the cached nodes.
+ *
+ * T = O(N), N = nodes released
+ */
+void listSetNodeCache(list *list, unsigned long max)
+{
+    listNode *node;
+
+    list->cache_max = max;
+    while (list->cache_len > max) {
+        node = list->cache;
+        list->cache = node->next;
+        zfree(node);
+        list->cache_len--;
+    }
+}
+
+/* A node from the cache, or from malloc when the cache is empty. */
+static listNode *listAllocNode(list *list)
+{
+    listNode *node = list->cache;
+
+    if (node == NULL)
+        return zmalloc(sizeof(*node));
+    list->cache = node->next;
+    list->cache_len--;
+    return node;
+}
+
+/* Give a node back to the cache, or to free when the cache is full. */
+static void listFreeNode(list *list, listNode *node)
+{
+    if (list->cache_len >= list->cache_max) {
+        zfree(node);
+        return;
+    }
+    node->next = list->cache;
+    list->cache = node;
+    list->cache_len++;
+}
+
 /*
  * ͷб(ԼбĽڵ)
  *
@@ -74,10 +122,11 @@ void listRelease(list *list)
         // бԴ free ôȶԽڵֵ
         if (list->free) list->free(current->value);
         // ֮ͷŽڵ
-        free(current);
+        zfree(current);
         current = next;
     }
-    free(list);
+    listSetNodeCache(list, 0);
+    zfree(list);
 }
 
 /*
@@ -92,7 +141,7 @@ list *listAddNodeHead(list *list, void *value)
 {
     listNode *node;
 
-    if ((node = malloc(sizeof(*node))) == NULL)
+    if ((node = listAllocNode(list)) == NULL)
         return NULL;
 
     node->value = value;
@@ -126,7 +175,7 @@ list *listAddNodeTail(list *list, void *value)
 {
     listNode *node;
 
-    if ((node = malloc(sizeof(*node))) == NULL)
+    if ((node = listAllocNode(list)) == NULL)
         return NULL;
 
     node->value = value;
@@ -157,7 +206,7 @@ list *listAddNodeTail(list *list, void *value)
 list *listInsertNode(list *list, listNode *old_node, void *value, int after) {
     listNode *node;
 
-    if ((node = malloc(sizeof(*node))) == NULL)
+    if ((node = listAllocNode(list)) == NULL)
         return NULL;
 
     node->value = value;
@@ -218,7 +267,7 @@ void listDelNode(list *list, listNode *node)
     if (list->free) list->free(node->value);
 
     // ͷŽڵ
-    free(node);
+    listFreeNode(list, node);
 
     // бڵ
     list->len--;
@@ -237,7 +286,7 @@ listIter *listGetIterator(list *list, int direction)
 {
     listIter *iter;
     
-    if ((iter = malloc(sizeof(*iter))) == NULL) return NULL;
+    if ((iter = zmalloc(sizeof(*iter))) == NULL) return NULL;
 
     // ݵķ򣬽ָָͷ߱β
     if (direction == AL_START_HEAD)
@@ -257,7 +306,7 @@ listIter *listGetIterator(list *list, int direction)
  * T = O(1)
  */
 void listReleaseIterator(listIter *iter) {
-    free(iter);
+    zfree(iter);
 }
 
 /*
@@ -329,6 +378,7 @@ list *listDup(list *orig)
     copy->dup = orig->dup;
     copy->free = orig->free;
     copy->match = orig->match;
+    copy->cache_max = orig->cache_max;
 
     // ƽڵ
     iter = listGetIterator(orig, AL_START_HEAD);
@@ -444,3 +494,68 @@ void listRotate(list *list) {
     tail->next = list->head;
     list->head = tail;
 }
+
+/* ---------------------------------------------------------------------------
+ * Intrusive list: the ilistNode is embedded in the object, so linking and
+ * unlinking never allocate, and an object finds its own node without a
+ * search. The list doesn't own the objects.
+ * ------------------------------------------------------------------------- */
+
+void ilistInit(ilist *list)
+{
+    list->head = list->tail = NULL;
+    list->len = 0;
+}
+
+void ilistAddNodeHead(ilist *list, ilistNode *node)
+{
+    node->prev = NULL;
+    node->next = list->head;
+    if (list->head)
+        list->head->prev = node;
+    else
+        list->tail = node;
+    list->head = node;
+    list->len++;
+}
+
+void ilistAddNodeTail(ilist *list, ilistNode *node)
+{
+    node->next = NULL;
+    node->prev = list->tail;
+    if (list->tail)
+        list->tail->next = node;
+    else
+        list->head = node;
+    list->tail = node;
+    list->len++;
+}
+
+/* Unlink node, the object it's embedded in is left alone. */
+void ilistDelNode(ilist *list, ilistNode *node)
+{
+    if (node->prev)
+        node->prev->next = node->next;
+    else
+        list->head = node->next;
+    if (node->next)
+        node->next->prev = node->prev;
+    else
+        list->tail = node->prev;
+    node->prev = node->next = NULL;
+    list->len--;
+}
+
+/* Move the tail node to the head, like listRotate. */
+void ilistRotate(ilist *list)
+{
+    ilistNode *tail = list->tail;
+
+    if (list->len <= 1) return;
+    list->tail = tail->prev;
+    list->tail->next = NULL;
+    list->head->prev = tail;
+    tail->prev = NULL;
+    tail->next = list->head;
+    list->head = tail;
+}
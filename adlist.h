@@ -31,6 +31,8 @@
 #ifndef __ADLIST_H__
 #define __ADLIST_H__
 
+#include <stddef.h>
+
 /* Node, List, and Iterator are the only data structures used currently. */
 
 /*
@@ -82,8 +84,27 @@ typedef struct list {
     void (*free)(void *ptr);
     // ȶԺ
     int (*match)(void *ptr, void *key);
+
+    // deleted nodes kept for reuse, see listSetNodeCache
+    listNode *cache;
+    unsigned long cache_len;
+    unsigned long cache_max;
 } list;
 
+/*
+ * Intrusive list node, embedded in the object it links
+ */
+typedef struct ilistNode {
+    struct ilistNode *prev;
+    struct ilistNode *next;
+} ilistNode;
+
+typedef struct ilist {
+    ilistNode *head;
+    ilistNode *tail;
+    unsigned long len;
+} ilist;
+
 /* Functions implemented as macros */
 // Ľڵ
 #define listLength(l) ((l)->len)
@@ -106,6 +127,14 @@ typedef struct list {
 #define listGetFree(l) ((l)->free)
 #define listGetMatchMethod(l) ((l)->match)
 
+#define ilistLength(l) ((l)->len)
+#define ilistFirst(l) ((l)->head)
+#define ilistLast(l) ((l)->tail)
+#define ilistPrevNode(n) ((n)->prev)
+#define ilistNextNode(n) ((n)->next)
+// the object of type t whose member m is node n
+#define ilistEntry(n,t,m) ((t *)((char *)(n) - offsetof(t, m)))
+
 /* Prototypes */
 list *listCreate(void);
 void listRelease(list *list);
@@ -122,6 +151,13 @@ listNode *listIndex(list *list, long index);
 void listRewind(list *list, listIter *li);
 void listRewindTail(list *list, listIter *li);
 void listRotate(list *list);
+void listSetNodeCache(list *list, unsigned long max);
+
+void ilistInit(ilist *list);
+void ilistAddNodeHead(ilist *list, ilistNode *node);
+void ilistAddNodeTail(ilist *list, ilistNode *node);
+void ilistDelNode(ilist *list, ilistNode *node);
+void ilistRotate(ilist *list);
 
 /* Directions for iterators */
 #define AL_START_HEAD 0
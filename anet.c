@@ -75,10 +75,9 @@ int anetNonBlock(char *err, int fd)
     return ANET_OK;
 }
 
-int anetTcpNoDelay(char *err, int fd)
+int anetSetTcpNoDelay(char *err, int fd, int val)
 {
-    int yes = 1;
-    if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes)) == -1)
+    if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val)) == -1)
     {
         anetSetError(err, "setsockopt TCP_NODELAY: %s", strerror(errno));
         return ANET_ERR;
@@ -86,6 +85,11 @@ int anetTcpNoDelay(char *err, int fd)
     return ANET_OK;
 }
 
+int anetTcpNoDelay(char *err, int fd)
+{
+    return anetSetTcpNoDelay(err, fd, 1);
+}
+
 int anetSetSendBuffer(char *err, int fd, int buffsize)
 {
     if (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &buffsize, sizeof(buffsize)) == -1)
@@ -96,6 +100,94 @@ int anetSetSendBuffer(char *err, int fd, int buffsize)
     return ANET_OK;
 }
 
+int anetSetReceiveBuffer(char *err, int fd, int buffsize)
+{
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buffsize, sizeof(buffsize)) == -1)
+    {
+        anetSetError(err, "setsockopt SO_RCVBUF: %s", strerror(errno));
+        return ANET_ERR;
+    }
+    return ANET_OK;
+}
+
+/* Linux clears TCP_QUICKACK again as soon as the connection leaves the
+ * quick ack mode, so callers wanting it permanently must set it after
+ * every read. */
+int anetTcpQuickAck(char *err, int fd, int val)
+{
+#ifdef TCP_QUICKACK
+    if (setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &val, sizeof(val)) == -1)
+    {
+        anetSetError(err, "setsockopt TCP_QUICKACK: %s", strerror(errno));
+        return ANET_ERR;
+    }
+    return ANET_OK;
+#else
+    ((void) fd);
+    ((void) val);
+    anetSetError(err, "TCP_QUICKACK is not supported on this system");
+    return ANET_ERR;
+#endif
+}
+
+/* Limit the unsent bytes queued in the kernel, so replies wait in user
+ * space where they can still be merged, instead of in a deep socket
+ * buffer. */
+int anetTcpNotSentLowat(char *err, int fd, int bytes)
+{
+#ifdef TCP_NOTSENT_LOWAT
+    if (setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &bytes, sizeof(bytes)) == -1)
+    {
+        anetSetError(err, "setsockopt TCP_NOTSENT_LOWAT: %s", strerror(errno));
+        return ANET_ERR;
+    }
+    return ANET_OK;
+#else
+    ((void) fd);
+    ((void) bytes);
+    anetSetError(err, "TCP_NOTSENT_LOWAT is not supported on this system");
+    return ANET_ERR;
+#endif
+}
+
+/* Busy poll the device queue for up to 'usec' microseconds on blocking
+ * receives and in poll/epoll, trading CPU for latency. */
+int anetSetBusyPoll(char *err, int fd, int usec)
+{
+#ifdef SO_BUSY_POLL
+    if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec)) == -1)
+    {
+        anetSetError(err, "setsockopt SO_BUSY_POLL: %s", strerror(errno));
+        return ANET_ERR;
+    }
+    return ANET_OK;
+#else
+    ((void) fd);
+    ((void) usec);
+    anetSetError(err, "SO_BUSY_POLL is not supported on this system");
+    return ANET_ERR;
+#endif
+}
+
+/* Set on a listening socket: accept() only returns connections that
+ * already sent data, or waited more than 'seconds'. */
+int anetTcpDeferAccept(char *err, int fd, int seconds)
+{
+#ifdef TCP_DEFER_ACCEPT
+    if (setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &seconds, sizeof(seconds)) == -1)
+    {
+        anetSetError(err, "setsockopt TCP_DEFER_ACCEPT: %s", strerror(errno));
+        return ANET_ERR;
+    }
+    return ANET_OK;
+#else
+    ((void) fd);
+    ((void) seconds);
+    anetSetError(err, "TCP_DEFER_ACCEPT is not supported on this system");
+    return ANET_ERR;
+#endif
+}
+
 int anetTcpKeepAlive(char *err, int fd)
 {
     int yes = 1;
@@ -106,6 +198,60 @@ int anetTcpKeepAlive(char *err, int fd)
     return ANET_OK;
 }
 
+/* Set TCP keep alive option to detect dead peers. The interval option
+ * is only used for Linux as we are using Linux-specific APIs to set
+ * the probe send time, interval, and count. On OSX only the idle time
+ * can be tuned (TCP_KEEPALIVE). */
+int anetKeepAlive(char *err, int fd, int interval)
+{
+    int val;
+
+    if (anetTcpKeepAlive(err, fd) == ANET_ERR)
+        return ANET_ERR;
+
+#ifdef __linux__
+    /* Default settings are more or less garbage, with the keepalive time
+     * set to 7200 by default on Linux. Modify settings to make the feature
+     * actually useful. */
+
+    /* Send first probe after interval. */
+    val = interval;
+    if (setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &val, sizeof(val)) < 0) {
+        anetSetError(err, "setsockopt TCP_KEEPIDLE: %s\n", strerror(errno));
+        return ANET_ERR;
+    }
+
+    /* Send next probes after the specified interval. Note that we set the
+     * delay as interval / 3, as we send three probes before detecting
+     * an error (see the next setsockopt call). */
+    val = interval/3;
+    if (val == 0) val = 1;
+    if (setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &val, sizeof(val)) < 0) {
+        anetSetError(err, "setsockopt TCP_KEEPINTVL: %s\n", strerror(errno));
+        return ANET_ERR;
+    }
+
+    /* Consider the socket in error state after three we send three ACK
+     * probes without getting a reply. */
+    val = 3;
+    if (setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &val, sizeof(val)) < 0) {
+        anetSetError(err, "setsockopt TCP_KEEPCNT: %s\n", strerror(errno));
+        return ANET_ERR;
+    }
+#elif defined(TCP_KEEPALIVE)
+    val = interval;
+    if (setsockopt(fd, IPPROTO_TCP, TCP_KEEPALIVE, &val, sizeof(val)) < 0) {
+        anetSetError(err, "setsockopt TCP_KEEPALIVE: %s\n", strerror(errno));
+        return ANET_ERR;
+    }
+#else
+    ((void) interval); /* Avoid unused var warning for non Linux systems. */
+    ((void) val);
+#endif
+
+    return ANET_OK;
+}
+
 int anetResolve(char *err, char *host, char *ipbuf)
 {
     struct sockaddr_in sa;
@@ -296,6 +442,38 @@ int anetTcpServer(char *err, int port, char *bindaddr)
     return s;
 }
 
+int anetUdpServer(char *err, int port, char *bindaddr)
+{
+    int s, on = 1;
+    struct sockaddr_in sa;
+
+    if ((s = socket(AF_INET, SOCK_DGRAM, 0)) == -1) {
+        anetSetError(err, "creating socket: %s", strerror(errno));
+        return ANET_ERR;
+    }
+    if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1) {
+        anetSetError(err, "setsockopt SO_REUSEADDR: %s", strerror(errno));
+        close(s);
+        return ANET_ERR;
+    }
+
+    memset(&sa,0,sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(port);
+    sa.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bindaddr && inet_aton(bindaddr, &sa.sin_addr) == 0) {
+        anetSetError(err, "invalid bind address");
+        close(s);
+        return ANET_ERR;
+    }
+    if (bind(s,(struct sockaddr*)&sa,sizeof(sa)) == -1) {
+        anetSetError(err, "bind: %s", strerror(errno));
+        close(s);
+        return ANET_ERR;
+    }
+    return s;
+}
+
 int anetUnixServer(char *err, char *path, mode_t perm)
 {
     int s;
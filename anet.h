@@ -62,13 +62,22 @@ int anetUnixNonBlockConnect(char *err, char *path);
 int anetRead(int fd, char *buf, int count);
 int anetResolve(char *err, char *host, char *ipbuf);
 int anetTcpServer(char *err, int port, char *bindaddr);
+int anetUdpServer(char *err, int port, char *bindaddr);
 int anetUnixServer(char *err, char *path, mode_t perm);
 int anetTcpAccept(char *err, int serversock, char *ip, int *port);
 int anetUnixAccept(char *err, int serversock);
 int anetWrite(int fd, char *buf, int count);
 int anetNonBlock(char *err, int fd);
 int anetTcpNoDelay(char *err, int fd);
+int anetSetTcpNoDelay(char *err, int fd, int val);
+int anetSetSendBuffer(char *err, int fd, int buffsize);
+int anetSetReceiveBuffer(char *err, int fd, int buffsize);
+int anetTcpQuickAck(char *err, int fd, int val);
+int anetTcpNotSentLowat(char *err, int fd, int bytes);
+int anetSetBusyPoll(char *err, int fd, int usec);
+int anetTcpDeferAccept(char *err, int fd, int seconds);
 int anetTcpKeepAlive(char *err, int fd);
+int anetKeepAlive(char *err, int fd, int interval);
 int anetPeerToString(int fd, char *ip, int *port);
 void anetSetError(char *err, const char *fmt, ...);
 #endif
@@ -0,0 +1,577 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include "aof.h"
+#include "zmalloc.h"
+#include "areactor.h"
+#include "client.h"
+#include "network.h"
+#include "db.h"
+#include "bio.h"
+#include "util.h"
+
+
+// append only file: every command that changed the keyspace is appended
+// to g_server.aof_buf as it was received, the buffer is written once per
+// loop iteration by before_sleep and fsynced as --appendfsync says. at
+// startup the file is replayed. a forked child rewrites it from the
+// keyspace when it has grown too much.
+
+static void buffer_append(struct aof_buffer *b, const char *p, size_t len)
+{
+	size_t size;
+	char *data;
+
+	if (b->len + len > b->size) {
+		size = b->size ? b->size : 4096;
+		while (size < b->len + len) size *= 2;
+		data = (char *)zrealloc(b->data, size);
+		if (data == NULL) {
+			// dropping a write would lose it silently
+			printf ("Out of memory growing the AOF buffer\n");
+			exit(1);
+		}
+		b->data = data;
+		b->size = size;
+	}
+	memcpy(b->data + b->len, p, len);
+	b->len += len;
+}
+
+static void buffer_free(struct aof_buffer *b)
+{
+	zfree(b->data);
+	b->data = NULL;
+	b->len = 0;
+	b->size = 0;
+}
+
+// "<prefix><ll>\r\n"
+static void cat_length(struct aof_buffer *b, char prefix, long long ll)
+{
+	char buf[LONG_STR_SIZE + 3];
+	int len;
+
+	buf[0] = prefix;
+	len = ll2string(buf + 1, sizeof(buf) - 1, ll) + 1;
+	buf[len++] = '\r';
+	buf[len++] = '\n';
+	buffer_append(b, buf, len);
+}
+
+// the command as a multibulk request, the way clients send it
+static void cat_command(struct aof_buffer *b, int argc, struct arg *argv)
+{
+	int j;
+
+	cat_length(b, '*', argc);
+	for (j = 0; j < argc; j++) {
+		cat_length(b, '$', argv[j].len);
+		buffer_append(b, argv[j].ptr, argv[j].len);
+		buffer_append(b, "\r\n", 2);
+	}
+}
+
+// "PEXPIREAT key <ms>", or "DEL key" if the ttl already deleted the key
+static void cat_expire(struct aof_buffer *b, struct arg *key)
+{
+	char when[LONG_STR_SIZE];
+	struct arg argv[3];
+	long long expire;
+
+	argv[1] = *key;
+	if (dictFind(g_server.db, key) == NULL) {
+		argv[0].ptr = "DEL";
+		argv[0].len = 3;
+		cat_command(b, 2, argv);
+		return;
+	}
+	if ((expire = db_get_expire(key)) == -1) {
+		return;
+	}
+	argv[0].ptr = "PEXPIREAT";
+	argv[0].len = 9;
+	argv[2].ptr = when;
+	argv[2].len = ll2string(when, sizeof(when), expire);
+	cat_command(b, 3, argv);
+}
+
+// cmd as it is logged, called after it changed the keyspace. a relative
+// ttl is logged as the deadline it gave, so the replay doesn't extend it.
+void cat_propagated_command(struct aof_buffer *b, struct command *cmd, int argc, struct arg *argv)
+{
+	if (cmd->pro == command_expire) {
+		cat_expire(b, &argv[1]);
+	} else if (cmd->pro == command_set && argc > 3) {
+		cat_command(b, 3, argv);
+		cat_expire(b, &argv[1]);
+	} else {
+		cat_command(b, argc, argv);
+	}
+}
+
+// p is a command made by cat_propagated_command
+void feed_append_only_file(const char *p, size_t len)
+{
+	buffer_append(&g_server.aof_buf, p, len);
+
+	// the child writes the keyspace as it was at fork time, what
+	// changed since is appended to its file when it's done
+	if (g_server.aof_child_pid != -1) {
+		buffer_append(&g_server.aof_rewrite_buf, p, len);
+	}
+}
+
+
+// write aof_buf to the file, then fsync or hand the fsync to the bio
+// thread. called before the loop sleeps, and by flush_before_reply.
+// force writes even if an fsync is still running.
+void flush_append_only_file(int force)
+{
+	static time_t last_write_error_log = 0;
+	struct aof_buffer *b = &g_server.aof_buf;
+	ssize_t nwritten;
+	int sync_in_progress = 0;
+
+	if (g_server.aof_fd == -1) {
+		return;
+	}
+	if (b->len == 0) {
+		// everysec: the last writes before the server went idle still
+		// need their fsync
+		if (g_server.aof_fsync == AOF_FSYNC_EVERYSEC &&
+			g_server.aof_fsync_offset != g_server.aof_current_size &&
+			g_server.unixtime > g_server.aof_last_fsync &&
+			bio_pending_jobs(BIO_AOF_FSYNC) == 0) {
+			goto try_fsync;
+		}
+		return;
+	}
+
+	if (g_server.aof_fsync == AOF_FSYNC_EVERYSEC) {
+		sync_in_progress = bio_pending_jobs(BIO_AOF_FSYNC) != 0;
+	}
+	// a write to a file being fsynced blocks until the fsync is done,
+	// hold the buffer back for up to AOF_FLUSH_POSTPONE_MAX seconds
+	if (sync_in_progress && !force) {
+		if (g_server.aof_flush_postponed_start == 0) {
+			g_server.aof_flush_postponed_start = g_server.unixtime;
+			return;
+		}
+		if (g_server.unixtime - g_server.aof_flush_postponed_start < AOF_FLUSH_POSTPONE_MAX) {
+			return;
+		}
+		g_server.stat_aof_delayed_fsync++;
+		printf ("AOF fsync is taking too long (disk is busy?), writing without waiting for it\n");
+	}
+	g_server.aof_flush_postponed_start = 0;
+
+	nwritten = write_all(g_server.aof_fd, b->data, b->len);
+	if (nwritten != (ssize_t)b->len) {
+		// the replies would say the data is safe when it is not
+		if (g_server.aof_fsync == AOF_FSYNC_ALWAYS) {
+			printf ("Can't write the AOF with appendfsync always: %s\n", strerror(errno));
+			exit(1);
+		}
+		if (g_server.unixtime - last_write_error_log > 30) {
+			printf ("Error writing the AOF, will retry: %s\n",
+					nwritten == -1 ? strerror(errno) : "short write");
+			last_write_error_log = g_server.unixtime;
+		}
+		// keep what wasn't written for the next try
+		if (nwritten > 0) {
+			g_server.aof_current_size += nwritten;
+			memmove(b->data, b->data + nwritten, b->len - nwritten);
+			b->len -= nwritten;
+		}
+		return;
+	}
+	g_server.aof_current_size += nwritten;
+	if (b->size > AOF_BUF_KEEP) {
+		buffer_free(b);
+	} else {
+		b->len = 0;
+	}
+
+try_fsync:
+	if (g_server.aof_fsync == AOF_FSYNC_ALWAYS) {
+		if (data_fsync(g_server.aof_fd) == -1) {
+			printf ("Can't fsync the AOF with appendfsync always: %s\n", strerror(errno));
+			exit(1);
+		}
+		g_server.aof_fsync_offset = g_server.aof_current_size;
+		g_server.aof_last_fsync = g_server.unixtime;
+	} else if (g_server.aof_fsync == AOF_FSYNC_EVERYSEC &&
+			   g_server.unixtime > g_server.aof_last_fsync) {
+		if (!sync_in_progress) {
+			bio_create_job(BIO_AOF_FSYNC, g_server.aof_fd);
+			g_server.aof_fsync_offset = g_server.aof_current_size;
+		}
+		g_server.aof_last_fsync = g_server.unixtime;
+	}
+}
+
+// with appendfsync always a write is on disk before it is acknowledged.
+// before_sleep flushes once per loop iteration, but a write handler may
+// run before it in the same iteration, and udp replies go out from the
+// read handler: whatever sends replies calls this first.
+void flush_before_reply()
+{
+	if (g_server.aof_fd != -1 && g_server.aof_fsync == AOF_FSYNC_ALWAYS &&
+		g_server.aof_buf.len != 0) {
+		flush_append_only_file(0);
+	}
+}
+
+// run the commands of the file through a pseudo client, the replies are
+// dropped. the file is mapped and parsed in place. a command cut short at
+// the end, e.g. by a crash in the middle of a write, is truncated away;
+// anything else malformed stops the server.
+void load_append_only_file()
+{
+	long long start = ustime();
+	struct stat sb;
+	struct client *c;
+	char *base;
+	off_t off = 0;
+	size_t len;
+	int fd;
+
+	fd = open(g_server.aof_filename, O_RDWR);
+	if (fd == -1) {
+		if (errno == ENOENT) {
+			return;
+		}
+		printf ("Can't open the AOF %s: %s\n", g_server.aof_filename, strerror(errno));
+		exit(1);
+	}
+	if (fstat(fd, &sb) == -1) {
+		printf ("Can't stat the AOF %s: %s\n", g_server.aof_filename, strerror(errno));
+		exit(1);
+	}
+	if (sb.st_size == 0) {
+		close(fd);
+		return;
+	}
+	// the parser ends every argument with a null byte, a private mapping
+	// keeps them out of the file
+	base = (char *)mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (base == MAP_FAILED) {
+		printf ("Can't map the AOF %s: %s\n", g_server.aof_filename, strerror(errno));
+		exit(1);
+	}
+	if ((c = create_pseudo_client(CLIENT_AOF)) == NULL) {
+		printf ("Can't create the AOF client\n");
+		exit(1);
+	}
+
+	g_server.loading = 1;
+	c->qb_start = c->qb_pos = 0;
+	while (off < sb.st_size) {
+		len = sb.st_size - off;
+		if (len > AOF_LOAD_CHUNK) len = AOF_LOAD_CHUNK;
+		c->input_buf = base + off;
+		c->qb_len = len;
+		process_input(c);
+
+		if (c->flags & CLIENT_CLOSE_AFTER_REPLY) {
+			printf ("Bad file format reading the AOF at offset %lld\n", (long long)off + c->qb_pos);
+			exit(1);
+		}
+		if (c->qb_len == 0) {
+			off += len;
+			continue;
+		}
+		if (off + (off_t)len == sb.st_size) {
+			off += c->qb_start;
+			break;
+		}
+		// a command crosses the end of the chunk: the next chunk starts
+		// with it and the parser goes on where it stopped, the arguments
+		// it has point into the mapping and stay valid
+		if (c->qb_start == 0) {
+			printf ("Bad file format reading the AOF at offset %lld\n", (long long)off);
+			exit(1);
+		}
+		off += c->qb_start;
+		c->qb_pos -= c->qb_start;
+		c->qb_start = 0;
+	}
+	g_server.loading = 0;
+
+	// a transaction with no EXEC never ran. left in the file, the writes
+	// appended after it would be queued in it on the next load.
+	if (c->flags & CLIENT_MULTI) {
+		off = g_server.loading_multi - base;
+		printf ("AOF ends inside a transaction, truncating %lld bytes\n",
+				(long long)(sb.st_size - off));
+	} else if (off < sb.st_size) {
+		printf ("AOF ends with an incomplete command, truncating %lld bytes\n",
+				(long long)(sb.st_size - off));
+	}
+	if (off < sb.st_size) {
+		if (ftruncate(fd, off) == -1) {
+			printf ("Can't truncate the AOF: %s\n", strerror(errno));
+			exit(1);
+		}
+	}
+	c->input_buf = NULL;
+	free_pseudo_client(c);
+	munmap(base, sb.st_size);
+	close(fd);
+	printf ("AOF loaded: %lld bytes, %lu keys in %.3f seconds\n", (long long)off,
+			dictSize(g_server.db), (double)(ustime() - start) / 1000000);
+}
+
+// open the file for appending, creating it if needed
+void open_append_only_file()
+{
+	struct stat sb;
+
+	g_server.aof_fd = open(g_server.aof_filename, O_WRONLY | O_APPEND | O_CREAT, 0644);
+	if (g_server.aof_fd == -1 || fstat(g_server.aof_fd, &sb) == -1) {
+		printf ("Can't open the AOF %s: %s\n", g_server.aof_filename, strerror(errno));
+		exit(1);
+	}
+	g_server.aof_current_size = sb.st_size;
+	g_server.aof_rewrite_base_size = sb.st_size;
+	g_server.aof_fsync_offset = sb.st_size;
+}
+
+static void rewrite_temp_filename(char *buf, size_t len, pid_t pid)
+{
+	// next to the file, so the rename is atomic
+	snprintf(buf, len, "%s.rewrite.%d", g_server.aof_filename, (int)pid);
+}
+
+// in the child: the keyspace as SET and PEXPIREAT commands. 0 if the
+// file was written and fsynced.
+static int rewrite_append_only_file(char *filename)
+{
+	struct aof_buffer b = {NULL, 0, 0};
+	struct arg argv[3], *key, *val;
+	long long now = mstime(), expire;
+	dictIterator *di;
+	dictEntry *de;
+	int fd;
+
+	fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) {
+		printf ("Can't open %s for the AOF rewrite: %s\n", filename, strerror(errno));
+		return -1;
+	}
+	// a safe iterator: db_get_expire must not move the db entries around
+	if ((di = dictGetSafeIterator(g_server.db)) == NULL) {
+		goto werr;
+	}
+	argv[0].ptr = "SET";
+	argv[0].len = 3;
+	while ((de = dictNext(di)) != NULL) {
+		key = (struct arg *)dictGetKey(de);
+		val = (struct arg *)dictGetVal(de);
+		expire = db_get_expire(key);
+		if (expire != -1 && expire < now) {
+			continue;
+		}
+		argv[1] = *key;
+		argv[2] = *val;
+		cat_command(&b, 3, argv);
+		if (expire != -1) {
+			cat_expire(&b, key);
+		}
+		if (b.len >= AOF_BUF_KEEP) {
+			if (write_all(fd, b.data, b.len) != (ssize_t)b.len) {
+				goto werr;
+			}
+			b.len = 0;
+		}
+	}
+	dictReleaseIterator(di);
+	di = NULL;
+	if (b.len && write_all(fd, b.data, b.len) != (ssize_t)b.len) {
+		goto werr;
+	}
+	if (data_fsync(fd) == -1 || close(fd) == -1) {
+		fd = -1;
+		goto werr;
+	}
+	buffer_free(&b);
+	return 0;
+
+werr:
+	printf ("Error writing %s for the AOF rewrite: %s\n", filename, strerror(errno));
+	if (di) dictReleaseIterator(di);
+	if (fd != -1) close(fd);
+	unlink(filename);
+	buffer_free(&b);
+	return -1;
+}
+
+// fork a child that writes the keyspace to a new file. -1 if a child is
+// already running or fork failed.
+int rewrite_append_only_file_background()
+{
+	char tmpfile[256];
+	pid_t pid;
+
+	if (has_active_child_process()) {
+		return -1;
+	}
+	pid = fork();
+	if (pid == 0) {
+		rewrite_temp_filename(tmpfile, sizeof(tmpfile), getpid());
+		_exit(rewrite_append_only_file(tmpfile) == 0 ? 0 : 1);
+	}
+	if (pid == -1) {
+		printf ("Can't rewrite the AOF in the background, fork: %s\n", strerror(errno));
+		return -1;
+	}
+	printf ("Background AOF rewrite started by pid %d\n", (int)pid);
+	g_server.aof_child_pid = pid;
+	// resizing would copy the whole table on write in the parent
+	dictDisableResize();
+	return 0;
+}
+
+// the child is gone: append what changed meanwhile to its file and put
+// the file in place of the old one
+void background_rewrite_done_handler(int exitcode, int bysignal)
+{
+	char tmpfile[256];
+	struct stat sb;
+	int newfd, oldfd;
+
+	rewrite_temp_filename(tmpfile, sizeof(tmpfile), g_server.aof_child_pid);
+	if (bysignal || exitcode != 0) {
+		printf ("Background AOF rewrite failed, %s %d\n",
+				bysignal ? "signal" : "exit code", bysignal ? bysignal : exitcode);
+		goto cleanup;
+	}
+
+	newfd = open(tmpfile, O_WRONLY | O_APPEND);
+	if (newfd == -1) {
+		printf ("Can't open %s after the AOF rewrite: %s\n", tmpfile, strerror(errno));
+		goto cleanup;
+	}
+	if (write_all(newfd, g_server.aof_rewrite_buf.data, g_server.aof_rewrite_buf.len) !=
+			(ssize_t)g_server.aof_rewrite_buf.len || fstat(newfd, &sb) == -1) {
+		printf ("Error writing %s after the AOF rewrite: %s\n", tmpfile, strerror(errno));
+		close(newfd);
+		goto cleanup;
+	}
+	if (rename(tmpfile, g_server.aof_filename) == -1) {
+		printf ("Can't rename %s to %s: %s\n", tmpfile, g_server.aof_filename, strerror(errno));
+		close(newfd);
+		goto cleanup;
+	}
+
+	// without appendonly the rewrite only made a file
+	if (g_server.aof_fd == -1) {
+		close(newfd);
+	} else {
+		oldfd = g_server.aof_fd;
+		g_server.aof_fd = newfd;
+		g_server.aof_current_size = sb.st_size;
+		g_server.aof_rewrite_base_size = sb.st_size;
+		g_server.aof_fsync_offset = sb.st_size;
+		if (g_server.aof_fsync == AOF_FSYNC_ALWAYS) {
+			data_fsync(newfd);
+		} else if (g_server.aof_fsync == AOF_FSYNC_EVERYSEC) {
+			bio_create_job(BIO_AOF_FSYNC, newfd);
+		}
+		// the rewrite buffer had all of it
+		g_server.aof_buf.len = 0;
+		// the old file has no name left, closing it frees its blocks,
+		// which takes a while for a big one
+		bio_create_job(BIO_CLOSE_FILE, oldfd);
+	}
+	printf ("Background AOF rewrite finished, %lld bytes\n", (long long)sb.st_size);
+
+cleanup:
+	unlink(tmpfile);
+	buffer_free(&g_server.aof_rewrite_buf);
+	g_server.aof_child_pid = -1;
+	dictEnableResize();
+}
+
+// the keyspace was replaced, by a replica's sync: the file doesn't lead
+// to it any more. a running rewrite has the old keyspace, it is killed.
+void restart_aof_rewrite()
+{
+	int statloc;
+
+	if (g_server.aof_child_pid != -1) {
+		kill(g_server.aof_child_pid, SIGKILL);
+		waitpid(g_server.aof_child_pid, &statloc, 0);
+		background_rewrite_done_handler(-1, SIGKILL);
+	}
+	// a background save may be running, aof_cron tries again
+	g_server.aof_rewrite_scheduled = (rewrite_append_only_file_background() == -1);
+}
+
+// reap the rewrite child, or start one when the file grew enough
+void aof_cron()
+{
+	long long base, growth;
+	int statloc;
+
+	if (g_server.aof_child_pid != -1) {
+		if (waitpid(g_server.aof_child_pid, &statloc, WNOHANG) == g_server.aof_child_pid) {
+			background_rewrite_done_handler(WIFEXITED(statloc) ? WEXITSTATUS(statloc) : -1,
+											WIFSIGNALED(statloc) ? WTERMSIG(statloc) : 0);
+		}
+		return;
+	}
+
+	if (g_server.aof_rewrite_scheduled && !has_active_child_process()) {
+		g_server.aof_rewrite_scheduled = (rewrite_append_only_file_background() == -1);
+		return;
+	}
+
+	if (g_server.aof_fd != -1 && g_server.aof_rewrite_perc &&
+		g_server.aof_current_size > g_server.aof_rewrite_min_size &&
+		!has_active_child_process()) {
+		base = g_server.aof_rewrite_base_size ? g_server.aof_rewrite_base_size : 1;
+		growth = (g_server.aof_current_size * 100 / base) - 100;
+		if (growth >= g_server.aof_rewrite_perc) {
+			printf ("Starting automatic AOF rewrite on %lld%% growth\n", growth);
+			rewrite_append_only_file_background();
+		}
+	}
+}
+
+// AOF_FSYNC_* for an --appendfsync value, -1 if unknown
+int aof_fsync_from_name(const char *name)
+{
+	if (strcasecmp(name, "always") == 0) return AOF_FSYNC_ALWAYS;
+	if (strcasecmp(name, "everysec") == 0) return AOF_FSYNC_EVERYSEC;
+	if (strcasecmp(name, "no") == 0) return AOF_FSYNC_NO;
+	return -1;
+}
+
+void command_bgrewriteaof(struct client *c)
+{
+	if (g_server.aof_child_pid != -1) {
+		addReplyError(c, "Background append only file rewriting already in progress");
+		return;
+	}
+	if (g_server.rdb_child_pid != -1) {
+		addReplyError(c, "Can't rewrite the AOF while a background save is in progress");
+		return;
+	}
+	if (rewrite_append_only_file_background() == -1) {
+		addReplyError(c, "Can't start the background AOF rewrite");
+		return;
+	}
+	addReplyStatus(c, "Background append only file rewriting started");
+}
@@ -0,0 +1,45 @@
+
+#ifndef _AOF_H
+#define _AOF_H
+
+#include <stddef.h>
+
+struct command;
+struct arg;
+struct client;
+
+// appendfsync policies
+#define AOF_FSYNC_NO		0	// let the kernel flush when it wants
+#define AOF_FSYNC_ALWAYS	1	// fsync before the replies go out
+#define AOF_FSYNC_EVERYSEC	2	// fsync once a second in the bio thread
+
+#define DEFAULT_AOF_FILENAME	"appendonly.aof"
+#define DEFAULT_AOF_FSYNC		AOF_FSYNC_EVERYSEC
+#define DEFAULT_AOF_REWRITE_PERC	100			// rewrite when grown by 100% since the last one
+#define DEFAULT_AOF_REWRITE_MIN_SIZE	(64*1024*1024)
+
+#define AOF_BUF_KEEP		(64*1024)		// larger buffers are freed once written
+#define AOF_LOAD_CHUNK		(64*1024*1024)	// bytes of the file parsed at a time
+#define AOF_FLUSH_POSTPONE_MAX	2			// seconds a write waits for a running fsync
+
+// commands waiting to be written
+struct aof_buffer{
+	char *data;
+	size_t len;
+	size_t size;
+};
+
+void cat_propagated_command(struct aof_buffer *b, struct command *cmd, int argc, struct arg *argv);
+void feed_append_only_file(const char *p, size_t len);
+void flush_append_only_file(int force);
+void flush_before_reply();
+void load_append_only_file();
+void open_append_only_file();
+int rewrite_append_only_file_background();
+void restart_aof_rewrite();
+void background_rewrite_done_handler(int exitcode, int bysignal);
+void aof_cron();
+int aof_fsync_from_name(const char *name);
+void command_bgrewriteaof(struct client *c);
+
+#endif
@@ -1,22 +1,458 @@
 
 #include "areactor.h"
+#include "zmalloc.h"
 #include "stdlib.h"
 #include "stdio.h"
+#include "string.h"
+#include <sys/time.h>
 #include "adlist.h"
 #include "anet.h"
 #include "network.h"
+#include "udp.h"
+#include "scan.h"
+#include "client.h"
+#include "db.h"
+#include "aof.h"
+#include "bio.h"
+#include "rdb.h"
+#include "replication.h"
+#include "pubsub.h"
+#include "upstream.h"
 
 struct server g_server;
 
+// return the UNIX time in microseconds
+long long ustime(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return ((long long)tv.tv_sec)*1000000 + tv.tv_usec;
+}
+
+// return the UNIX time in milliseconds
+long long mstime(void)
+{
+	return ustime()/1000;
+}
+
+// periodic housekeeping, called g_server.hz times per second
+int server_cron(struct aeEventLoop *eventLoop, long long id, void *clientData)
+{
+	NOTUSED(eventLoop);
+	NOTUSED(id);
+	NOTUSED(clientData);
+
+	g_server.unixtime = time(NULL);
+	g_server.lruclock = lru_clock();
+
+	clients_cron();
+	ratelimit_cron();
+	db_cron();
+	aof_cron();
+	rdb_cron();
+	upstream_cron();
+	if (g_server.cronloops % g_server.hz == 0) {
+		replication_cron();
+	}
+
+	g_server.cronloops++;
+	return 1000/g_server.hz;
+}
+
+// called every time the event loop is about to wait for events
+void before_sleep(struct aeEventLoop *eventLoop)
+{
+	NOTUSED(eventLoop);
+
+	free_clients_in_async_free_queue();
+	// before the replies go out, see flush_before_reply
+	flush_append_only_file(0);
+	db_before_sleep();
+}
+
+// a forked child is writing a snapshot of the keyspace
+int has_active_child_process()
+{
+	return g_server.aof_child_pid != -1 || g_server.rdb_child_pid != -1;
+}
+
 void init_server_config()
 {
 	g_server.port = DEFAULT_PORT;
 	g_server.bindaddr = NULL;
 	g_server.commands = NULL;
-	g_server.clients = listCreate();
+	g_server.numcommands = 0;
+	g_server.commands_size = 0;
+	g_server.db = NULL;
+	g_server.expires = NULL;
+	g_server.stat_expiredkeys = 0;
+	g_server.dirty = 0;
+	g_server.loading = 0;
+	g_server.loading_multi = NULL;
+	g_server.aof_enabled = 0;
+	g_server.aof_filename = DEFAULT_AOF_FILENAME;
+	g_server.aof_fsync = DEFAULT_AOF_FSYNC;
+	g_server.aof_rewrite_perc = DEFAULT_AOF_REWRITE_PERC;
+	g_server.aof_rewrite_min_size = DEFAULT_AOF_REWRITE_MIN_SIZE;
+	g_server.aof_fd = -1;
+	memset(&g_server.aof_buf, 0, sizeof(g_server.aof_buf));
+	memset(&g_server.aof_rewrite_buf, 0, sizeof(g_server.aof_rewrite_buf));
+	g_server.aof_child_pid = -1;
+	g_server.aof_current_size = 0;
+	g_server.aof_rewrite_base_size = 0;
+	g_server.aof_rewrite_scheduled = 0;
+	g_server.aof_fsync_offset = 0;
+	g_server.aof_last_fsync = time(NULL);
+	g_server.aof_flush_postponed_start = 0;
+	g_server.stat_aof_delayed_fsync = 0;
+	g_server.rdb_filename = DEFAULT_RDB_FILENAME;
+	g_server.rdb_child_pid = -1;
+	g_server.rdb_child_pipe = -1;
+	g_server.rdb_child_keys = 0;
+	g_server.rdb_child_total = 0;
+	g_server.rdb_child_cow = -1;
+	g_server.dirty_before_bgsave = 0;
+	g_server.lastsave = time(NULL);
+	g_server.lastbgsave_ok = 1;
+	g_server.master_repl_offset = 0;
+	g_server.repl_backlog_size = DEFAULT_REPL_BACKLOG_SIZE;
+	g_server.repl_backlog = NULL;
+	g_server.repl_backlog_histlen = 0;
+	g_server.replicas = NULL;
+	g_server.masterhost = NULL;
+	g_server.masterport = 0;
+	g_server.repl_state = REPL_STATE_NONE;
+	g_server.repl_transfer_s = -1;
+	g_server.repl_transfer_fd = -1;
+	g_server.repl_transfer_size = -1;
+	g_server.repl_transfer_read = 0;
+	g_server.repl_transfer_lastio = 0;
+	g_server.master = NULL;
+	g_server.current_client = NULL;
+	g_server.pubsub_channels = NULL;
+	g_server.pubsub_hard_limit = DEFAULT_PUBSUB_HARD_LIMIT;
+	g_server.pubsub_soft_limit = DEFAULT_PUBSUB_SOFT_LIMIT;
+	g_server.pubsub_soft_seconds = DEFAULT_PUBSUB_SOFT_SECONDS;
+	g_server.maxmemory = 0;
+	g_server.maxmemory_policy = DEFAULT_MAXMEMORY_POLICY;
+	g_server.maxmemory_samples = DEFAULT_MAXMEMORY_SAMPLES;
+	g_server.lfu_log_factor = DEFAULT_LFU_LOG_FACTOR;
+	g_server.lfu_decay_time = DEFAULT_LFU_DECAY_TIME;
+	g_server.lruclock = lru_clock();
+	g_server.stat_evictedkeys = 0;
+	g_server.upstream_host = DEFAULT_UPSTREAM_HOST;
+	g_server.upstream_port = DEFAULT_UPSTREAM_PORT;
+	g_server.upstream_timeout = DEFAULT_UPSTREAM_TIMEOUT;
+	g_server.upstream_calls = NULL;
+	g_server.stat_sa_coalesced = 0;
+	g_server.sa_cache = NULL;
+	g_server.sa_cache_ttl = DEFAULT_SA_CACHE_TTL;
+	g_server.sa_cache_max_bytes = DEFAULT_SA_CACHE_MAX_BYTES;
+	g_server.sa_cache_bytes = 0;
+	g_server.stat_sa_cache_hits = 0;
+	g_server.stat_sa_cache_misses = 0;
+	g_server.stat_sa_cache_evictions = 0;
+	g_server.cmd_clock = 0;
+	g_server.stat_error_replies = 0;
+	g_server.slowlog_log_slower_than = DEFAULT_SLOWLOG_LOG_SLOWER_THAN;
+	g_server.slowlog_max_len = DEFAULT_SLOWLOG_MAX_LEN;
+	memset(&g_server.tcp_opts, 0, sizeof(g_server.tcp_opts));
+	memset(&g_server.udp_opts, 0, sizeof(g_server.udp_opts));
+	g_server.tcp_opts.nodelay = 1;
+	g_server.udp_port = 0;
+	g_server.udp_fd = -1;
+	g_server.udp_batch = NULL;
+	g_server.udp_client = NULL;
+	g_server.stat_udp_datagrams = 0;
+	g_server.stat_udp_syscalls = 0;
+	g_server.stat_udp_dropped = 0;
+	g_server.hz = DEFAULT_HZ;
+	g_server.scan_impl_forced = 0;
+	g_server.maxidletime = DEFAULT_MAXIDLETIME;
+	g_server.tcpkeepalive = DEFAULT_TCP_KEEPALIVE;
+	memset(&g_server.ratelimit, 0, sizeof(g_server.ratelimit));
+	g_server.stat_rejected_conns = 0;
+	g_server.stat_rejected_requests = 0;
+}
+
+static void usage()
+{
+	printf ("Usage: ./out [--port <port>] [--bind <addr>] [--udp-port <port>] [--timeout <seconds>]\n"
+			"             [--tcp-keepalive <seconds>] [--hz <n>]\n"
+			"             [--maxconn-per-ip <n>] [--accept-rate <n/s>] [--accept-burst <n>]\n"
+			"             [--request-rate <n/s>] [--request-burst <n>]\n"
+			"             [--tcp-rcvbuf <bytes>] [--tcp-sndbuf <bytes>] [--tcp-nodelay yes|no]\n"
+			"             [--tcp-quickack yes|no] [--tcp-notsent-lowat <bytes>]\n"
+			"             [--tcp-busy-poll <usec>] [--tcp-defer-accept <seconds>]\n"
+			"             [--udp-rcvbuf <bytes>] [--udp-sndbuf <bytes>] [--udp-busy-poll <usec>]\n"
+			"             [--scan-impl auto|avx2|sse2|scalar]\n"
+			"             [--slowlog-log-slower-than <usec>] [--slowlog-max-len <n>]\n"
+			"             [--appendonly yes|no] [--appendfilename <file>]\n"
+			"             [--appendfsync always|everysec|no]\n"
+			"             [--auto-aof-rewrite-percentage <n>] [--auto-aof-rewrite-min-size <bytes>]\n"
+			"             [--dbfilename <file>]\n"
+			"             [--replicaof <host>:<port>] [--repl-backlog-size <bytes>]\n"
+			"             [--pubsub-hard-limit <bytes>] [--pubsub-soft-limit <bytes>]\n"
+			"             [--pubsub-soft-seconds <n>]\n"
+			"             [--maxmemory <bytes>] [--maxmemory-policy <policy>]\n"
+			"             [--maxmemory-samples <n>] [--lfu-log-factor <n>] [--lfu-decay-time <minutes>]\n"
+			"             [--upstream <host>:<port>] [--upstream-timeout <ms>]\n"
+			"             [--sa-cache-ttl <ms>] [--sa-cache-size <bytes>]\n");
+	exit(1);
+}
+
+static int yesnotoi(char *s)
+{
+	if (strcasecmp(s, "yes") == 0) return 1;
+	if (strcasecmp(s, "no") == 0) return 0;
+	printf ("Expected yes or no, got '%s'\n", s);
+	usage();
+	return -1;
+}
+
+// options come in "--name value" pairs, e.g. ./out --port 5555 --timeout 300
+void load_server_config(int argc, char **argv)
+{
+	int j;
+	char *name, *value, *p;
+
+	for (j = 1; j < argc; j += 2) {
+		name = argv[j];
+		value = (j+1 < argc) ? argv[j+1] : NULL;
+		if (strncmp(name, "--", 2) != 0 || value == NULL) {
+			usage();
+		}
+		name += 2;
+
+		if (strcasecmp(name, "port") == 0) {
+			g_server.port = atoi(value);
+		} else if (strcasecmp(name, "bind") == 0) {
+			g_server.bindaddr = value;
+		} else if (strcasecmp(name, "udp-port") == 0) {
+			g_server.udp_port = atoi(value);
+		} else if (strcasecmp(name, "timeout") == 0) {
+			g_server.maxidletime = atoi(value);
+		} else if (strcasecmp(name, "tcp-keepalive") == 0) {
+			g_server.tcpkeepalive = atoi(value);
+		} else if (strcasecmp(name, "hz") == 0) {
+			g_server.hz = atoi(value);
+		} else if (strcasecmp(name, "maxconn-per-ip") == 0) {
+			g_server.ratelimit.maxconn_per_ip = atoi(value);
+		} else if (strcasecmp(name, "accept-rate") == 0) {
+			g_server.ratelimit.accept_rate = atoi(value);
+		} else if (strcasecmp(name, "accept-burst") == 0) {
+			g_server.ratelimit.accept_burst = atoi(value);
+		} else if (strcasecmp(name, "request-rate") == 0) {
+			g_server.ratelimit.request_rate = atoi(value);
+		} else if (strcasecmp(name, "request-burst") == 0) {
+			g_server.ratelimit.request_burst = atoi(value);
+		} else if (strcasecmp(name, "tcp-rcvbuf") == 0) {
+			g_server.tcp_opts.rcvbuf = atoi(value);
+		} else if (strcasecmp(name, "tcp-sndbuf") == 0) {
+			g_server.tcp_opts.sndbuf = atoi(value);
+		} else if (strcasecmp(name, "tcp-nodelay") == 0) {
+			g_server.tcp_opts.nodelay = yesnotoi(value);
+		} else if (strcasecmp(name, "tcp-quickack") == 0) {
+			g_server.tcp_opts.quickack = yesnotoi(value);
+		} else if (strcasecmp(name, "tcp-notsent-lowat") == 0) {
+			g_server.tcp_opts.notsent_lowat = atoi(value);
+		} else if (strcasecmp(name, "tcp-busy-poll") == 0) {
+			g_server.tcp_opts.busy_poll = atoi(value);
+		} else if (strcasecmp(name, "tcp-defer-accept") == 0) {
+			g_server.tcp_opts.defer_accept = atoi(value);
+		} else if (strcasecmp(name, "udp-rcvbuf") == 0) {
+			g_server.udp_opts.rcvbuf = atoi(value);
+		} else if (strcasecmp(name, "udp-sndbuf") == 0) {
+			g_server.udp_opts.sndbuf = atoi(value);
+		} else if (strcasecmp(name, "udp-busy-poll") == 0) {
+			g_server.udp_opts.busy_poll = atoi(value);
+		} else if (strcasecmp(name, "scan-impl") == 0) {
+			// the parser picks the fastest one by itself, this is for testing
+			scan_init();
+			if (strcasecmp(value, "auto") != 0 && scan_set_impl(value) == -1) {
+				printf ("scan-impl '%s' is unknown or not supported by this cpu\n", value);
+				exit(1);
+			}
+			g_server.scan_impl_forced = (strcasecmp(value, "auto") != 0);
+		} else if (strcasecmp(name, "slowlog-log-slower-than") == 0) {
+			g_server.slowlog_log_slower_than = atoll(value);
+		} else if (strcasecmp(name, "slowlog-max-len") == 0) {
+			g_server.slowlog_max_len = atoi(value);
+		} else if (strcasecmp(name, "appendonly") == 0) {
+			g_server.aof_enabled = yesnotoi(value);
+		} else if (strcasecmp(name, "appendfilename") == 0) {
+			g_server.aof_filename = value;
+		} else if (strcasecmp(name, "appendfsync") == 0) {
+			if ((g_server.aof_fsync = aof_fsync_from_name(value)) == -1) {
+				printf ("appendfsync must be always, everysec or no\n");
+				exit(1);
+			}
+		} else if (strcasecmp(name, "auto-aof-rewrite-percentage") == 0) {
+			g_server.aof_rewrite_perc = atoi(value);
+		} else if (strcasecmp(name, "auto-aof-rewrite-min-size") == 0) {
+			g_server.aof_rewrite_min_size = atoll(value);
+		} else if (strcasecmp(name, "dbfilename") == 0) {
+			g_server.rdb_filename = value;
+		} else if (strcasecmp(name, "replicaof") == 0) {
+			// one value per option, host and port go together
+			if ((p = strrchr(value, ':')) == NULL || p == value) {
+				printf ("replicaof must be <host>:<port>\n");
+				exit(1);
+			}
+			*p = '\0';
+			g_server.masterhost = value;
+			g_server.masterport = atoi(p + 1);
+			g_server.repl_state = REPL_STATE_CONNECT;
+		} else if (strcasecmp(name, "repl-backlog-size") == 0) {
+			g_server.repl_backlog_size = atoll(value);
+		} else if (strcasecmp(name, "pubsub-hard-limit") == 0) {
+			g_server.pubsub_hard_limit = atoll(value);
+		} else if (strcasecmp(name, "pubsub-soft-limit") == 0) {
+			g_server.pubsub_soft_limit = atoll(value);
+		} else if (strcasecmp(name, "pubsub-soft-seconds") == 0) {
+			g_server.pubsub_soft_seconds = atoi(value);
+		} else if (strcasecmp(name, "maxmemory") == 0) {
+			g_server.maxmemory = atoll(value);
+		} else if (strcasecmp(name, "maxmemory-policy") == 0) {
+			if ((g_server.maxmemory_policy = evict_policy_from_name(value)) == -1) {
+				printf ("maxmemory-policy must be noeviction, allkeys-lru, allkeys-lfu, allkeys-random,\n"
+						"volatile-lru, volatile-lfu, volatile-random or volatile-ttl\n");
+				exit(1);
+			}
+		} else if (strcasecmp(name, "maxmemory-samples") == 0) {
+			g_server.maxmemory_samples = atoi(value);
+		} else if (strcasecmp(name, "lfu-log-factor") == 0) {
+			g_server.lfu_log_factor = atoi(value);
+		} else if (strcasecmp(name, "lfu-decay-time") == 0) {
+			g_server.lfu_decay_time = atoi(value);
+		} else if (strcasecmp(name, "upstream") == 0) {
+			if ((p = strrchr(value, ':')) == NULL || p == value) {
+				printf ("upstream must be <host>:<port>\n");
+				exit(1);
+			}
+			*p = '\0';
+			g_server.upstream_host = value;
+			g_server.upstream_port = atoi(p + 1);
+		} else if (strcasecmp(name, "upstream-timeout") == 0) {
+			g_server.upstream_timeout = atoll(value);
+		} else if (strcasecmp(name, "sa-cache-ttl") == 0) {
+			g_server.sa_cache_ttl = atoll(value);
+		} else if (strcasecmp(name, "sa-cache-size") == 0) {
+			g_server.sa_cache_max_bytes = atoll(value);
+		} else {
+			printf ("Unknown option --%s\n", name);
+			usage();
+		}
+	}
+
+	if (g_server.maxidletime < 0 || g_server.tcpkeepalive < 0) {
+		printf ("timeout and tcp-keepalive can't be negative\n");
+		exit(1);
+	}
+	if (g_server.ratelimit.maxconn_per_ip < 0 || g_server.ratelimit.accept_rate < 0 ||
+		g_server.ratelimit.accept_burst < 0 || g_server.ratelimit.request_rate < 0 ||
+		g_server.ratelimit.request_burst < 0) {
+		printf ("rate limits can't be negative\n");
+		exit(1);
+	}
+	// the burst defaults to the rate
+	if (g_server.ratelimit.accept_rate > RATELIMIT_MAX_BURST ||
+		g_server.ratelimit.accept_burst > RATELIMIT_MAX_BURST ||
+		g_server.ratelimit.request_rate > RATELIMIT_MAX_BURST ||
+		g_server.ratelimit.request_burst > RATELIMIT_MAX_BURST) {
+		printf ("rates and bursts can't be over %d\n", RATELIMIT_MAX_BURST);
+		exit(1);
+	}
+	if (g_server.slowlog_max_len < 0) {
+		printf ("slowlog-max-len can't be negative\n");
+		exit(1);
+	}
+	if (g_server.aof_rewrite_perc < 0 || g_server.aof_rewrite_min_size < 0) {
+		printf ("auto-aof-rewrite-percentage and auto-aof-rewrite-min-size can't be negative\n");
+		exit(1);
+	}
+	if (g_server.masterhost != NULL && (g_server.masterport <= 0 || g_server.masterport > 65535)) {
+		printf ("replicaof has a bad port\n");
+		exit(1);
+	}
+	if (g_server.repl_backlog_size < 16*1024) {
+		printf ("repl-backlog-size must be 16kb at least\n");
+		exit(1);
+	}
+	if (g_server.pubsub_hard_limit < 0 || g_server.pubsub_soft_limit < 0 ||
+		g_server.pubsub_soft_seconds < 0) {
+		printf ("pubsub output limits can't be negative\n");
+		exit(1);
+	}
+	if (g_server.maxmemory < 0 || g_server.lfu_log_factor < 0 || g_server.lfu_decay_time < 0) {
+		printf ("maxmemory, lfu-log-factor and lfu-decay-time can't be negative\n");
+		exit(1);
+	}
+	if (g_server.upstream_port <= 0 || g_server.upstream_port > 65535) {
+		printf ("upstream has a bad port\n");
+		exit(1);
+	}
+	if (g_server.upstream_timeout < 1) {
+		printf ("upstream-timeout must be 1 ms at least\n");
+		exit(1);
+	}
+	if (g_server.sa_cache_ttl < 0 || g_server.sa_cache_max_bytes < 0) {
+		printf ("sa-cache-ttl and sa-cache-size can't be negative\n");
+		exit(1);
+	}
+	if (g_server.maxmemory_samples < 1 || g_server.maxmemory_samples > 64) {
+		printf ("maxmemory-samples must be between 1 and 64\n");
+		exit(1);
+	}
+	if (g_server.hz < 1 || g_server.hz > 500) {
+		printf ("hz must be between 1 and 500\n");
+		exit(1);
+	}
+}
+
+void init_server()
+{
+	g_server.unixtime = time(NULL);
+	g_server.cronloops = 0;
+	ilistInit(&g_server.clients);
+	if (init_command_table() == -1) {
+		printf ("Can't build the command table\n");
+		exit(1);
+	}
+	pool_init(&g_server.client_pool, sizeof(struct client), CLIENT_POOL_SLAB, 0);
+	pool_init(&g_server.buf_pool, LEN, 1, BUFFER_POOL_MAX_FREE);
+	g_server.readbuf = (char *)zmalloc(LEN + PROTO_READ_LEN);
+	if (g_server.readbuf == NULL) {
+		printf ("Can't allocate the read buffer\n");
+		exit(1);
+	}
+	ratelimit_init();
+	slowlog_init();
+	db_init();
+	bio_init();
+	g_server.replicas = listCreate();
+	g_server.clients_to_close = listCreate();
+	if (g_server.replicas == NULL || g_server.clients_to_close == NULL) {
+		printf ("Can't create the client lists\n");
+		exit(1);
+	}
+	pubsub_init();
+	upstream_init();
+	if (!g_server.scan_impl_forced) {
+		scan_init();
+	}
 	g_server.el = aeCreateEventLoop(100 + 1024);
 	if (g_server.el == NULL) {
 		printf ("el error\n");
+		exit(1);
+	}
+	aeSetBeforeSleepProc(g_server.el, before_sleep);
+	// a client fd can't be over the setsize, ae refuses to watch it
+	g_server.clients_by_fd = (struct client **)zcalloc(g_server.el->setsize * sizeof(struct client *));
+	if (g_server.clients_by_fd == NULL) {
+		printf ("Can't allocate the client table\n");
+		exit(1);
 	}
 
 	// create tcp server
@@ -25,6 +461,9 @@ void init_server_config()
 		printf ("socket error\n");
 		exit(1);
 	}
+	// acceptTcpHandler accepts until EAGAIN, so it must not block
+	anetNonBlock(NULL, g_server.socket_fd);
+	apply_listener_options(g_server.socket_fd, &g_server.tcp_opts);
 
 	// binding acceptTcpHandler to client connected. 
 	if (g_server.socket_fd > 0) {
@@ -33,11 +472,34 @@ void init_server_config()
 			exit(1);
 		}
 	}
+
+	// stateless requests over datagrams
+	if (g_server.udp_port) {
+		udp_init();
+	}
+
+	// the keyspace comes back before any client is served. the AOF has
+	// the latest writes, the snapshot is used only without it.
+	if (g_server.aof_enabled) {
+		load_append_only_file();
+		open_append_only_file();
+	} else if (rdb_load(g_server.rdb_filename) == -1) {
+		printf ("Can't load the snapshot %s\n", g_server.rdb_filename);
+		exit(1);
+	}
+
+	// cron for idle clients and other background jobs
+	if (aeCreateTimeEvent(g_server.el, 1, server_cron, NULL, NULL) == AE_ERR) {
+		printf ("Can't create the server_cron time event\n");
+		exit(1);
+	}
 }
 
 int main(int argc, char **argv)
 {
 	init_server_config();
+	load_server_config(argc, argv);
+	init_server();
 
 	aeMain(g_server.el);
 	
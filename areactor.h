@@ -6,25 +6,189 @@
 #include "adlist.h"
 #include "anet.h"
 #include "command.h"
+#include "ratelimit.h"
+#include "pool.h"
+#include "slowlog.h"
+#include "dict.h"
+#include "aof.h"
+#include "rdb.h"
+#include "replication.h"
+#include "pubsub.h"
+#include "evict.h"
+#include "upstream.h"
+#include <sys/types.h>
 
 #define DEFAULT_PORT	5555
+#define DEFAULT_MAXIDLETIME	0		// seconds, 0 = never close idle clients
+#define DEFAULT_TCP_KEEPALIVE	300	// seconds, 0 = SO_KEEPALIVE off
+#define DEFAULT_HZ	10				// server_cron calls per second
+#define CLIENTS_CRON_MIN_ITERATIONS	50	// clients checked per cron at least
+#define MAX_ACCEPTS_PER_CALL	1000	// connections accepted per readable event
+
+// socket options of one listener, applied to every socket it accepts
+struct sockopts{
+	int rcvbuf;			// SO_RCVBUF in bytes, 0 = system default
+	int sndbuf;			// SO_SNDBUF in bytes, 0 = system default
+	int nodelay;		// TCP_NODELAY
+	int quickack;		// TCP_QUICKACK, re-armed after every read
+	int notsent_lowat;	// TCP_NOTSENT_LOWAT in bytes, 0 = system default
+	int busy_poll;		// SO_BUSY_POLL in usec, 0 = off
+	int defer_accept;	// TCP_DEFER_ACCEPT in seconds on the listening socket, 0 = off
+	int warned;			// a failure was already logged
+};
 
 struct server{
 	int port;		// socket port 
 	int socket_fd;	// socket fd
+	struct sockopts tcp_opts;	// for the tcp listener and its clients
+	struct sockopts udp_opts;	// rcvbuf, sndbuf and busy_poll of the udp socket
 	char *bindaddr;             //Bind address or NULL 
 	char neterr[ANET_ERR_LEN];  //Error buffer for anet.c 
 
-	struct command *commands;	// commands
+	// udp listener, off when udp_port is 0
+	int udp_port;
+	int udp_fd;
+	struct udp_batch *udp_batch;	// recvmmsg/sendmmsg buffers
+	struct client *udp_client;		// runs the commands of every datagram
+	long long stat_udp_datagrams;	// datagrams received
+	long long stat_udp_syscalls;	// recv/send calls made for them
+	long long stat_udp_dropped;		// truncated requests, unsent replies
+
+	// registered commands, looked up through the hash in command.c
+	struct command **commands;
+	int numcommands;
+	int commands_size;		// allocated slots of commands
+	long long cmd_clock;	// when the last command ended, see process_command
+	long long stat_error_replies;	// -ERR replies sent
+
+	// slowlog
+	long long slowlog_log_slower_than;	// microseconds, -1 = off
+	int slowlog_max_len;
+	struct slowlog slowlog;
+
+	// keyspace, see db.c
+	dict *db;
+	dict *expires;		// keys with a ttl -> unix time in ms
+	long long stat_expiredkeys;
+	long long dirty;	// changes to the keyspace, commands add to it
+	int loading;		// replaying the AOF
+	char *loading_multi;	// where the last MULTI replayed starts, in the mapped AOF
+
+	// append only file, see aof.c
+	int aof_enabled;		// --appendonly
+	char *aof_filename;
+	int aof_fsync;			// AOF_FSYNC_*
+	int aof_rewrite_perc;	// rewrite when grown by this % since the last one, 0 = never
+	long long aof_rewrite_min_size;	// but not while smaller than this
+	int aof_fd;				// -1 when not appending
+	struct aof_buffer aof_buf;		// written in before_sleep
+	struct aof_buffer aof_rewrite_buf;	// changes since the rewrite child forked
+	pid_t aof_child_pid;	// -1 if no rewrite is running
+	long long aof_current_size;
+	long long aof_rewrite_base_size;	// size after the last rewrite or at startup
+	int aof_rewrite_scheduled;		// start a rewrite once no child runs
+	long long aof_fsync_offset;		// aof_current_size at the last fsync
+	time_t aof_last_fsync;
+	time_t aof_flush_postponed_start;	// a write waits for a running fsync since, 0 = not
+	long long stat_aof_delayed_fsync;	// writes that didn't wait for the fsync
+
+	// snapshots, see rdb.c
+	char *rdb_filename;		// --dbfilename
+	pid_t rdb_child_pid;	// -1 if no background save is running
+	int rdb_child_pipe;		// progress from the child, -1 if none
+	long long rdb_child_keys;	// keys the child said it saved
+	long long rdb_child_total;	// keys it has to save
+	long long rdb_child_cow;	// bytes the child copied on write, -1 if unknown
+	long long dirty_before_bgsave;
+	time_t lastsave;		// unix time of the last successful save
+	int lastbgsave_ok;
+
+	// replication, see replication.c
+	long long master_repl_offset;	// stream bytes fed on a primary, applied on a replica
+	long long repl_backlog_size;	// --repl-backlog-size
+	char *repl_backlog;				// ring of the last stream bytes, NULL until a SYNC
+	long long repl_backlog_histlen;	// bytes of the stream it has
+	list *replicas;					// clients that sent SYNC
+	char *masterhost;				// --replicaof, NULL on a primary
+	int masterport;
+	int repl_state;					// REPL_STATE_*
+	int repl_transfer_s;			// socket to the primary while syncing, -1 if none
+	int repl_transfer_fd;			// the snapshot being received, -1 if none
+	long long repl_transfer_size;	// -1 until its size is read
+	long long repl_transfer_read;
+	time_t repl_transfer_lastio;
+	struct client *master;			// runs the stream, NULL if not connected
+	struct client *current_client;	// running a command, NULL if none
+
+	// pub/sub, see pubsub.c
+	dict *pubsub_channels;			// channel -> list of subscribed clients
+	long long pubsub_hard_limit;	// output bytes a subscriber may have pending
+	long long pubsub_soft_limit;	// or for pubsub_soft_seconds at most
+	int pubsub_soft_seconds;
+
+	// memory limit, see evict.c
+	long long maxmemory;		// bytes zmalloc may count, 0 = no limit
+	int maxmemory_policy;		// MAXMEMORY_*
+	int maxmemory_samples;		// keys sampled per eviction
+	int lfu_log_factor;			// how slow the LFU counter grows
+	int lfu_decay_time;			// minutes for the LFU counter to lose 1, 0 = never
+	unsigned int lruclock;		// lru_clock(), refreshed by server_cron
+	long long stat_evictedkeys;
+
+	// the upstream of SA and its answers cache, see upstream.c
+	char *upstream_host;			// --upstream
+	int upstream_port;
+	long long upstream_timeout;		// ms for an answer
+	dict *upstream_calls;			// request bytes -> struct upstream_call in flight
+	long long stat_sa_coalesced;	// requests that joined a call in flight
+	dict *sa_cache;					// request bytes -> struct sa_cache_entry
+	ilist sa_cache_order;			// entries, oldest first
+	long long sa_cache_ttl;			// ms an answer is reused, 0 = no cache
+	long long sa_cache_max_bytes;	// 0 = no cache
+	long long sa_cache_bytes;		// allocated by the entries
+	long long stat_sa_cache_hits;
+	long long stat_sa_cache_misses;
+	long long stat_sa_cache_evictions;	// dropped to make room, not expired
 
 	// event loop 
 	aeEventLoop *el;
-	list *clients; 		//clients
+	ilist clients; 		//clients, linked through client->client_node
+	struct client **clients_by_fd;	// el->setsize slots, NULL if no client
+	list *clients_to_close;		// freed in before_sleep, see free_client_async
+
+	// memory of the clients. buf_pool hands out the LEN reply buffers,
+	// attached only while a client has replies pending. every read goes
+	// to readbuf: LEN bytes for an unfinished request, then PROTO_READ_LEN
+	// for new data.
+	struct pool client_pool;
+	struct pool buf_pool;
+	char *readbuf;
+
+	// cron & timeouts
+	int hz;				// server_cron frequency
+	time_t unixtime;	// cached unix time, refreshed by server_cron
+	long long cronloops;	// number of times the cron function run
+	int maxidletime;	// close clients idle for more than N seconds, 0 = never
+	int tcpkeepalive;	// keepalive probe interval for clients, 0 = off
+	int scan_impl_forced;	// --scan-impl given, don't pick by cpu
+
+	// per-ip admission control
+	struct ratelimit_config ratelimit;
+	struct ipbucket_table ipbuckets;
+	long long stat_rejected_conns;		// connections refused by the limits
+	long long stat_rejected_requests;	// requests refused by the limits
 };
 
 
 extern struct server g_server;
 
+long long ustime(void);
+long long mstime(void);
+void init_server_config();
+void load_server_config(int argc, char **argv);
+void init_server();
+int has_active_child_process();
+
 
 #endif
 
@@ -0,0 +1,456 @@
+// areactor-benchmark: load generator for the server. opens many
+// connections on one aeEventLoop, each sends a batch of pipelined
+// requests, waits for all the replies and sends the next one. reports
+// the throughput and the latency percentiles of every command in the mix,
+// a request's latency going from the write of its batch to its reply.
+//
+//   make bench/areactor-benchmark
+//   ./bench/areactor-benchmark [--host 127.0.0.1] [--port 5555] [--clients 50]
+//       [--pipeline 1] [--mix get:50,set:50] [--size 16] [--keyspace 100000]
+//       [--duration 10]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/time.h>
+#include "../ae.h"
+#include "../anet.h"
+#include "../hist.h"
+
+#define MAX_MIX		8
+#define READ_LEN	(16*1024)
+
+// commands the mix can have, with how their request is built
+#define REQ_KEY		(1<<0)	// the name, then a random key
+#define REQ_VALUE	(1<<1)	// then the payload
+
+static struct {
+	const char *name;
+	int args;
+} known_commands[] = {
+	{"get", REQ_KEY},
+	{"set", REQ_KEY | REQ_VALUE},
+	{"del", REQ_KEY},
+	{"exists", REQ_KEY},
+	{"sa", REQ_VALUE},
+	{"num", 0},
+};
+
+struct mix_entry{
+	const char *name;
+	int args;
+	int weight;
+	long long calls;
+	long long errors;	// -ERR replies
+	struct hist latency;	// usec
+};
+
+// one connection
+struct bclient{
+	int fd;
+	char *obuf;			// requests of the batch
+	size_t olen;
+	size_t opos;		// bytes of it written
+	char *ibuf;			// replies read, not parsed yet
+	size_t ilen;
+	size_t isize;
+	int sent;			// requests in the batch
+	int replies;		// replies to it read so far
+	int *cmds;			// mix entry of every request in the batch
+	long long start;	// usec the batch was written at
+};
+
+static struct {
+	char *host;
+	int port;
+	int clients;
+	int pipeline;
+	int size;
+	long keyspace;
+	int duration;		// seconds
+	struct mix_entry mix[MAX_MIX];
+	int nmix;
+	int total_weight;
+
+	aeEventLoop *el;
+	struct bclient *conns;
+	char *payload;
+	long long start;
+	long long requests;
+	long long last_requests;	// at the last progress line
+	int stopping;
+} cfg;
+
+static long long ustime(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return ((long long)tv.tv_sec)*1000000 + tv.tv_usec;
+}
+
+static void usage(const char *prog)
+{
+	printf("usage: %s [--host <addr>] [--port <port>] [--clients <n>] [--pipeline <n>]\n"
+		   "       [--mix <cmd>:<weight>,...] [--size <bytes>] [--keyspace <n>] [--duration <seconds>]\n"
+		   "commands: get set del exists sa num\n", prog);
+	exit(1);
+}
+
+// "get:80,set:20", a command without a weight counts 1
+static void parse_mix(const char *prog, char *s)
+{
+	char *tok, *colon;
+	unsigned int j;
+
+	cfg.nmix = 0;
+	cfg.total_weight = 0;
+	for (tok = strtok(s, ","); tok != NULL; tok = strtok(NULL, ",")) {
+		if (cfg.nmix == MAX_MIX) {
+			usage(prog);
+		}
+		if ((colon = strchr(tok, ':')) != NULL) {
+			*colon = '\0';
+		}
+		for (j = 0; j < sizeof(known_commands)/sizeof(known_commands[0]); j++) {
+			if (strcasecmp(tok, known_commands[j].name) == 0) break;
+		}
+		if (j == sizeof(known_commands)/sizeof(known_commands[0])) {
+			printf("unknown command '%s' in the mix\n", tok);
+			usage(prog);
+		}
+		cfg.mix[cfg.nmix].name = known_commands[j].name;
+		cfg.mix[cfg.nmix].args = known_commands[j].args;
+		cfg.mix[cfg.nmix].weight = colon ? atoi(colon + 1) : 1;
+		if (cfg.mix[cfg.nmix].weight <= 0) {
+			usage(prog);
+		}
+		hist_reset(&cfg.mix[cfg.nmix].latency);
+		cfg.total_weight += cfg.mix[cfg.nmix].weight;
+		cfg.nmix++;
+	}
+	if (cfg.nmix == 0) {
+		usage(prog);
+	}
+}
+
+static int pick_command()
+{
+	int r = rand() % cfg.total_weight, j;
+
+	for (j = 0; j < cfg.nmix - 1; j++) {
+		if (r < cfg.mix[j].weight) break;
+		r -= cfg.mix[j].weight;
+	}
+	return j;
+}
+
+// append "$<len>\r\n<s>\r\n" to the batch of bc
+static void add_bulk(struct bclient *bc, const char *s, size_t len)
+{
+	bc->olen += sprintf(bc->obuf + bc->olen, "$%zu\r\n", len);
+	memcpy(bc->obuf + bc->olen, s, len);
+	bc->olen += len;
+	memcpy(bc->obuf + bc->olen, "\r\n", 2);
+	bc->olen += 2;
+}
+
+// the next batch of requests, written when the socket is writable
+static void build_batch(struct bclient *bc)
+{
+	struct mix_entry *m;
+	char key[32];
+	int j, keylen;
+
+	bc->olen = bc->opos = 0;
+	for (j = 0; j < cfg.pipeline; j++) {
+		bc->cmds[j] = pick_command();
+		m = &cfg.mix[bc->cmds[j]];
+		bc->olen += sprintf(bc->obuf + bc->olen, "*%d\r\n",
+							1 + !!(m->args & REQ_KEY) + !!(m->args & REQ_VALUE));
+		add_bulk(bc, m->name, strlen(m->name));
+		if (m->args & REQ_KEY) {
+			keylen = snprintf(key, sizeof(key), "key:%ld", random() % cfg.keyspace);
+			add_bulk(bc, key, keylen);
+		}
+		if (m->args & REQ_VALUE) {
+			add_bulk(bc, cfg.payload, cfg.size);
+		}
+	}
+	bc->sent = cfg.pipeline;
+	bc->replies = 0;
+}
+
+// bytes a reply at p takes, 0 if it isn't complete yet, -1 if it isn't
+// a reply
+static long reply_length(char *p, char *end)
+{
+	char *nl;
+	long len, n, j, sub;
+
+	if (p == end) {
+		return 0;
+	}
+	if ((nl = memchr(p, '\n', end - p)) == NULL) {
+		return 0;
+	}
+	len = nl + 1 - p;
+	switch (*p) {
+	case '+':
+	case '-':
+	case ':':
+		return len;
+	case '$':
+		n = atol(p + 1);
+		if (n < 0) return len;
+		if (end - p < len + n + 2) return 0;
+		return len + n + 2;
+	case '*':
+		n = atol(p + 1);
+		for (j = 0; j < n; j++) {
+			if ((sub = reply_length(p + len, end)) <= 0) return sub;
+			len += sub;
+		}
+		return len;
+	default:
+		return -1;
+	}
+}
+
+static void write_handler(aeEventLoop *el, int fd, void *privdata, int mask);
+
+// take the complete replies out of ibuf. once the batch has them all
+// the next one goes out.
+static void process_replies(struct bclient *bc)
+{
+	long long now = ustime();
+	struct mix_entry *m;
+	size_t pos = 0;
+	long len;
+
+	while (bc->replies < bc->sent) {
+		len = reply_length(bc->ibuf + pos, bc->ibuf + bc->ilen);
+		if (len == 0) break;
+		if (len == -1) {
+			printf("protocol error from the server\n");
+			exit(1);
+		}
+		m = &cfg.mix[bc->cmds[bc->replies]];
+		m->calls++;
+		if (bc->ibuf[pos] == '-') m->errors++;
+		hist_record(&m->latency, now - bc->start);
+		bc->replies++;
+		cfg.requests++;
+		pos += len;
+	}
+	memmove(bc->ibuf, bc->ibuf + pos, bc->ilen - pos);
+	bc->ilen -= pos;
+
+	if (bc->replies == bc->sent && !cfg.stopping) {
+		build_batch(bc);
+		if (aeCreateFileEvent(cfg.el, bc->fd, AE_WRITABLE, write_handler, bc) == AE_ERR) {
+			printf("can't watch a connection\n");
+			exit(1);
+		}
+	}
+}
+
+static void read_handler(aeEventLoop *el, int fd, void *privdata, int mask)
+{
+	struct bclient *bc = (struct bclient *)privdata;
+	ssize_t nread;
+
+	(void)el;
+	(void)mask;
+	if (bc->isize - bc->ilen < READ_LEN) {
+		bc->isize = bc->ilen + READ_LEN * 2;
+		if ((bc->ibuf = (char *)realloc(bc->ibuf, bc->isize)) == NULL) {
+			printf("out of memory\n");
+			exit(1);
+		}
+	}
+	nread = read(fd, bc->ibuf + bc->ilen, bc->isize - bc->ilen);
+	if (nread == -1 && errno == EAGAIN) {
+		return;
+	}
+	if (nread <= 0) {
+		printf("connection lost: %s\n", nread ? strerror(errno) : "closed by the server");
+		exit(1);
+	}
+	bc->ilen += nread;
+	process_replies(bc);
+}
+
+static void write_handler(aeEventLoop *el, int fd, void *privdata, int mask)
+{
+	struct bclient *bc = (struct bclient *)privdata;
+	ssize_t nwritten;
+
+	(void)mask;
+	if (bc->opos == 0) {
+		bc->start = ustime();
+	}
+	nwritten = write(fd, bc->obuf + bc->opos, bc->olen - bc->opos);
+	if (nwritten == -1) {
+		if (errno == EAGAIN) return;
+		printf("writing to the server: %s\n", strerror(errno));
+		exit(1);
+	}
+	bc->opos += nwritten;
+	if (bc->opos == bc->olen) {
+		aeDeleteFileEvent(el, fd, AE_WRITABLE);
+	}
+}
+
+// a line per second, and the end of the run
+static int progress(aeEventLoop *el, long long id, void *clientData)
+{
+	// the timer may fire a little early, round to the closest second
+	long long seconds = (ustime() - cfg.start + 500000) / 1000000;
+
+	(void)id;
+	(void)clientData;
+	printf("%3llds %10lld requests/s\n", seconds, cfg.requests - cfg.last_requests);
+	fflush(stdout);
+	cfg.last_requests = cfg.requests;
+	if (seconds >= cfg.duration) {
+		// the batches on the wire are not waited for
+		cfg.stopping = 1;
+		aeStop(el);
+		return AE_NOMORE;
+	}
+	return 1000;
+}
+
+static void connect_clients()
+{
+	char err[ANET_ERR_LEN];
+	struct bclient *bc;
+	int j, maxreq;
+
+	// the largest request: *3, three bulks with their headers
+	maxreq = 64 + 32 + cfg.size;
+	cfg.conns = (struct bclient *)calloc(cfg.clients, sizeof(struct bclient));
+	for (j = 0; j < cfg.clients; j++) {
+		bc = &cfg.conns[j];
+		bc->fd = anetTcpNonBlockConnect(err, cfg.host, cfg.port);
+		if (bc->fd == ANET_ERR) {
+			printf("%s\n", err);
+			exit(1);
+		}
+		anetTcpNoDelay(NULL, bc->fd);
+		bc->obuf = (char *)malloc((size_t)maxreq * cfg.pipeline);
+		bc->cmds = (int *)malloc(sizeof(int) * cfg.pipeline);
+		if (bc->obuf == NULL || bc->cmds == NULL) {
+			printf("out of memory\n");
+			exit(1);
+		}
+		build_batch(bc);
+		if (aeCreateFileEvent(cfg.el, bc->fd, AE_READABLE, read_handler, bc) == AE_ERR ||
+			aeCreateFileEvent(cfg.el, bc->fd, AE_WRITABLE, write_handler, bc) == AE_ERR) {
+			printf("can't watch a connection, too many clients?\n");
+			exit(1);
+		}
+	}
+}
+
+static void report(long long elapsed)
+{
+	struct mix_entry *m;
+	struct hist all;
+	long long errors = 0;
+	int j, k;
+
+	hist_reset(&all);
+	printf("\n%d clients, pipeline %d, %d bytes payload, %ld keys\n",
+		   cfg.clients, cfg.pipeline, cfg.size, cfg.keyspace);
+	printf("%lld requests in %.2f seconds, %.0f requests/s\n\n",
+		   cfg.requests, elapsed / 1e6, cfg.requests * 1e6 / elapsed);
+	printf("%-8s %10s %8s %8s %8s %8s %8s %8s\n",
+		   "command", "requests", "errors", "p50", "p99", "p99.9", "max", "(usec)");
+	for (j = 0; j < cfg.nmix; j++) {
+		m = &cfg.mix[j];
+		printf("%-8s %10lld %8lld %8llu %8llu %8llu %8llu\n", m->name, m->calls, m->errors,
+			   (unsigned long long)hist_percentile(&m->latency, 50),
+			   (unsigned long long)hist_percentile(&m->latency, 99),
+			   (unsigned long long)hist_percentile(&m->latency, 99.9),
+			   (unsigned long long)m->latency.max);
+		// the overall percentiles come from the merged buckets
+		all.count += m->latency.count;
+		if (m->latency.max > all.max) all.max = m->latency.max;
+		for (k = 0; k < HIST_BUCKETS; k++) {
+			all.buckets[k] += m->latency.buckets[k];
+		}
+		errors += m->errors;
+	}
+	printf("%-8s %10lld %8lld %8llu %8llu %8llu %8llu\n", "all", cfg.requests, errors,
+		   (unsigned long long)hist_percentile(&all, 50),
+		   (unsigned long long)hist_percentile(&all, 99),
+		   (unsigned long long)hist_percentile(&all, 99.9),
+		   (unsigned long long)all.max);
+}
+
+int main(int argc, char **argv)
+{
+	char defmix[] = "get:50,set:50";
+	char *name, *value;
+	int j;
+
+	cfg.host = "127.0.0.1";
+	cfg.port = 5555;
+	cfg.clients = 50;
+	cfg.pipeline = 1;
+	cfg.size = 16;
+	cfg.keyspace = 100000;
+	cfg.duration = 10;
+	parse_mix(argv[0], defmix);
+
+	// options come in "--name value" pairs, like the server's
+	for (j = 1; j < argc; j += 2) {
+		name = argv[j];
+		value = (j+1 < argc) ? argv[j+1] : NULL;
+		if (strncmp(name, "--", 2) != 0 || value == NULL) {
+			usage(argv[0]);
+		}
+		name += 2;
+		if (strcasecmp(name, "host") == 0) {
+			cfg.host = value;
+		} else if (strcasecmp(name, "port") == 0) {
+			cfg.port = atoi(value);
+		} else if (strcasecmp(name, "clients") == 0) {
+			cfg.clients = atoi(value);
+		} else if (strcasecmp(name, "pipeline") == 0) {
+			cfg.pipeline = atoi(value);
+		} else if (strcasecmp(name, "mix") == 0) {
+			parse_mix(argv[0], value);
+		} else if (strcasecmp(name, "size") == 0) {
+			cfg.size = atoi(value);
+		} else if (strcasecmp(name, "keyspace") == 0) {
+			cfg.keyspace = atol(value);
+		} else if (strcasecmp(name, "duration") == 0) {
+			cfg.duration = atoi(value);
+		} else {
+			usage(argv[0]);
+		}
+	}
+	if (cfg.clients < 1 || cfg.pipeline < 1 || cfg.size < 0 || cfg.keyspace < 1 || cfg.duration < 1) {
+		usage(argv[0]);
+	}
+
+	cfg.payload = (char *)malloc(cfg.size + 1);
+	memset(cfg.payload, 'x', cfg.size);
+	cfg.el = aeCreateEventLoop(cfg.clients + 128);
+	if (cfg.el == NULL) {
+		printf("can't create the event loop\n");
+		return 1;
+	}
+	connect_clients();
+	cfg.start = ustime();
+	aeCreateTimeEvent(cfg.el, 1000, progress, NULL, NULL);
+	aeMain(cfg.el);
+	report(ustime() - cfg.start);
+	return 0;
+}
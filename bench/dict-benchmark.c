@@ -0,0 +1,96 @@
+// dict-benchmark: inserts into a growing dict, timing every operation,
+// first with the incremental rehash of dict.c, then with each resize
+// done at once by the insert that triggers it, like a plain hash table.
+// the throughput is about the same, the tail latency is not: a blocking
+// resize of millions of keys takes milliseconds.
+//
+//   make bench/dict-benchmark && ./bench/dict-benchmark [keys]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../dict.h"
+#include "../hist.h"
+
+static long long nstime(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((long long)ts.tv_sec)*1000000000 + ts.tv_nsec;
+}
+
+static uint64_t hash_key(const void *key)
+{
+	return dictGenHashFunction(key, strlen((const char *)key));
+}
+
+static int compare_keys(void *privdata, const void *key1, const void *key2)
+{
+	(void)privdata;
+	return strcmp((const char *)key1, (const char *)key2) == 0;
+}
+
+// the keys belong to the keys array, every run uses the same ones
+static dictType type = {hash_key, compare_keys, NULL, NULL};
+
+static char **keys;
+
+// n inserts, each followed by a lookup of an older key, like a SET and
+// a GET. latencies in ns.
+static void run(const char *name, long n, int blocking)
+{
+	struct hist h;
+	dict *d = dictCreate(&type, NULL);
+	long long start, t, total;
+	long j, resizes = 0;
+
+	hist_reset(&h);
+	total = nstime();
+	for (j = 0; j < n; j++) {
+		start = nstime();
+		dictAdd(d, keys[j], NULL);
+		if (dictIsRehashing(d) && blocking) {
+			while (dictRehash(d, 1000));
+			resizes++;
+		}
+		dictFind(d, keys[rand() % (j + 1)]);
+		t = nstime() - start;
+		hist_record(&h, t);
+	}
+	total = nstime() - total;
+
+	printf("%-12s %10.0f ops/s  p50 %6llu ns  p99 %6llu ns  p99.9 %7llu ns  max %10llu ns\n",
+		name, (double)n * 1e9 / total,
+		(unsigned long long)hist_percentile(&h, 50),
+		(unsigned long long)hist_percentile(&h, 99),
+		(unsigned long long)hist_percentile(&h, 99.9),
+		(unsigned long long)h.max);
+	if (blocking) {
+		printf("%-12s %ld resizes done in one go\n", "", resizes);
+	}
+	dictRelease(d);
+}
+
+int main(int argc, char **argv)
+{
+	long n = argc > 1 ? atol(argv[1]) : 4000000;
+	char buf[32];
+	long j;
+
+	if (n <= 0) {
+		printf("usage: %s [keys]\n", argv[0]);
+		return 1;
+	}
+	keys = (char **)malloc(sizeof(char *) * n);
+	for (j = 0; j < n; j++) {
+		snprintf(buf, sizeof(buf), "key:%ld", j);
+		keys[j] = strdup(buf);
+	}
+
+	printf("%ld inserts + lookups into an empty dict\n", n);
+	run("incremental", n, 0);
+	run("blocking", n, 1);
+	return 0;
+}
@@ -0,0 +1,140 @@
+
+// dispatch-benchmark: ns per command lookup with tables of a few to
+// hundreds of commands, the linear strcasecmp scan that was used before
+// against the perfect hash in cmdhash.c. names are looked up in random
+// case and one lookup in ten misses, like a mistyped command.
+//
+//   make bench/dispatch-benchmark && ./bench/dispatch-benchmark [seconds]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <sys/time.h>
+#include "../cmdhash.h"
+
+#define MAX_COMMANDS	1000
+#define QUERIES			4096
+
+static long long ustime(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return ((long long)tv.tv_sec)*1000000 + tv.tv_usec;
+}
+
+static void noop(struct client *c)
+{
+	(void)c;
+}
+
+static struct command table[MAX_COMMANDS];
+static struct command *ptrs[MAX_COMMANDS];
+static char *queries[QUERIES];
+static size_t qlens[QUERIES];
+
+// the lookup as it was: strcasecmp on every entry, then the length check
+static struct command *lookup_linear(int n, const char *name, size_t len)
+{
+	int j;
+
+	for (j = 0; j < n; j++) {
+		if (strcasecmp(name, table[j].name) == 0) {
+			return (strlen(table[j].name) == len) ? table + j : NULL;
+		}
+	}
+	return NULL;
+}
+
+static void make_table(int n)
+{
+	static const char *stems[] = {"get", "set", "del", "hget", "hset", "zadd",
+		"zrangebyscore", "client", "config", "slowlog", "xreadgroup", "subscribe"};
+	char name[64];
+	int j;
+
+	for (j = 0; j < n; j++) {
+		if (j < (int)(sizeof(stems)/sizeof(stems[0]))) {
+			snprintf(name, sizeof(name), "%s", stems[j]);
+		} else {
+			snprintf(name, sizeof(name), "%s%d", stems[j % (sizeof(stems)/sizeof(stems[0]))], j);
+		}
+		free(table[j].name);
+		table[j].name = strdup(name);
+		table[j].pro = noop;
+		ptrs[j] = table + j;
+	}
+}
+
+static void make_queries(int n)
+{
+	char *s;
+	int j;
+	size_t k;
+
+	for (j = 0; j < QUERIES; j++) {
+		free(queries[j]);
+		if (rand() % 10 == 0) {
+			queries[j] = strdup("nosuchcommand");
+		} else {
+			queries[j] = strdup(table[rand() % n].name);
+		}
+		s = queries[j];
+		for (k = 0; s[k]; k++) {
+			if (rand() & 1) s[k] = toupper((unsigned char)s[k]);
+		}
+		qlens[j] = strlen(s);
+	}
+}
+
+static void run(const char *name, int n, struct cmdhash *h, double seconds)
+{
+	long long start = ustime(), elapsed, lookups = 0;
+	long found = 0;
+	int j;
+
+	do {
+		for (j = 0; j < QUERIES; j++) {
+			if (h) {
+				found += cmdhash_lookup(h, queries[j], qlens[j]) != NULL;
+			} else {
+				found += lookup_linear(n, queries[j], qlens[j]) != NULL;
+			}
+		}
+		lookups += QUERIES;
+		elapsed = ustime() - start;
+	} while (elapsed < seconds * 1000000);
+
+	printf("  %-8s %8.1f ns/lookup  (%ld found)\n", name,
+		   elapsed * 1000.0 / lookups, found);
+	fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+	static const int sizes[] = {5, 20, 100, 300, 1000};
+	double seconds = (argc > 1) ? atof(argv[1]) : 1;
+	struct cmdhash h = {0, 0, NULL, NULL};
+	long long start;
+	unsigned int j;
+
+	srand(1);
+	for (j = 0; j < sizeof(sizes)/sizeof(sizes[0]); j++) {
+		make_table(sizes[j]);
+		make_queries(sizes[j]);
+
+		start = ustime();
+		if (cmdhash_build(&h, ptrs, sizes[j]) == -1) {
+			printf("can't build the table of %d commands\n", sizes[j]);
+			return 1;
+		}
+		printf("%d commands (hash built in %lld us, %u slots):\n",
+			   sizes[j], ustime() - start, h.size);
+		run("linear", sizes[j], NULL, seconds);
+		run("hash", sizes[j], &h, seconds);
+	}
+	cmdhash_free(&h);
+	return 0;
+}
@@ -0,0 +1,166 @@
+
+// scan-benchmark: bytes/sec of the request framing with every delimiter
+// scanning implementation, against the memchr + byte loop parser it
+// replaced. the walk mirrors process_multibulk_buffer and
+// process_inline_buffer in network.c without the client around them.
+//
+//   make bench/scan-benchmark && ./bench/scan-benchmark [seconds]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "../scan.h"
+#include "../util.h"
+
+#define BUF_LEN	(1024*1024)
+
+static long long ustime(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return ((long long)tv.tv_sec)*1000000 + tv.tv_usec;
+}
+
+// fill buf with pipelined requests, return the used length
+static size_t fill(char *buf, size_t size, int inline_req, int vlen)
+{
+	char value[4096];
+	char req[8192];
+	size_t len = 0;
+	int n, j = 0;
+
+	memset(value, 'v', vlen);
+	value[vlen] = '\0';
+	while (1) {
+		if (inline_req) {
+			n = snprintf(req, sizeof(req), "set key:%d %s %d\r\n", j, value, j);
+		} else {
+			n = snprintf(req, sizeof(req), "*3\r\n$3\r\nset\r\n$%d\r\nkey:%d\r\n$%d\r\n%s\r\n",
+						 (int)strlen("key:") + snprintf(NULL, 0, "%d", j), j, vlen, value);
+		}
+		if (len + n > size) break;
+		memcpy(buf + len, req, n);
+		len += n;
+		j++;
+	}
+	return len;
+}
+
+// the parser as it was: memchr for line ends, byte loops for the rest
+static long walk_before(char *p, char *end)
+{
+	long args = 0;
+	long long ll, n;
+	char *nl, *q;
+
+	while (p < end) {
+		if (*p == '*') {
+			nl = memchr(p, '\r', end - p);
+			string2ll(p + 1, nl - (p + 1), &n);
+			p = nl + 2;
+			while (n--) {
+				nl = memchr(p, '\r', end - p);
+				string2ll(p + 1, nl - (p + 1), &ll);
+				p = nl + 2 + ll + 2;
+				args++;
+			}
+		} else {
+			nl = memchr(p, '\n', end - p);
+			q = (nl > p && nl[-1] == '\r') ? nl - 1 : nl;
+			while (p < q) {
+				while (p < q && (*p == ' ' || *p == '\t')) p++;
+				if (p == q) break;
+				while (p < q && *p != ' ' && *p != '\t') p++;
+				args++;
+			}
+			p = nl + 1;
+		}
+	}
+	return args;
+}
+
+// the parser now, through the scan_* function pointers
+static long walk_scan(char *p, char *end)
+{
+	long args = 0;
+	long long ll, n;
+	char *nl, *cr;
+
+	while (p < end) {
+		if (*p == '*') {
+			cr = scan_nondigit(p + 1, end);
+			string2ll(p + 1, cr - (p + 1), &n);
+			p = cr + 2;
+			while (n--) {
+				cr = scan_nondigit(p + 1, end);
+				string2ll(p + 1, cr - (p + 1), &ll);
+				p = cr + 2 + ll + 2;
+				args++;
+			}
+		} else {
+			nl = scan_byte(p, end, '\n');
+			if (nl > p && nl[-1] == '\r') nl--;
+			while (p < nl) {
+				if (*p == ' ' || *p == '\t') {
+					p++;
+					continue;
+				}
+				p = scan_blank(p, nl);
+				args++;
+				if (p < nl) p++;
+			}
+			p = (*p == '\r') ? p + 2 : p + 1;
+		}
+	}
+	return args;
+}
+
+static void run(const char *name, long (*walk)(char *, char *), char *buf, size_t len, double seconds)
+{
+	long long start = ustime(), elapsed;
+	long long bytes = 0;
+	long args = 0;
+
+	do {
+		args += walk(buf, buf + len);
+		bytes += len;
+		elapsed = ustime() - start;
+	} while (elapsed < seconds * 1000000);
+
+	printf("  %-8s %10.1f MB/s  (%ld args)\n", name,
+		   bytes / (elapsed / 1000000.0) / (1024*1024), args);
+	fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+	static const char *impls[] = {"scalar", "sse2", "avx2"};
+	static const struct { const char *name; int inline_req; int vlen; } loads[] = {
+		{"multibulk, 10 byte values", 0, 10},
+		{"multibulk, 100 byte values", 0, 100},
+		{"inline, 10 byte values", 1, 10},
+		{"inline, 100 byte values", 1, 100},
+		{"inline, 1000 byte values", 1, 1000},
+	};
+	double seconds = (argc > 1) ? atof(argv[1]) : 1;
+	char *buf = malloc(BUF_LEN);
+	unsigned int j, k;
+	size_t len;
+
+	for (j = 0; j < sizeof(loads)/sizeof(loads[0]); j++) {
+		len = fill(buf, BUF_LEN, loads[j].inline_req, loads[j].vlen);
+		printf("%s:\n", loads[j].name);
+		run("before", walk_before, buf, len, seconds);
+		for (k = 0; k < sizeof(impls)/sizeof(impls[0]); k++) {
+			if (scan_set_impl(impls[k]) == -1) {
+				printf("  %-8s not supported by this cpu\n", impls[k]);
+				continue;
+			}
+			run(impls[k], walk_scan, buf, len, seconds);
+		}
+	}
+	free(buf);
+	return 0;
+}
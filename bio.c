@@ -0,0 +1,106 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "bio.h"
+#include "adlist.h"
+
+
+struct bio_job{
+	int type;
+	int fd;
+};
+
+static pthread_t bio_thread;
+static pthread_mutex_t bio_mutex;
+static pthread_cond_t bio_newjob_cond;
+static list *bio_jobs;		// jobs not done yet, the first one may be running
+static unsigned long long bio_pending[BIO_NUM_OPS];
+
+static void *bio_process_jobs(void *arg)
+{
+	struct bio_job *job;
+	listNode *ln;
+
+	(void)arg;
+	pthread_mutex_lock(&bio_mutex);
+	while (1) {
+		if (listLength(bio_jobs) == 0) {
+			pthread_cond_wait(&bio_newjob_cond, &bio_mutex);
+			continue;
+		}
+		// the job stays queued while it runs, so it counts as pending
+		ln = listFirst(bio_jobs);
+		job = (struct bio_job *)ln->value;
+		pthread_mutex_unlock(&bio_mutex);
+
+		if (job->type == BIO_AOF_FSYNC) {
+			if (data_fsync(job->fd) == -1 && errno != EBADF && errno != EINVAL) {
+				printf ("Background fsync of fd %d failed: %s\n", job->fd, strerror(errno));
+			}
+		} else if (job->type == BIO_CLOSE_FILE) {
+			close(job->fd);
+		}
+
+		pthread_mutex_lock(&bio_mutex);
+		bio_pending[job->type]--;
+		listDelNode(bio_jobs, ln);
+	}
+	return NULL;
+}
+
+void bio_init()
+{
+	pthread_attr_t attr;
+
+	pthread_mutex_init(&bio_mutex, NULL);
+	pthread_cond_init(&bio_newjob_cond, NULL);
+	bio_jobs = listCreate();
+	if (bio_jobs == NULL) {
+		printf ("Can't create the background job list\n");
+		exit(1);
+	}
+	listSetFreeMethod(bio_jobs, free);
+
+	pthread_attr_init(&attr);
+	if (pthread_create(&bio_thread, &attr, bio_process_jobs, NULL) != 0) {
+		printf ("Can't create the background I/O thread\n");
+		exit(1);
+	}
+	pthread_attr_destroy(&attr);
+}
+
+void bio_create_job(int type, int fd)
+{
+	struct bio_job *job = (struct bio_job *)malloc(sizeof(struct bio_job));
+
+	if (job == NULL) {
+		printf ("Out of memory creating a background job\n");
+		exit(1);
+	}
+	job->type = type;
+	job->fd = fd;
+
+	pthread_mutex_lock(&bio_mutex);
+	if (listAddNodeTail(bio_jobs, job) == NULL) {
+		printf ("Out of memory creating a background job\n");
+		exit(1);
+	}
+	bio_pending[type]++;
+	pthread_cond_signal(&bio_newjob_cond);
+	pthread_mutex_unlock(&bio_mutex);
+}
+
+// jobs of type queued or running
+unsigned long long bio_pending_jobs(int type)
+{
+	unsigned long long val;
+
+	pthread_mutex_lock(&bio_mutex);
+	val = bio_pending[type];
+	pthread_mutex_unlock(&bio_mutex);
+	return val;
+}
@@ -0,0 +1,25 @@
+
+#ifndef _BIO_H
+#define _BIO_H
+
+// background I/O: jobs that may block on the disk run in one thread, in
+// the order they were created, so the event loop never waits for them.
+
+// job types
+#define BIO_AOF_FSYNC	0	// fsync a file
+#define BIO_CLOSE_FILE	1	// close a file, e.g. the last link of a replaced one
+#define BIO_NUM_OPS		2
+
+// fdatasync doesn't flush the metadata, the size is all an appended
+// file needs and that it does update
+#ifdef __linux__
+#define data_fsync fdatasync
+#else
+#define data_fsync fsync
+#endif
+
+void bio_init();
+void bio_create_job(int type, int fd);
+unsigned long long bio_pending_jobs(int type);
+
+#endif
@@ -3,26 +3,118 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include "client.h"
+#include "zmalloc.h"
 #include "anet.h"
 #include "areactor.h"
 #include "network.h"
 #include "adlist.h"
+#include "pool.h"
+#include "multi.h"
+#include "replication.h"
+#include "pubsub.h"
+#include "upstream.h"
 
 
-struct client *create_client(int fd)
+// parser and reply state shared by socket and udp clients. no buffer is
+// attached yet, and argv is allocated by the first request.
+static int init_client_buffers(struct client *c)
 {
-	struct client *c = (struct client *)malloc(sizeof(struct client));
+	c->input_buf = NULL;
+	c->querybuf = NULL;
+	c->qb_len = 0;
+	c->qb_start = 0;
+	c->qb_pos = 0;
+	c->reqtype = 0;
+	c->multibulklen = 0;
+	c->bulklen = -1;
+	c->argc = 0;
+	c->argv_size = 0;
+	c->argv = NULL;
+	c->bufpos = 0;
+	c->sentlen = 0;
+	c->buf = NULL;
+	c->reply = listCreate();
+	c->reply_bytes = 0;
+	c->mstate = NULL;
+	c->repl = NULL;
+	c->pubsub = NULL;
+	c->upstream_call = NULL;
+	c->upstream_node = NULL;
+	if (c->reply == NULL) {
+		return -1;
+	}
+	listSetFreeMethod(c->reply, release_reply_block);
+	listSetNodeCache(c->reply, CLIENT_REPLY_NODE_CACHE);
+	return 0;
+}
+
+struct client *create_client(int fd, uint32_t ip, int port)
+{
+	struct client *c = (struct client *)pool_alloc(&g_server.client_pool);
+
+	if (c == NULL) {
+		return NULL;
+	}
+	if (init_client_buffers(c) == -1) {
+		pool_free(&g_server.client_pool, c);
+		return NULL;
+	}
 
 	anetNonBlock(NULL,fd);
-	anetTcpNoDelay(NULL,fd);
+	apply_socket_options(fd, &g_server.tcp_opts);
+	if (g_server.tcpkeepalive) {
+		anetKeepAlive(NULL, fd, g_server.tcpkeepalive);
+	}
 	if (aeCreateFileEvent(g_server.el, fd, AE_READABLE, readQueryFromClientHandle, c) == AE_ERR){
 		close(fd);
-		free(c);
+		listRelease(c->reply);
+		pool_free(&g_server.client_pool, c);
 		return NULL;
 	}
 
 	c->fd = fd;
-	listAddNodeTail(g_server.clients, c);
+	c->flags = 0;
+	c->ip = ip;
+	c->port = port;
+	c->lastinteraction = g_server.unixtime;
+	// the node lives in the client: no malloc here, no search in freeClient
+	ilistAddNodeTail(&g_server.clients, &c->client_node);
+	g_server.clients_by_fd[fd] = c;
+
+	return c;
+}
+
+// a client without a socket, for udp datagrams or the AOF replay. it is
+// not linked in g_server.clients: it never times out, and the udp one
+// gets ip/port set for every datagram.
+struct client *create_pseudo_client(int flags)
+{
+	struct client *c = (struct client *)pool_alloc(&g_server.client_pool);
+
+	if (c == NULL) {
+		return NULL;
+	}
+	if (init_client_buffers(c) == -1) {
+		pool_free(&g_server.client_pool, c);
+		return NULL;
+	}
+	c->fd = -1;
+	c->flags = flags;
+	c->ip = 0;
+	c->port = 0;
+	c->lastinteraction = g_server.unixtime;
+
+	return c;
+}
+
+void free_pseudo_client(struct client *c)
+{
+	client_release_reply_buffer(c);
+	discard_transaction(c);
+	zfree(c->querybuf);
+	zfree(c->argv);
+	listRelease(c->reply);
+	pool_free(&g_server.client_pool, c);
 }
 
 void freeClient(struct client *c)
@@ -34,13 +126,159 @@ void freeClient(struct client *c)
     aeDeleteFileEvent(g_server.el, c->fd, AE_WRITABLE);
 	
 	close(c->fd); 	// close fd
+	ratelimit_release(c->ip);
 
 	// del node in list
-	ln = listSearchKey(g_server.clients, c);
-	listDelNode(g_server.clients, ln);
+	ilistDelNode(&g_server.clients, &c->client_node);
+	g_server.clients_by_fd[c->fd] = NULL;
+	if ((c->flags & CLIENT_CLOSE_ASAP) &&
+		(ln = listSearchKey(g_server.clients_to_close, c)) != NULL) {
+		listDelNode(g_server.clients_to_close, ln);
+	}
+
+	client_release_reply_buffer(c);
+	discard_transaction(c);
+	replication_free_client(c);
+	pubsub_free_client(c);
+	upstream_free_client(c);
+	zfree(c->querybuf);
+	zfree(c->argv);
+	listRelease(c->reply);
+	pool_free(&g_server.client_pool, c);
+}
+
+// c waits for the answer of a command, see upstream.c. its socket isn't
+// read and what it sent meanwhile waits in the query buffer, so the
+// replies keep the order of the requests.
+void block_client(struct client *c)
+{
+	c->flags |= CLIENT_BLOCKED;
+	aeDeleteFileEvent(g_server.el, c->fd, AE_READABLE);
+}
+
+// the answer is in the client's output: read it again, and run the
+// requests that came in the meantime
+void unblock_client(struct client *c)
+{
+	c->flags &= ~CLIENT_BLOCKED;
+	if (aeCreateFileEvent(g_server.el, c->fd, AE_READABLE, readQueryFromClientHandle, c) == AE_ERR) {
+		free_client_async(c);
+		return;
+	}
+	process_pending_input(c);
+}
+
+// close c before the loop sleeps again, for when the caller still walks
+// a list c is in. it gets no more output meanwhile.
+void free_client_async(struct client *c)
+{
+	if (c->flags & CLIENT_CLOSE_ASAP) {
+		return;
+	}
+	if (listAddNodeTail(g_server.clients_to_close, c) == NULL) {
+		// not closed then, but the limit that asked for it will again
+		printf ("Out of memory queueing a client to close\n");
+		return;
+	}
+	c->flags |= CLIENT_CLOSE_ASAP;
+}
+
+void free_clients_in_async_free_queue()
+{
+	struct client *c;
+
+	while (listLength(g_server.clients_to_close)) {
+		c = (struct client *)listNodeValue(listFirst(g_server.clients_to_close));
+		listDelNode(g_server.clients_to_close, listFirst(g_server.clients_to_close));
+		c->flags &= ~CLIENT_CLOSE_ASAP;
+		freeClient(c);
+	}
+}
+
+// free method of the reply lists: the last holder of a block frees it
+void release_reply_block(void *p)
+{
+	struct reply_block *b = (struct reply_block *)p;
 
-	free(c);
+	if (--b->refcount == 0) {
+		zfree(b);
+	}
 }
 
 
+// the client on the socket fd, or NULL
+struct client *lookup_client_by_fd(int fd)
+{
+	if (fd < 0 || fd >= g_server.el->setsize) {
+		return NULL;
+	}
+	return g_server.clients_by_fd[fd];
+}
+
+
+//----------------------------
+// reply buffers live in g_server.buf_pool and are attached only while
+// replies are pending, so an idle client costs its struct and little more.
+
+int client_attach_reply_buffer(struct client *c)
+{
+	if (c->buf == NULL) {
+		c->buf = (char *)pool_alloc(&g_server.buf_pool);
+	}
+	return (c->buf == NULL) ? -1 : 0;
+}
 
+// only when bufpos is 0
+void client_release_reply_buffer(struct client *c)
+{
+	if (c->buf != NULL) {
+		pool_free(&g_server.buf_pool, c->buf);
+		c->buf = NULL;
+	}
+}
+
+
+
+
+// return 1 if the client was closed because of the idle timeout
+int clients_cron_handle_timeout(struct client *c)
+{
+	// an idle replication link is fine, see REPL_PING
+	if (c->flags & (CLIENT_MASTER | CLIENT_REPLICA)) {
+		return 0;
+	}
+	if (g_server.maxidletime &&
+		(g_server.unixtime - c->lastinteraction) > g_server.maxidletime) {
+		printf("Closing idle client\n");
+		freeClient(c);
+		return 1;
+	}
+	return 0;
+}
+
+// check a slice of the clients every call, so a full pass takes about a
+// second no matter how many clients there are, and one call never walks
+// the whole list.
+void clients_cron()
+{
+	int numclients = ilistLength(&g_server.clients);
+	int iterations = numclients/g_server.hz;
+	struct client *c;
+	ilistNode *head;
+
+	if (iterations < CLIENTS_CRON_MIN_ITERATIONS) {
+		iterations = (numclients < CLIENTS_CRON_MIN_ITERATIONS) ?
+					 numclients : CLIENTS_CRON_MIN_ITERATIONS;
+	}
+
+	while (ilistLength(&g_server.clients) && iterations--) {
+		// rotate the list, take the current head, process.
+		// this way we just need to check the head after a rotation.
+		ilistRotate(&g_server.clients);
+		head = ilistFirst(&g_server.clients);
+		c = ilistEntry(head, struct client, client_node);
+		if (clients_cron_handle_timeout(c)) {
+			continue;
+		}
+	}
+}
@@ -2,19 +2,107 @@
 #ifndef _CLIENT_H
 #define _CLIENT_H
 
-#define LEN	(1024*16)
+#include <time.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "adlist.h"
+
+#define LEN	(1024*16)		// size of a pooled reply buffer, and max request size
+
+#define CLIENT_POOL_SLAB	256		// clients carved from one malloc
+#define BUFFER_POOL_MAX_FREE	1024	// idle LEN buffers kept for reuse
+
+// client flags
+#define CLIENT_UDP	(1<<0)		// pseudo client running udp datagrams, no socket
+#define CLIENT_CLOSE_AFTER_REPLY	(1<<1)	// close once the pending replies are sent
+#define CLIENT_MULTI	(1<<2)		// in MULTI, commands are queued
+#define CLIENT_DIRTY_EXEC	(1<<3)	// a queued command was refused, EXEC fails
+#define CLIENT_AOF	(1<<4)		// pseudo client replaying the AOF, replies are dropped
+#define CLIENT_MASTER	(1<<5)	// the primary of this replica, replies are dropped
+#define CLIENT_REPLICA	(1<<6)	// sent SYNC, gets the stream instead of replies
+#define CLIENT_CLOSE_ASAP	(1<<7)	// in g_server.clients_to_close, no more output
+#define CLIENT_BLOCKED	(1<<8)		// waits for the upstream, nothing is read meanwhile
+
+#define CLIENT_ARGV_INITIAL	8	// argv slots allocated by the first request
+#define CLIENT_REPLY_NODE_CACHE	4	// reply list nodes kept for reuse
+
+struct multi_state;
+struct replica;
+struct pubsub_state;
+struct upstream_call;
+
+// one argument of the current request. ptr points into the query buffer
+// (no copy) and is null terminated, but len is the real length: values
+// may contain null bytes.
+struct arg{
+	char *ptr;
+	size_t len;
+};
+
+// reply data that didn't fit in client->buf, or a block shared by the
+// reply lists of many clients, see addReplySharedBlock
+struct reply_block{
+	size_t size;	// capacity of buf
+	size_t used;	// bytes of buf in use
+	int refcount;	// reply lists holding it
+	char buf[];
+};
 
 struct client{
 	int fd;		// socket fd
+	int flags;	// CLIENT_*
+	uint32_t ip;	// peer IPv4 address, network order
+	int port;		// peer port
+	time_t lastinteraction;	// time of the last read or write, for timeout
+	ilistNode client_node;	// links g_server.clients, unused for udp
 
-	char input_buf[LEN];
-	char buf[LEN];
+	// query buffer and request parser state. input_buf points into the
+	// shared g_server.readbuf while a read is processed; between reads it
+	// is querybuf, a copy of the unfinished request sized to fit, or NULL
+	// when the last read ended on a request boundary.
+	char *input_buf;
+	char *querybuf;
+	int qb_len;			// bytes read into input_buf
+	int qb_start;		// where the request being parsed starts
+	int qb_pos;			// where the parser goes on
+	int reqtype;		// PROTO_REQ_*, 0 until the first byte of a request is seen
+	int multibulklen;	// arguments of the multibulk request still to be read
+	long bulklen;		// length of the bulk being read, -1 = header not read yet
+	int argc;
+	int argv_size;		// allocated argv slots
+	struct arg *argv;
+
+	// replies
+	int bufpos;			// bytes of buf in use
+	int sentlen;		// bytes of buf, or of the first reply block, already sent
+	char *buf;			// LEN buffer from g_server.buf_pool, NULL when nothing is pending
+	list *reply;		// reply_block overflow, used only when buf is full
+	unsigned long reply_bytes;	// total bytes in the reply list
+
+	struct multi_state *mstate;	// commands queued by MULTI, NULL when none
+	struct replica *repl;		// replication state after SYNC, NULL when none
+	struct pubsub_state *pubsub;	// subscriptions, NULL until the first one
+	struct upstream_call *upstream_call;	// the call it is blocked on, NULL if none
+	listNode *upstream_node;	// its node in the waiters of that call
 };
 
 
 
-struct client *create_client(int fd);
+struct client *create_client(int fd, uint32_t ip, int port);
+struct client *create_pseudo_client(int flags);
+void free_pseudo_client(struct client *c);
 void freeClient(struct client *c);
+void free_client_async(struct client *c);
+void free_clients_in_async_free_queue();
+void release_reply_block(void *p);
+void block_client(struct client *c);
+void unblock_client(struct client *c);
+struct client *lookup_client_by_fd(int fd);
+
+int client_attach_reply_buffer(struct client *c);
+void client_release_reply_buffer(struct client *c);
+int clients_cron_handle_timeout(struct client *c);
+void clients_cron();
 
 #endif
 
@@ -0,0 +1,190 @@
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "cmdhash.h"
+#include "zmalloc.h"
+
+
+// 64 bit fnv-1a of the name, the only pass over its bytes. bytes are
+// folded with | 0x20 so names equal under strcasecmp hash the same; the
+// other pairs it folds together only collide, and lookup compares.
+static uint64_t cmd_hash(const char *s, size_t len)
+{
+	uint64_t h = 14695981039346656037ULL;
+	size_t j;
+
+	for (j = 0; j < len; j++) {
+		h ^= (unsigned char)s[j] | 0x20;
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+// the bucket (seed 0) and slot hashes, murmur3 fmix64 of the name hash
+static uint32_t cmd_mix(uint64_t h, uint32_t seed)
+{
+	h ^= seed * 0x9e3779b97f4a7c15ULL;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return (uint32_t)h;
+}
+
+struct bucket{
+	uint32_t id;
+	int count;
+	int first;		// index in members
+};
+
+// biggest buckets first, they are the hardest to place
+static int bucket_cmp(const void *a, const void *b)
+{
+	return ((const struct bucket *)b)->count - ((const struct bucket *)a)->count;
+}
+
+// 0 on success, 1 if a bucket found no seed (try more slots), -1 for
+// out of memory or a name given twice
+static int try_build(struct cmdhash *h, struct command **cmds, int n)
+{
+	struct bucket *buckets;
+	int *members, *fill;
+	uint64_t *hashes;
+	uint32_t *pos, seed, b;
+	int j, k, i, ret = -1;
+
+	h->seeds = (uint32_t *)zcalloc(h->nbuckets * sizeof(uint32_t));
+	h->slots = (struct cmdhash_slot *)zcalloc(h->size * sizeof(struct cmdhash_slot));
+	buckets = (struct bucket *)zcalloc(h->nbuckets * sizeof(struct bucket));
+	members = (int *)zmalloc(sizeof(int) * (n + 1));
+	fill = (int *)zcalloc(h->nbuckets * sizeof(int));
+	pos = (uint32_t *)zmalloc(sizeof(uint32_t) * (n + 1));
+	hashes = (uint64_t *)zmalloc(sizeof(uint64_t) * (n + 1));
+	if (h->seeds == NULL || h->slots == NULL || buckets == NULL ||
+		members == NULL || fill == NULL || pos == NULL || hashes == NULL) {
+		goto out;
+	}
+
+	// counting sort of the names by bucket
+	for (j = 0; j < n; j++) {
+		hashes[j] = cmd_hash(cmds[j]->name, strlen(cmds[j]->name));
+		b = cmd_mix(hashes[j], 0) & (h->nbuckets - 1);
+		buckets[b].count++;
+	}
+	for (b = 0, k = 0; b < h->nbuckets; b++) {
+		buckets[b].id = b;
+		buckets[b].first = k;
+		k += buckets[b].count;
+	}
+	for (j = 0; j < n; j++) {
+		b = cmd_mix(hashes[j], 0) & (h->nbuckets - 1);
+		members[buckets[b].first + fill[b]++] = j;
+	}
+	qsort(buckets, h->nbuckets, sizeof(struct bucket), bucket_cmp);
+
+	for (i = 0; i < (int)h->nbuckets && buckets[i].count; i++) {
+		int *m = members + buckets[i].first;
+		int count = buckets[i].count;
+
+		// equal names always share a bucket. different names with the same
+		// 64 bit hash would never be placed, refuse them as well.
+		for (j = 0; j < count; j++) {
+			for (k = j + 1; k < count; k++) {
+				if (hashes[m[j]] == hashes[m[k]]) {
+					goto out;
+				}
+			}
+		}
+
+		// displace: the first seed that puts the whole bucket in free slots
+		for (seed = 1; seed <= CMDHASH_MAX_SEED; seed++) {
+			for (j = 0; j < count; j++) {
+				pos[j] = cmd_mix(hashes[m[j]], seed) & (h->size - 1);
+				if (h->slots[pos[j]].cmd != NULL) break;
+				for (k = 0; k < j && pos[k] != pos[j]; k++);
+				if (k < j) break;
+			}
+			if (j == count) break;
+		}
+		if (seed > CMDHASH_MAX_SEED) {
+			ret = 1;
+			goto out;
+		}
+		h->seeds[buckets[i].id] = seed;
+		for (j = 0; j < count; j++) {
+			h->slots[pos[j]].cmd = cmds[m[j]];
+			h->slots[pos[j]].len = strlen(cmds[m[j]]->name);
+		}
+	}
+	ret = 0;
+
+out:
+	zfree(buckets);
+	zfree(members);
+	zfree(fill);
+	zfree(pos);
+	zfree(hashes);
+	if (ret != 0) {
+		zfree(h->seeds);
+		zfree(h->slots);
+		h->seeds = NULL;
+		h->slots = NULL;
+	}
+	return ret;
+}
+
+// build the table of the n commands in cmds, replacing what h held
+// before. about four names per bucket and the slots at most 80% full; if
+// a bucket can't be placed the slots double. -1 on out of memory or a
+// duplicate name, h is left as it was.
+int cmdhash_build(struct cmdhash *h, struct command **cmds, int n)
+{
+	struct cmdhash t;
+	int ret;
+
+	t.nbuckets = 1;
+	while (t.nbuckets < (uint32_t)(n / 4 + 1)) t.nbuckets <<= 1;
+	t.size = 1;
+	while (t.size < (uint32_t)(n + n / 4 + 1)) t.size <<= 1;
+
+	while ((ret = try_build(&t, cmds, n)) == 1 && t.size < CMDHASH_MAX_SIZE) {
+		t.size <<= 1;
+	}
+	if (ret != 0) {
+		return -1;
+	}
+	cmdhash_free(h);
+	*h = t;
+	return 0;
+}
+
+// the command called name (len bytes, not null terminated), or NULL
+struct command *cmdhash_lookup(struct cmdhash *h, const char *name, size_t len)
+{
+	struct cmdhash_slot *s;
+	uint64_t hash;
+	uint32_t b;
+
+	if (h->size == 0) {
+		return NULL;
+	}
+	hash = cmd_hash(name, len);
+	b = cmd_mix(hash, 0) & (h->nbuckets - 1);
+	s = h->slots + (cmd_mix(hash, h->seeds[b]) & (h->size - 1));
+	if (s->cmd != NULL && s->len == len && strncasecmp(s->cmd->name, name, len) == 0) {
+		return s->cmd;
+	}
+	return NULL;
+}
+
+void cmdhash_free(struct cmdhash *h)
+{
+	zfree(h->seeds);
+	zfree(h->slots);
+	h->seeds = NULL;
+	h->slots = NULL;
+	h->nbuckets = 0;
+	h->size = 0;
+}
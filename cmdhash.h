@@ -0,0 +1,34 @@
+
+#ifndef _CMDHASH_H
+#define _CMDHASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "command.h"
+
+// perfect hash of command names, hash and displace (CHD): names go to
+// buckets by a first hash, then every bucket gets a seed for a second
+// hash that puts all of its names in free slots. a lookup is one pass
+// over the name, two mixes of its hash and one compare. names are case
+// insensitive.
+
+#define CMDHASH_MAX_SEED	(1<<16)		// seeds tried per bucket before growing
+#define CMDHASH_MAX_SIZE	(1<<24)		// slots, the build gives up after that
+
+struct cmdhash_slot{
+	struct command *cmd;	// NULL = free
+	size_t len;				// strlen(cmd->name)
+};
+
+struct cmdhash{
+	uint32_t nbuckets;		// power of two
+	uint32_t size;			// slots, power of two
+	uint32_t *seeds;		// one per bucket
+	struct cmdhash_slot *slots;
+};
+
+int cmdhash_build(struct cmdhash *h, struct command **cmds, int n);
+struct command *cmdhash_lookup(struct cmdhash *h, const char *name, size_t len);
+void cmdhash_free(struct cmdhash *h);
+
+#endif
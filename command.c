@@ -1,88 +1,242 @@
 
 #include "command.h"
+#include "zmalloc.h"
 #include "areactor.h"
 #include "network.h"
+#include "cmdhash.h"
+#include "multi.h"
+#include "db.h"
+#include "aof.h"
+#include "rdb.h"
+#include "replication.h"
+#include "pubsub.h"
+#include "evict.h"
+#include "upstream.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 
 void command_get_clients_number(struct client *c)
 {
-	int numbers = listLength(g_server.clients);
-	sprintf(c->buf, "%d", listLength(g_server.clients));
-	addReply(c, NULL);
+	addReplyLongLong(c, ilistLength(&g_server.clients));
 }
 
 void command_quit_client(struct client *c)
 {
-	freeClient(c);
+	// there's no connection to close for a datagram
+	if (c->flags & CLIENT_UDP) {
+		addReplyError(c, "quit is not supported over UDP");
+		return;
+	}
+	// the client goes away once +OK is written
+	addReplyStatus(c, "OK");
+	c->flags |= CLIENT_CLOSE_AFTER_REPLY;
 }
 
-void command_sa(struct client *c)
+
+void command_sb(struct client *c)
 {
-	int sa_fd;
-	char err_buf[100];
-	
-	sa_fd = anetTcpConnect(err_buf, "192.168.1.109", 5566);
-	if (sa_fd == ANET_ERR) {
-		printf("%s\n", err_buf);
+	addReplyStatus(c, "SB operate return OK");
+}
+
+void command_sc(struct client *c)
+{
+	addReplyStatus(c, "SC operate return OK");
+}
+
+// stats: one line per command that was called, latencies in microseconds
+// stats reset: zero the counters and histograms of every command
+void command_stats(struct client *c)
+{
+	char line[256];
+	struct command *cmd;
+	int j, n = 0, len;
+
+	if (c->argc == 2 && strcasecmp(c->argv[1].ptr, "reset") == 0) {
+		reset_command_stats();
+		addReplyStatus(c, "OK");
+		return;
+	}
+	if (c->argc != 1) {
+		addReplyError(c, "syntax error, try STATS or STATS RESET");
 		return;
 	}
 
-	anetWrite(sa_fd, c->input_buf, strlen(c->input_buf)+1);
-	anetRead(sa_fd, c->buf, IOBUF_LEN);
-	close(sa_fd);
-	
-	addReply(c, NULL);
+	for (j = 0; j < g_server.numcommands; j++) {
+		cmd = g_server.commands[j];
+		if (cmd->calls || cmd->rejected_calls) n++;
+	}
+	addReplyMultiBulkLen(c, n);
+	for (j = 0; j < g_server.numcommands; j++) {
+		cmd = g_server.commands[j];
+		if (cmd->calls == 0 && cmd->rejected_calls == 0) {
+			continue;
+		}
+		len = snprintf(line, sizeof(line),
+			"%s:calls=%lld,usec=%lld,usec_per_call=%.2f,rejected_calls=%lld,"
+			"failed_calls=%lld,p50=%llu,p99=%llu,p999=%llu,max=%llu",
+			cmd->name, cmd->calls, cmd->microseconds,
+			cmd->calls ? (double)cmd->microseconds / cmd->calls : 0,
+			cmd->rejected_calls, cmd->failed_calls,
+			(unsigned long long)hist_percentile(cmd->latency, 50),
+			(unsigned long long)hist_percentile(cmd->latency, 99),
+			(unsigned long long)hist_percentile(cmd->latency, 99.9),
+			(unsigned long long)cmd->latency->max);
+		addReplyBulk(c, line, len);
+	}
 }
 
-void command_sb(struct client *c)
+// built in commands: name, proc, arity, flags
+static struct command command_table[] = {
+	{"num", command_get_clients_number, 1, CMD_READONLY},
+	{"quit", command_quit_client, 1, CMD_PUBSUB},
+	{"sa", command_sa, 2, CMD_SLOW | CMD_OFFLOAD},
+	{"sb", command_sb, -1, CMD_READONLY},
+	{"sc", command_sc, -1, CMD_READONLY},
+	{"stats", command_stats, -1, CMD_READONLY},
+	{"slowlog", command_slowlog, -2, CMD_READONLY},
+	{"multi", command_multi, 1, 0},
+	{"exec", command_exec, 1, 0},
+	{"discard", command_discard, 1, 0},
+	{"get", command_get, 2, CMD_READONLY},
+	{"set", command_set, -3, CMD_WRITE | CMD_DENYOOM},
+	{"del", command_del, -2, CMD_WRITE},
+	{"exists", command_exists, -2, CMD_READONLY},
+	{"expire", command_expire, 3, CMD_WRITE},
+	{"ttl", command_ttl, 2, CMD_READONLY},
+	{"pexpireat", command_pexpireat, 3, CMD_WRITE},
+	{"bgrewriteaof", command_bgrewriteaof, 1, 0},
+	{"save", command_save, 1, CMD_SLOW},
+	{"bgsave", command_bgsave, 1, 0},
+	{"lastsave", command_lastsave, 1, CMD_READONLY},
+	{"sync", command_sync, 1, 0},
+	{"replconf", command_replconf, -2, 0},
+	{"role", command_role, 1, CMD_READONLY},
+	{"subscribe", command_subscribe, -2, CMD_PUBSUB},
+	{"unsubscribe", command_unsubscribe, -1, CMD_PUBSUB},
+	{"publish", command_publish, 3, 0},
+	{"memory", command_memory, 1, CMD_READONLY},
+	{"upstream", command_upstream, 1, CMD_READONLY},
+};
+
+
+static struct cmdhash dispatch;
+
+
+// add cmd to g_server.commands and rebuild the dispatch table, -1 if
+// the name is taken or out of memory
+static int add_command(struct command *cmd)
 {
-	addReply(c, "SB operate return OK");
+	struct command **commands;
+	int size;
+
+	if (lookup_command(cmd->name, strlen(cmd->name)) != NULL) {
+		return -1;
+	}
+	if (cmd->latency == NULL) {
+		cmd->latency = (struct hist *)zcalloc(sizeof(struct hist));
+		if (cmd->latency == NULL) {
+			return -1;
+		}
+	}
+	if (g_server.numcommands == g_server.commands_size) {
+		size = g_server.commands_size ? g_server.commands_size * 2 : 16;
+		commands = (struct command **)zrealloc(g_server.commands, sizeof(struct command *)*size);
+		if (commands == NULL) {
+			return -1;
+		}
+		g_server.commands = commands;
+		g_server.commands_size = size;
+	}
+	g_server.commands[g_server.numcommands++] = cmd;
+
+	// the hash has no free slots to fill in, build it again. this only
+	// happens at startup, a few hundred commands take well under 1ms.
+	if (cmdhash_build(&dispatch, g_server.commands, g_server.numcommands) == -1) {
+		g_server.numcommands--;
+		return -1;
+	}
+	return 0;
 }
 
-void command_sc(struct client *c)
+// register the built in commands, -1 if the table can't be built
+int init_command_table()
 {
-	addReply(c, "SC operate return OK");
+	unsigned int j;
+
+	for (j = 0; j < sizeof(command_table)/sizeof(struct command); j++) {
+		if (add_command(command_table + j) == -1) {
+			return -1;
+		}
+	}
+	return 0;
 }
 
-struct command command_table[] = {
-	{"num", command_get_clients_number},
-	{"quit", command_quit_client},
-	{"sa", command_sa},
-	{"sb", command_sb},
-	{"sc", command_sc},
-};
+// add a command at startup, e.g. from a module. arity counts the name,
+// -N means at least N arguments. -1 if the name is taken, the arity is 0
+// or out of memory.
+int register_command(const char *name, CommandProc *proc, int arity, int flags)
+{
+	struct command *cmd;
 
+	if (name == NULL || *name == '\0' || proc == NULL || arity == 0) {
+		return -1;
+	}
+	cmd = (struct command *)zcalloc(sizeof(struct command));
+	if (cmd == NULL) {
+		return -1;
+	}
+	cmd->name = zstrdup(name);
+	cmd->pro = proc;
+	cmd->arity = arity;
+	cmd->flags = flags;
+	if (cmd->name == NULL || add_command(cmd) == -1) {
+		zfree(cmd->name);
+		zfree(cmd->latency);
+		zfree(cmd);
+		return -1;
+	}
+	return 0;
+}
 
-void init_command_table()
+void reset_command_stats()
 {
-	g_server.commands = command_table;
+	struct command *cmd;
+	int j;
+
+	for (j = 0; j < g_server.numcommands; j++) {
+		cmd = g_server.commands[j];
+		cmd->calls = 0;
+		cmd->microseconds = 0;
+		cmd->rejected_calls = 0;
+		cmd->failed_calls = 0;
+		hist_reset(cmd->latency);
+	}
 }
 
 int get_commands_number()
 {
-	return sizeof(command_table)/sizeof(struct command);
+	return g_server.numcommands;
 }
 
-struct command *get_command_from_name(const char *name)
+// find a command by name, case insensitive. len is the length of name,
+// which may hold null bytes (a binary multibulk argument)
+struct command *lookup_command(const char *name, size_t len)
 {
-	int i;
+	return cmdhash_lookup(&dispatch, name, len);
+}
 
-	for (i=0; i<sizeof(command_table)/sizeof(struct command); i++) {
-		if (strcasecmp(name, command_table[i].name) == 0){
-			return command_table + i;
-		}
-	}
-	// not find name cmd
-	return NULL;
+struct command *get_command_from_name(const char *name)
+{
+	return lookup_command(name, strlen(name));
 }
 
 struct command *get_command_from_index(int index)
 {
 	if ((index >=0) && (index < get_commands_number())){
-		return command_table + index;
+		return g_server.commands[index];
 	}
 
 	return NULL;
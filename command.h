@@ -3,22 +3,41 @@
 #define _COMMAND_H
 
 #include "client.h"
+#include "hist.h"
 
 typedef void CommandProc(struct client *c);
 
+// command flags
+#define CMD_READONLY	(1<<0)		// doesn't change any state
+#define CMD_WRITE		(1<<1)		// changes state
+#define CMD_SLOW		(1<<2)		// may take a long time, e.g. network I/O
+#define CMD_OFFLOAD		(1<<3)		// may run off the event loop
+#define CMD_NOREPLY		(1<<4)		// doesn't send a reply
+#define CMD_PUBSUB		(1<<5)		// allowed to a client with subscriptions
+#define CMD_DENYOOM		(1<<6)		// may use more memory, refused over maxmemory
+
 struct command{
 	char *name;
 	CommandProc *pro;
+	int arity;		// argc with the name, -N means N or more
+	int flags;		// CMD_*
+
+	// stats, updated by process_command
+	long long calls;
+	long long microseconds;		// total time spent in pro
+	long long rejected_calls;	// refused before pro ran, e.g. wrong arity
+	long long failed_calls;		// ran and replied with an error
+	struct hist *latency;		// microseconds per call
 };
 
 
-void init_command_table();
+int init_command_table();
+int register_command(const char *name, CommandProc *proc, int arity, int flags);
+struct command *lookup_command(const char *name, size_t len);
 struct command *get_command_from_name(const char *name);
 struct command *get_command_from_index(int index);
 int get_commands_number();
-
-
-extern struct command command_table[];
+void reset_command_stats();
 
 #endif
 
@@ -0,0 +1,500 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <strings.h>
+#include "db.h"
+#include "zmalloc.h"
+#include "areactor.h"
+#include "client.h"
+#include "network.h"
+#include "util.h"
+#include "replication.h"
+#include "evict.h"
+
+
+static uint64_t db_hash(const void *key)
+{
+	const struct arg *k = (const struct arg *)key;
+
+	return dictGenHashFunction(k->ptr, k->len);
+}
+
+static int db_compare(void *privdata, const void *key1, const void *key2)
+{
+	const struct arg *k1 = (const struct arg *)key1;
+	const struct arg *k2 = (const struct arg *)key2;
+
+	NOTUSED(privdata);
+	return k1->len == k2->len && memcmp(k1->ptr, k2->ptr, k1->len) == 0;
+}
+
+static void db_free(void *privdata, void *obj)
+{
+	NOTUSED(privdata);
+	zfree(obj);
+}
+
+static dictType db_dict_type = {
+	db_hash,
+	db_compare,
+	db_free,
+	db_free
+};
+
+// key -> unix time in ms it expires at. the key is the one stored in
+// g_server.db, it is freed by that dict.
+static dictType expires_dict_type = {
+	db_hash,
+	db_compare,
+	NULL,
+	NULL
+};
+
+// copy of a, null terminated, header and bytes in one malloc
+static struct arg *db_string(struct arg *a)
+{
+	struct arg *s;
+
+	s = (struct arg *)zmalloc(sizeof(struct arg) + a->len + 1);
+	if (s == NULL) {
+		return NULL;
+	}
+	s->ptr = (char *)(s + 1);
+	s->len = a->len;
+	memcpy(s->ptr, a->ptr, a->len);
+	s->ptr[a->len] = '\0';
+	return s;
+}
+
+// copy of a as a value, null terminated, in one allocation
+static struct db_value *db_value(struct arg *a)
+{
+	struct db_value *v;
+
+	v = (struct db_value *)zmalloc(sizeof(struct db_value) + a->len + 1);
+	if (v == NULL) {
+		return NULL;
+	}
+	v->s.ptr = (char *)(v + 1);
+	v->s.len = a->len;
+	memcpy(v->s.ptr, a->ptr, a->len);
+	v->s.ptr[a->len] = '\0';
+	v->lru = evict_initial_lru();
+	return v;
+}
+
+// the seed comes from /dev/urandom so clients can't pick keys that all
+// land in one bucket
+static uint64_t db_hash_seed()
+{
+	uint64_t seed = 0;
+	int fd;
+
+	fd = open("/dev/urandom", O_RDONLY);
+	if (fd == -1 || read(fd, &seed, sizeof(seed)) != sizeof(seed)) {
+		seed = ((uint64_t)ustime() << 16) ^ getpid();
+	}
+	if (fd != -1) {
+		close(fd);
+	}
+	return seed;
+}
+
+void db_init()
+{
+	dictSetHashFunctionSeed(db_hash_seed());
+	g_server.db = dictCreate(&db_dict_type, NULL);
+	g_server.expires = dictCreate(&expires_dict_type, NULL);
+	if (g_server.db == NULL || g_server.expires == NULL) {
+		printf ("Can't create the db\n");
+		exit(1);
+	}
+}
+
+// the time keys expire against: when the running command started, so a
+// key doesn't go away halfway through it
+static long long db_now()
+{
+	return g_server.cmd_clock / 1000;
+}
+
+// the AOF and the replicas get a DEL for a key that expired or was
+// evicted: a replica never deletes one by itself, see expire_if_needed
+void propagate_deletion(struct arg *key)
+{
+	struct arg argv[2];
+
+	argv[0].ptr = "DEL";
+	argv[0].len = 3;
+	argv[1] = *key;
+	propagate(lookup_command("del", 3), 2, argv);
+}
+
+// 1 if key is past its ttl. a replica only hides the key until the DEL
+// of its primary comes, and for the primary's commands it is still there.
+// while loading nothing expires: the replayed commands decide, the DEL
+// of a key that expired is in the AOF too.
+static int expire_if_needed(struct arg *key)
+{
+	long long when = db_get_expire(key);
+
+	if (when < 0 || db_now() <= when || g_server.loading) {
+		return 0;
+	}
+	if (g_server.masterhost != NULL) {
+		return g_server.current_client == NULL ||
+			   !(g_server.current_client->flags & CLIENT_MASTER);
+	}
+	propagate_deletion(key);
+	db_delete(key);
+	g_server.stat_expiredkeys++;
+	return 1;
+}
+
+struct arg *db_lookup(struct arg *key)
+{
+	struct db_value *v;
+
+	if (expire_if_needed(key)) {
+		return NULL;
+	}
+	v = (struct db_value *)dictFetchValue(g_server.db, key);
+	// writing to every value read would copy its page in a forked child
+	if (v != NULL && !has_active_child_process()) {
+		evict_touch(v);
+	}
+	return (struct arg *)v;
+}
+
+// store a copy of key and val, overwriting an old value and its ttl.
+// -1 if out of memory
+int db_set(struct arg *key, struct arg *val)
+{
+	struct db_value *v;
+	struct arg *k;
+	dictEntry *de;
+
+	if ((v = db_value(val)) == NULL) {
+		return -1;
+	}
+	de = dictFind(g_server.db, key);
+	if (de != NULL) {
+		// a new value doesn't make the key any less used
+		if (g_server.maxmemory_policy & MAXMEMORY_FLAG_LFU) {
+			v->lru = ((struct db_value *)dictGetVal(de))->lru;
+		}
+		zfree(dictGetVal(de));
+		dictSetVal(g_server.db, de, v);
+		dictDelete(g_server.expires, key);
+		return 0;
+	}
+	if ((k = db_string(key)) == NULL) {
+		zfree(v);
+		return -1;
+	}
+	if (dictAdd(g_server.db, k, v) != DICT_OK) {
+		zfree(k);
+		zfree(v);
+		return -1;
+	}
+	return 0;
+}
+
+// store copies of a key that isn't there yet, as a snapshot load does.
+// -1 if the key exists or out of memory.
+int db_add(struct arg *key, struct arg *val)
+{
+	struct db_value *v;
+	struct arg *k;
+
+	k = db_string(key);
+	v = db_value(val);
+	if (k == NULL || v == NULL || dictAdd(g_server.db, k, v) != DICT_OK) {
+		zfree(k);
+		zfree(v);
+		return -1;
+	}
+	return 0;
+}
+
+// 1 if key was there, 0 if not. the ttl goes first, it shares the key.
+int db_delete(struct arg *key)
+{
+	dictDelete(g_server.expires, key);
+	return dictDelete(g_server.db, key) == DICT_OK;
+}
+
+// key expires at when, unix time in ms. -1 if there's no such key or
+// out of memory.
+int db_set_expire(struct arg *key, long long when)
+{
+	dictEntry *de, *existing;
+
+	de = dictFind(g_server.db, key);
+	if (de == NULL) {
+		return -1;
+	}
+	de = dictAddRaw(g_server.expires, dictGetKey(de), &existing);
+	if (de == NULL) {
+		if ((de = existing) == NULL) {
+			return -1;
+		}
+	}
+	dictSetSignedIntegerVal(de, when);
+	return 0;
+}
+
+// unix time in ms key expires at, -1 if it has no ttl
+long long db_get_expire(struct arg *key)
+{
+	dictEntry *de = dictFind(g_server.expires, key);
+
+	return de ? dictGetSignedIntegerVal(de) : -1;
+}
+
+// every command moves one bucket of a resize, this keeps it going while
+// the server has nothing else to do: when no request was read since the
+// last call. under load db_cron rehashes for a bounded time instead.
+void db_before_sleep()
+{
+	static long long last_cmd_clock = 0;
+	int idle = (g_server.cmd_clock == last_cmd_clock);
+
+	last_cmd_clock = g_server.cmd_clock;
+	// rehashing would copy the tables on write in a forked child
+	if (!idle || has_active_child_process()) {
+		return;
+	}
+	if (dictIsRehashing(g_server.db)) {
+		dictRehash(g_server.db, DB_REHASH_IDLE_STEPS);
+	}
+	if (dictIsRehashing(g_server.expires)) {
+		dictRehash(g_server.expires, DB_REHASH_IDLE_STEPS);
+	}
+}
+
+// give memory back after many deletions, and finish a resize that the
+// commands and the idle loop were too slow for
+static void db_resize(dict *d)
+{
+	if (htNeedsResize(d)) {
+		dictResize(d);
+	}
+	if (dictIsRehashing(d)) {
+		dictRehashMilliseconds(d, DB_REHASH_CRON_MS);
+	}
+}
+
+void db_cron()
+{
+	// a replica waits for the DELs of its primary
+	if (g_server.masterhost == NULL) {
+		active_expire_cycle();
+	}
+	if (!has_active_child_process()) {
+		db_resize(g_server.db);
+		db_resize(g_server.expires);
+	}
+}
+
+// free the expired keys nobody reads. keys with a ttl are sampled at
+// random, ACTIVE_EXPIRE_KEYS_PER_LOOP at a time, and the cycle stops
+// as soon as a sample is mostly alive or the time budget is spent, so
+// the keyspace is never walked in one go. what is left is found by the
+// next cron, or by expire_if_needed.
+void active_expire_cycle()
+{
+	long long start = ustime(), timelimit, now;
+	unsigned long num, sampled, expired;
+	long iterations = 0;
+	dictEntry *de;
+
+	timelimit = 1000000LL * ACTIVE_EXPIRE_TIME_PERC / g_server.hz / 100;
+	do {
+		num = dictSize(g_server.expires);
+		if (num == 0) {
+			break;
+		}
+		// random picks in a table under 1% full mostly hit empty
+		// buckets, wait for db_resize to shrink it
+		if (dictSlots(g_server.expires) > DICT_HT_INITIAL_SIZE &&
+			num * 100 / dictSlots(g_server.expires) < 1) {
+			break;
+		}
+		if (num > ACTIVE_EXPIRE_KEYS_PER_LOOP) {
+			num = ACTIVE_EXPIRE_KEYS_PER_LOOP;
+		}
+
+		now = mstime();
+		sampled = num;
+		expired = 0;
+		while (num--) {
+			de = dictGetRandomKey(g_server.expires);
+			if (now > dictGetSignedIntegerVal(de)) {
+				propagate_deletion((struct arg *)dictGetKey(de));
+				db_delete((struct arg *)dictGetKey(de));
+				g_server.stat_expiredkeys++;
+				expired++;
+			}
+		}
+
+		// ustime() is not free, look at the clock every 16 samples
+		iterations++;
+		if ((iterations & 15) == 0 && ustime() - start > timelimit) {
+			break;
+		}
+	} while (expired * 100 > sampled * ACTIVE_EXPIRE_STALE_PERC);
+}
+
+// get <key>
+void command_get(struct client *c)
+{
+	struct arg *val = db_lookup(&c->argv[1]);
+
+	if (val == NULL) {
+		addReplyNull(c);
+		return;
+	}
+	addReplyBulk(c, val->ptr, val->len);
+}
+
+// set <key> <value> [ex <seconds>|px <milliseconds>]
+void command_set(struct client *c)
+{
+	long long expire, unit, when = -1;
+
+	if (c->argc == 5) {
+		if (strcasecmp(c->argv[3].ptr, "ex") == 0) {
+			unit = 1000;
+		} else if (strcasecmp(c->argv[3].ptr, "px") == 0) {
+			unit = 1;
+		} else {
+			addReplyError(c, "syntax error");
+			return;
+		}
+		if (!string2ll(c->argv[4].ptr, c->argv[4].len, &expire)) {
+			addReplyError(c, "value is not an integer or out of range");
+			return;
+		}
+		if (expire <= 0 || expire > (LLONG_MAX - db_now()) / unit) {
+			addReplyError(c, "invalid expire time in 'set' command");
+			return;
+		}
+		when = db_now() + expire * unit;
+	} else if (c->argc != 3) {
+		addReplyError(c, "syntax error");
+		return;
+	}
+
+	if (db_set(&c->argv[1], &c->argv[2]) == -1 ||
+		(when != -1 && db_set_expire(&c->argv[1], when) == -1)) {
+		addReplyError(c, "out of memory storing the key");
+		return;
+	}
+	g_server.dirty++;
+	addReplyStatus(c, "OK");
+}
+
+// del <key> [key ...]: number of keys removed
+void command_del(struct client *c)
+{
+	long long deleted = 0;
+	int j;
+
+	for (j = 1; j < c->argc; j++) {
+		// an expired key doesn't count as deleted
+		expire_if_needed(&c->argv[j]);
+		deleted += db_delete(&c->argv[j]);
+	}
+	g_server.dirty += deleted;
+	addReplyLongLong(c, deleted);
+}
+
+// exists <key> [key ...]: number of keys that exist, a key given twice
+// counts twice
+void command_exists(struct client *c)
+{
+	long long count = 0;
+	int j;
+
+	for (j = 1; j < c->argc; j++) {
+		if (db_lookup(&c->argv[j]) != NULL) count++;
+	}
+	addReplyLongLong(c, count);
+}
+
+// expire <key> <seconds>: 1 if the ttl was set, 0 if there is no key.
+// 0 seconds or less deletes the key right away.
+void command_expire(struct client *c)
+{
+	long long seconds;
+
+	if (!string2ll(c->argv[2].ptr, c->argv[2].len, &seconds)) {
+		addReplyError(c, "value is not an integer or out of range");
+		return;
+	}
+	if (seconds > (LLONG_MAX - db_now()) / 1000) {
+		addReplyError(c, "invalid expire time in 'expire' command");
+		return;
+	}
+	if (db_lookup(&c->argv[1]) == NULL) {
+		addReplyLongLong(c, 0);
+		return;
+	}
+	if (seconds <= 0) {
+		db_delete(&c->argv[1]);
+	} else if (db_set_expire(&c->argv[1], db_now() + seconds * 1000) == -1) {
+		addReplyError(c, "out of memory storing the ttl");
+		return;
+	}
+	g_server.dirty++;
+	addReplyLongLong(c, 1);
+}
+
+// pexpireat <key> <unix time in ms>: how EXPIRE and SET EX are logged,
+// so a replay sets the same deadline whenever it runs
+void command_pexpireat(struct client *c)
+{
+	long long when;
+
+	if (!string2ll(c->argv[2].ptr, c->argv[2].len, &when)) {
+		addReplyError(c, "value is not an integer or out of range");
+		return;
+	}
+	if (db_lookup(&c->argv[1]) == NULL) {
+		addReplyLongLong(c, 0);
+		return;
+	}
+	// while loading a past deadline is kept, the key goes away when it
+	// is looked up or sampled
+	if (when <= db_now() && !g_server.loading) {
+		db_delete(&c->argv[1]);
+	} else if (db_set_expire(&c->argv[1], when) == -1) {
+		addReplyError(c, "out of memory storing the ttl");
+		return;
+	}
+	g_server.dirty++;
+	addReplyLongLong(c, 1);
+}
+
+// ttl <key>: seconds left, -1 if the key has no ttl, -2 if there is no key
+void command_ttl(struct client *c)
+{
+	long long when, ttl;
+
+	if (db_lookup(&c->argv[1]) == NULL) {
+		addReplyLongLong(c, -2);
+		return;
+	}
+	if ((when = db_get_expire(&c->argv[1])) == -1) {
+		addReplyLongLong(c, -1);
+		return;
+	}
+	ttl = when - db_now();
+	if (ttl < 0) ttl = 0;
+	addReplyLongLong(c, (ttl + 500) / 1000);
+}
@@ -0,0 +1,50 @@
+
+#ifndef _DB_H
+#define _DB_H
+
+#include "dict.h"
+#include "client.h"
+
+// incremental rehash work done outside of the commands: a few buckets
+// every time the event loop is about to wait, up to 1ms per server_cron
+#define DB_REHASH_IDLE_STEPS	100
+#define DB_REHASH_CRON_MS		1
+
+// active expire: every server_cron samples ACTIVE_EXPIRE_KEYS_PER_LOOP
+// keys with a ttl and deletes the expired ones, again and again while
+// more than ACTIVE_EXPIRE_STALE_PERC of a sample was expired, for at
+// most ACTIVE_EXPIRE_TIME_PERC of the time between two crons
+#define ACTIVE_EXPIRE_KEYS_PER_LOOP	20
+#define ACTIVE_EXPIRE_STALE_PERC	25
+#define ACTIVE_EXPIRE_TIME_PERC		25
+
+// keys are stored as a struct arg followed by the bytes, one allocation
+// each, so a lookup takes c->argv[j] as it is. values are the same with
+// the access information for eviction in between, see evict.c.
+struct db_value{
+	struct arg s;		// first, the callers see a struct arg
+	unsigned int lru;	// LRU clock, or LFU time and counter
+};
+
+struct arg *db_lookup(struct arg *key);
+int db_set(struct arg *key, struct arg *val);
+int db_add(struct arg *key, struct arg *val);
+int db_delete(struct arg *key);
+int db_set_expire(struct arg *key, long long when);
+long long db_get_expire(struct arg *key);
+void propagate_deletion(struct arg *key);
+
+void db_init();
+void db_before_sleep();
+void db_cron();
+void active_expire_cycle();
+
+void command_get(struct client *c);
+void command_set(struct client *c);
+void command_del(struct client *c);
+void command_exists(struct client *c);
+void command_expire(struct client *c);
+void command_ttl(struct client *c);
+void command_pexpireat(struct client *c);
+
+#endif
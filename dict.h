@@ -0,0 +1,120 @@
+/* Hash Tables Implementation.
+ *
+ * In-memory hash tables with insert/del/replace/find/get-random-element
+ * operations, modeled on the Redis dict. Hash tables auto resize to
+ * power of two sizes, and collisions are handled by chaining.
+ *
+ * Resizing is incremental: a table that grows or shrinks gets a second
+ * table, and every operation moves one bucket from the old table to the
+ * new one, so no single operation pays for the whole resize. dictRehash
+ * and dictRehashMilliseconds move more buckets when the caller has time
+ * to spare, e.g. from a cron or an idle event loop.
+ */
+
+#ifndef __DICT_H
+#define __DICT_H
+
+#include <stdint.h>
+
+#define DICT_OK 0
+#define DICT_ERR 1
+
+typedef struct dictEntry {
+    void *key;
+    union {
+        void *val;
+        int64_t s64;
+    } v;
+    struct dictEntry *next;
+} dictEntry;
+
+typedef struct dictType {
+    uint64_t (*hashFunction)(const void *key);
+    int (*keyCompare)(void *privdata, const void *key1, const void *key2);
+    void (*keyDestructor)(void *privdata, void *key);
+    void (*valDestructor)(void *privdata, void *obj);
+} dictType;
+
+/* This is our hash table structure. Every dictionary has two of this as
+ * we implement incremental rehashing, for the old to the new table. */
+typedef struct dictht {
+    dictEntry **table;
+    unsigned long size;
+    unsigned long sizemask;
+    unsigned long used;
+} dictht;
+
+typedef struct dict {
+    dictType *type;
+    void *privdata;
+    dictht ht[2];
+    long rehashidx; /* rehashing not in progress if rehashidx == -1 */
+    unsigned long iterators; /* number of safe iterators currently running */
+} dict;
+
+/* A safe iterator may be used while the dict is modified (dictDelete of
+ * the current entry, dictAdd...), it pauses the incremental rehash.
+ * A non safe iterator only allows dictNext. */
+typedef struct dictIterator {
+    dict *d;
+    long index;
+    int table, safe;
+    dictEntry *entry, *nextEntry;
+} dictIterator;
+
+/* This is the initial size of every hash table */
+#define DICT_HT_INITIAL_SIZE     4
+
+/* ------------------------------- Macros ------------------------------------*/
+#define dictFreeVal(d, entry) \
+    if ((d)->type->valDestructor) \
+        (d)->type->valDestructor((d)->privdata, (entry)->v.val)
+
+#define dictSetVal(d, entry, _val_) do { (entry)->v.val = (_val_); } while(0)
+
+#define dictSetSignedIntegerVal(entry, _val_) \
+    do { (entry)->v.s64 = _val_; } while(0)
+
+#define dictFreeKey(d, entry) \
+    if ((d)->type->keyDestructor) \
+        (d)->type->keyDestructor((d)->privdata, (entry)->key)
+
+#define dictCompareKeys(d, key1, key2) \
+    (((d)->type->keyCompare) ? \
+        (d)->type->keyCompare((d)->privdata, key1, key2) : \
+        (key1) == (key2))
+
+#define dictHashKey(d, key) (d)->type->hashFunction(key)
+#define dictGetKey(he) ((he)->key)
+#define dictGetVal(he) ((he)->v.val)
+#define dictGetSignedIntegerVal(he) ((he)->v.s64)
+#define dictSlots(d) ((d)->ht[0].size+(d)->ht[1].size)
+#define dictSize(d) ((d)->ht[0].used+(d)->ht[1].used)
+#define dictIsRehashing(d) ((d)->rehashidx != -1)
+
+/* API */
+dict *dictCreate(dictType *type, void *privDataPtr);
+int dictExpand(dict *d, unsigned long size);
+int dictAdd(dict *d, void *key, void *val);
+dictEntry *dictAddRaw(dict *d, void *key, dictEntry **existing);
+int dictReplace(dict *d, void *key, void *val);
+int dictDelete(dict *d, const void *key);
+void dictRelease(dict *d);
+void dictEmpty(dict *d);
+dictEntry *dictFind(dict *d, const void *key);
+void *dictFetchValue(dict *d, const void *key);
+int dictResize(dict *d);
+int htNeedsResize(dict *d);
+dictIterator *dictGetIterator(dict *d);
+dictIterator *dictGetSafeIterator(dict *d);
+dictEntry *dictNext(dictIterator *iter);
+void dictReleaseIterator(dictIterator *iter);
+dictEntry *dictGetRandomKey(dict *d);
+int dictRehash(dict *d, int n);
+int dictRehashMilliseconds(dict *d, int ms);
+void dictEnableResize(void);
+void dictDisableResize(void);
+void dictSetHashFunctionSeed(uint64_t seed);
+uint64_t dictGenHashFunction(const void *key, size_t len);
+
+#endif /* __DICT_H */
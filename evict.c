@@ -0,0 +1,350 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <limits.h>
+#include "evict.h"
+#include "zmalloc.h"
+#include "areactor.h"
+#include "client.h"
+#include "network.h"
+#include "db.h"
+
+
+// maxmemory: before a write command runs, keys are evicted until the
+// memory zmalloc counts is back under the limit. there is no exact LRU
+// or LFU order to keep up to date, every value only has 24 bits saying
+// when it was last used, or how often. eviction samples a few keys and
+// keeps the best candidates seen so far in a small pool, which gets close
+// to the real order for a fraction of the cost.
+
+struct evpool_entry{
+	unsigned long long idle;	// higher is a better candidate
+	struct arg *key;			// a copy, the key may be gone when it is picked
+};
+
+static struct evpool_entry evpool[EVPOOL_SIZE];
+
+static struct {
+	const char *name;
+	int policy;
+} policies[] = {
+	{"volatile-lru", MAXMEMORY_VOLATILE_LRU},
+	{"volatile-lfu", MAXMEMORY_VOLATILE_LFU},
+	{"volatile-ttl", MAXMEMORY_VOLATILE_TTL},
+	{"volatile-random", MAXMEMORY_VOLATILE_RANDOM},
+	{"allkeys-lru", MAXMEMORY_ALLKEYS_LRU},
+	{"allkeys-lfu", MAXMEMORY_ALLKEYS_LFU},
+	{"allkeys-random", MAXMEMORY_ALLKEYS_RANDOM},
+	{"noeviction", MAXMEMORY_NO_EVICTION},
+};
+
+// MAXMEMORY_* for a --maxmemory-policy value, -1 if unknown
+int evict_policy_from_name(const char *name)
+{
+	unsigned int j;
+
+	for (j = 0; j < sizeof(policies)/sizeof(policies[0]); j++) {
+		if (strcasecmp(name, policies[j].name) == 0) return policies[j].policy;
+	}
+	return -1;
+}
+
+const char *evict_policy_name(int policy)
+{
+	unsigned int j;
+
+	for (j = 0; j < sizeof(policies)/sizeof(policies[0]); j++) {
+		if (policies[j].policy == policy) return policies[j].name;
+	}
+	return "unknown";
+}
+
+//---------------------------------
+// LRU
+//---------------------------------
+
+// seconds, in LRU_BITS. server_cron keeps it in g_server.lruclock, so
+// touching a key doesn't read the time
+unsigned int lru_clock()
+{
+	return (mstime() / LRU_CLOCK_RESOLUTION) & LRU_CLOCK_MAX;
+}
+
+// ms since the value was used, the clock may have wrapped once
+static unsigned long long estimate_idle_time(struct db_value *v)
+{
+	unsigned int clock = g_server.lruclock;
+
+	if (clock >= v->lru) {
+		return (unsigned long long)(clock - v->lru) * LRU_CLOCK_RESOLUTION;
+	}
+	return (unsigned long long)(clock + (LRU_CLOCK_MAX - v->lru)) * LRU_CLOCK_RESOLUTION;
+}
+
+//---------------------------------
+// LFU
+//---------------------------------
+
+// minutes, in 16 bits
+static unsigned long lfu_time_in_minutes()
+{
+	return (g_server.unixtime / 60) & 65535;
+}
+
+// minutes since ldt, the 16 bits wrap every 45 days
+static unsigned long lfu_time_elapsed(unsigned long ldt)
+{
+	unsigned long now = lfu_time_in_minutes();
+
+	if (now >= ldt) return now - ldt;
+	return 65535 - ldt + now;
+}
+
+// the counter grows slower the higher it is: with lfu_log_factor 10 it
+// takes about a million accesses to saturate at 255
+static unsigned long lfu_log_incr(unsigned long counter)
+{
+	double r, baseval, p;
+
+	if (counter == 255) return 255;
+	r = (double)rand() / RAND_MAX;
+	baseval = counter > LFU_INIT_VAL ? counter - LFU_INIT_VAL : 0;
+	p = 1.0 / (baseval * g_server.lfu_log_factor + 1);
+	if (r < p) counter++;
+	return counter;
+}
+
+// the counter decays by one every lfu_decay_time minutes the key isn't
+// used, so keys that were hot once don't stay forever
+static unsigned long lfu_decr_and_return(struct db_value *v)
+{
+	unsigned long ldt = v->lru >> 8;
+	unsigned long counter = v->lru & 255;
+	unsigned long periods;
+
+	periods = g_server.lfu_decay_time ? lfu_time_elapsed(ldt) / g_server.lfu_decay_time : 0;
+	if (periods) {
+		counter = (periods > counter) ? 0 : counter - periods;
+	}
+	return counter;
+}
+
+// lru of a value being stored
+unsigned int evict_initial_lru()
+{
+	if (g_server.maxmemory_policy & MAXMEMORY_FLAG_LFU) {
+		return (lfu_time_in_minutes() << 8) | LFU_INIT_VAL;
+	}
+	return g_server.lruclock;
+}
+
+// v was looked up by a command
+void evict_touch(struct db_value *v)
+{
+	unsigned long counter;
+
+	if (g_server.maxmemory_policy & MAXMEMORY_FLAG_LFU) {
+		counter = lfu_log_incr(lfu_decr_and_return(v));
+		v->lru = (lfu_time_in_minutes() << 8) | counter;
+	} else {
+		v->lru = g_server.lruclock;
+	}
+}
+
+//---------------------------------
+// eviction
+//---------------------------------
+
+// bytes over maxmemory, 0 if under. the AOF buffers hold the DELs of the
+// evicted keys, counting them would evict more to make room for those.
+static size_t bytes_to_free()
+{
+	size_t used = zmalloc_used_memory(), overhead = 0;
+
+	if (used <= (size_t)g_server.maxmemory) {
+		return 0;
+	}
+	if (g_server.aof_buf.data) {
+		overhead += zmalloc_size(g_server.aof_buf.data);
+	}
+	if (g_server.aof_rewrite_buf.data) {
+		overhead += zmalloc_size(g_server.aof_rewrite_buf.data);
+	}
+	used = (overhead > used) ? 0 : used - overhead;
+	return (used <= (size_t)g_server.maxmemory) ? 0 : used - g_server.maxmemory;
+}
+
+static void evpool_clear(int k)
+{
+	zfree(evpool[k].key);
+	evpool[k].key = NULL;
+	evpool[k].idle = 0;
+}
+
+// copy of key, header and bytes in one allocation
+static struct arg *evpool_key(struct arg *key)
+{
+	struct arg *s;
+
+	s = (struct arg *)zmalloc(sizeof(struct arg) + key->len);
+	if (s == NULL) {
+		return NULL;
+	}
+	s->ptr = (char *)(s + 1);
+	s->len = key->len;
+	memcpy(s->ptr, key->ptr, key->len);
+	return s;
+}
+
+// sample keys of sampledict, g_server.db or g_server.expires, and put
+// the ones better than the worst of the pool in it, sorted by idle
+static void evpool_populate(dict *sampledict)
+{
+	unsigned long long idle;
+	struct db_value *v;
+	struct arg *key;
+	dictEntry *de;
+	int j, k;
+
+	for (j = 0; j < g_server.maxmemory_samples; j++) {
+		de = dictGetRandomKey(sampledict);
+		key = (struct arg *)dictGetKey(de);
+		if (g_server.maxmemory_policy == MAXMEMORY_VOLATILE_TTL) {
+			// sooner to expire is better
+			idle = ULLONG_MAX - (unsigned long long)dictGetSignedIntegerVal(de);
+		} else {
+			if (sampledict != g_server.db) {
+				de = dictFind(g_server.db, key);
+			}
+			v = (struct db_value *)dictGetVal(de);
+			if (g_server.maxmemory_policy & MAXMEMORY_FLAG_LRU) {
+				idle = estimate_idle_time(v);
+			} else {
+				idle = 255 - lfu_decr_and_return(v);
+			}
+		}
+
+		// first slot that is empty or better than this key
+		k = 0;
+		while (k < EVPOOL_SIZE && evpool[k].key != NULL && evpool[k].idle < idle) {
+			k++;
+		}
+		if (k == 0 && evpool[EVPOOL_SIZE-1].key != NULL) {
+			// worse than all of a full pool
+			continue;
+		}
+		if (k < EVPOOL_SIZE && evpool[k].key == NULL) {
+			// goes in an empty slot
+		} else if (evpool[EVPOOL_SIZE-1].key == NULL) {
+			// room on the right, shift the better ones
+			memmove(evpool + k + 1, evpool + k, sizeof(evpool[0]) * (EVPOOL_SIZE - k - 1));
+			evpool[k].key = NULL;
+		} else {
+			// full: drop the worst one on the left
+			k--;
+			zfree(evpool[0].key);
+			memmove(evpool, evpool + 1, sizeof(evpool[0]) * k);
+			evpool[k].key = NULL;
+		}
+		if ((evpool[k].key = evpool_key(key)) == NULL) {
+			// out of memory, close the hole
+			evpool[k].idle = 0;
+			if (k < EVPOOL_SIZE - 1 && evpool[k+1].key != NULL) {
+				memmove(evpool + k, evpool + k + 1, sizeof(evpool[0]) * (EVPOOL_SIZE - k - 1));
+				evpool[EVPOOL_SIZE-1].key = NULL;
+			}
+			continue;
+		}
+		evpool[k].idle = idle;
+	}
+}
+
+// the key to evict next, NULL if there is none
+static struct arg *evict_pick_key()
+{
+	dict *d = (g_server.maxmemory_policy & MAXMEMORY_FLAG_ALLKEYS) ?
+			  g_server.db : g_server.expires;
+	struct arg *key = NULL;
+	dictEntry *de;
+	int k, pooled = 1;
+
+	if (g_server.maxmemory_policy == MAXMEMORY_ALLKEYS_RANDOM ||
+		g_server.maxmemory_policy == MAXMEMORY_VOLATILE_RANDOM) {
+		if (dictSize(d) == 0) {
+			return NULL;
+		}
+		return (struct arg *)dictGetKey(dictGetRandomKey(d));
+	}
+
+	// the pool may only have keys deleted since, refill it until one
+	// is still there
+	while (key == NULL && pooled && dictSize(d) != 0) {
+		evpool_populate(d);
+		pooled = 0;
+		for (k = EVPOOL_SIZE - 1; k >= 0 && key == NULL; k--) {
+			if (evpool[k].key == NULL) {
+				continue;
+			}
+			pooled = 1;
+			if ((de = dictFind(d, evpool[k].key)) != NULL) {
+				key = (struct arg *)dictGetKey(de);
+			}
+			evpool_clear(k);
+		}
+	}
+	return key;
+}
+
+// evict until used memory is under maxmemory. EVICT_FAIL if it is still
+// over: the policy is noeviction or there is nothing left it can evict.
+int perform_evictions()
+{
+	size_t tofree, freed = 0, before;
+	struct arg *key;
+
+	if ((tofree = bytes_to_free()) == 0) {
+		return EVICT_OK;
+	}
+	if (g_server.maxmemory_policy == MAXMEMORY_NO_EVICTION) {
+		return EVICT_FAIL;
+	}
+
+	while (freed < tofree) {
+		if ((key = evict_pick_key()) == NULL) {
+			return EVICT_FAIL;
+		}
+		// the AOF and the replicas delete it too. the DEL is written
+		// before the key is freed, and the memory it takes isn't
+		// counted as freed.
+		propagate_deletion(key);
+		before = zmalloc_used_memory();
+		db_delete(key);
+		if (before > zmalloc_used_memory()) {
+			freed += before - zmalloc_used_memory();
+		}
+		g_server.stat_evictedkeys++;
+	}
+	return EVICT_OK;
+}
+
+// memory: used_memory, rss and the maxmemory settings, one per line
+void command_memory(struct client *c)
+{
+	char line[128];
+	int len;
+
+	addReplyMultiBulkLen(c, 5);
+	len = snprintf(line, sizeof(line), "used_memory:%zu", zmalloc_used_memory());
+	addReplyBulk(c, line, len);
+	len = snprintf(line, sizeof(line), "used_memory_rss:%zu", zmalloc_get_rss());
+	addReplyBulk(c, line, len);
+	len = snprintf(line, sizeof(line), "maxmemory:%lld", g_server.maxmemory);
+	addReplyBulk(c, line, len);
+	len = snprintf(line, sizeof(line), "maxmemory_policy:%s",
+				   evict_policy_name(g_server.maxmemory_policy));
+	addReplyBulk(c, line, len);
+	len = snprintf(line, sizeof(line), "evicted_keys:%lld", g_server.stat_evictedkeys);
+	addReplyBulk(c, line, len);
+}
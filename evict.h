@@ -0,0 +1,51 @@
+
+#ifndef _EVICT_H
+#define _EVICT_H
+
+struct client;
+struct db_value;
+
+// maxmemory policies. LRU and LFU pick among sampled keys, all of them or
+// only the ones with a ttl, see perform_evictions
+#define MAXMEMORY_FLAG_LRU		(1<<0)
+#define MAXMEMORY_FLAG_LFU		(1<<1)
+#define MAXMEMORY_FLAG_ALLKEYS	(1<<2)
+
+#define MAXMEMORY_VOLATILE_LRU	((0<<8) | MAXMEMORY_FLAG_LRU)
+#define MAXMEMORY_VOLATILE_LFU	((1<<8) | MAXMEMORY_FLAG_LFU)
+#define MAXMEMORY_VOLATILE_TTL	(2<<8)
+#define MAXMEMORY_VOLATILE_RANDOM	(3<<8)
+#define MAXMEMORY_ALLKEYS_LRU	((4<<8) | MAXMEMORY_FLAG_LRU | MAXMEMORY_FLAG_ALLKEYS)
+#define MAXMEMORY_ALLKEYS_LFU	((5<<8) | MAXMEMORY_FLAG_LFU | MAXMEMORY_FLAG_ALLKEYS)
+#define MAXMEMORY_ALLKEYS_RANDOM	((6<<8) | MAXMEMORY_FLAG_ALLKEYS)
+#define MAXMEMORY_NO_EVICTION	(7<<8)
+
+#define DEFAULT_MAXMEMORY_POLICY	MAXMEMORY_NO_EVICTION
+#define DEFAULT_MAXMEMORY_SAMPLES	5
+#define DEFAULT_LFU_LOG_FACTOR		10
+#define DEFAULT_LFU_DECAY_TIME		1	// minutes
+
+// every value keeps 24 bits of access information in db_value->lru.
+// LRU: the clock when it was last used, in seconds, wrapping after
+// 194 days. LFU: 16 bits of minutes when the counter was last
+// decremented, then an 8 bits logarithmic access counter.
+#define LRU_BITS				24
+#define LRU_CLOCK_MAX			((1<<LRU_BITS)-1)
+#define LRU_CLOCK_RESOLUTION	1000	// ms
+#define LFU_INIT_VAL			5		// counter of a new key, so it isn't evicted at once
+
+// keys kept between evictions, best candidate last
+#define EVPOOL_SIZE				16
+
+#define EVICT_OK	0
+#define EVICT_FAIL	-1	// still over maxmemory, nothing left to evict
+
+unsigned int lru_clock();
+unsigned int evict_initial_lru();
+void evict_touch(struct db_value *v);
+int evict_policy_from_name(const char *name);
+const char *evict_policy_name(int policy);
+int perform_evictions();
+void command_memory(struct client *c);
+
+#endif
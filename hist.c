@@ -0,0 +1,74 @@
+
+#include <string.h>
+#include "hist.h"
+
+
+void hist_reset(struct hist *h)
+{
+	memset(h, 0, sizeof(*h));
+}
+
+static int hist_index(uint64_t v)
+{
+	int msb, shift;
+
+	if (v < (1 << HIST_SUB_BITS)) {
+		return (int)v;
+	}
+	msb = 63 - __builtin_clzll(v);
+	shift = msb - HIST_SUB_BITS;
+	return ((shift + 1) << HIST_SUB_BITS) + (int)((v >> shift) - (1 << HIST_SUB_BITS));
+}
+
+// the largest value that goes to bucket idx
+static uint64_t hist_bucket_top(int idx)
+{
+	int shift;
+	uint64_t sub;
+
+	if (idx < (1 << HIST_SUB_BITS)) {
+		return idx;
+	}
+	shift = (idx >> HIST_SUB_BITS) - 1;
+	sub = idx & ((1 << HIST_SUB_BITS) - 1);
+	return (((1 << HIST_SUB_BITS) + sub + 1) << shift) - 1;
+}
+
+// negative values (the clock went back) count as 0
+void hist_record(struct hist *h, long long value)
+{
+	uint64_t v = (value < 0) ? 0 : (uint64_t)value;
+
+	if (v >= (1ULL << HIST_MAX_BITS)) {
+		v = (1ULL << HIST_MAX_BITS) - 1;
+	}
+	h->buckets[hist_index(v)]++;
+	h->count++;
+	if (v > h->max) {
+		h->max = v;
+	}
+}
+
+// the value p percent of the records are at or below, e.g. 99.9. it is
+// the top of the bucket, so it errs high, but never above the max seen.
+uint64_t hist_percentile(struct hist *h, double p)
+{
+	uint64_t want, seen = 0, top;
+	int j;
+
+	if (h->count == 0) {
+		return 0;
+	}
+	want = (uint64_t)(h->count * p / 100.0 + 0.5);
+	if (want < 1) want = 1;
+	if (want > h->count) want = h->count;
+
+	for (j = 0; j < HIST_BUCKETS; j++) {
+		seen += h->buckets[j];
+		if (seen >= want) {
+			top = hist_bucket_top(j);
+			return (top < h->max) ? top : h->max;
+		}
+	}
+	return h->max;
+}
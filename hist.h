@@ -0,0 +1,26 @@
+
+#ifndef _HIST_H
+#define _HIST_H
+
+#include <stdint.h>
+
+// latency histogram with log buckets, like HdrHistogram: values below
+// 2^HIST_SUB_BITS have a bucket each, every power of two above is split
+// in 2^HIST_SUB_BITS buckets, so a percentile is within ~6% of the real
+// value. recording is a few instructions and never allocates.
+
+#define HIST_SUB_BITS	4
+#define HIST_MAX_BITS	40		// larger values are recorded as 2^40-1
+#define HIST_BUCKETS	((HIST_MAX_BITS - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+struct hist{
+	uint64_t count;
+	uint64_t max;
+	uint64_t buckets[HIST_BUCKETS];
+};
+
+void hist_reset(struct hist *h);
+void hist_record(struct hist *h, long long value);
+uint64_t hist_percentile(struct hist *h, double p);
+
+#endif
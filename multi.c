@@ -0,0 +1,175 @@
+
+#include <stdlib.h>
+#include <string.h>
+#include "multi.h"
+#include "zmalloc.h"
+#include "network.h"
+#include "areactor.h"
+#include "replication.h"
+
+
+// copy argc/argv of c in one malloc, every argument null terminated
+static struct arg *copy_args(struct client *c)
+{
+	struct arg *argv;
+	size_t bytes = 0;
+	char *p;
+	int j;
+
+	for (j = 0; j < c->argc; j++) {
+		bytes += c->argv[j].len + 1;
+	}
+	argv = (struct arg *)zmalloc(sizeof(struct arg) * c->argc + bytes);
+	if (argv == NULL) {
+		return NULL;
+	}
+	p = (char *)(argv + c->argc);
+	for (j = 0; j < c->argc; j++) {
+		memcpy(p, c->argv[j].ptr, c->argv[j].len);
+		p[c->argv[j].len] = '\0';
+		argv[j].ptr = p;
+		argv[j].len = c->argv[j].len;
+		p += c->argv[j].len + 1;
+	}
+	return argv;
+}
+
+void queue_multi_command(struct client *c, struct command *cmd)
+{
+	struct multi_state *ms = c->mstate;
+	struct multi_cmd *commands;
+	struct arg *argv;
+	int size;
+
+	if (ms == NULL) {
+		ms = (struct multi_state *)zcalloc(sizeof(struct multi_state));
+		if (ms == NULL) {
+			goto oom;
+		}
+		c->mstate = ms;
+	}
+	if (ms->count == ms->size) {
+		size = ms->size ? ms->size * 2 : 8;
+		commands = (struct multi_cmd *)zrealloc(ms->commands, sizeof(struct multi_cmd) * size);
+		if (commands == NULL) {
+			goto oom;
+		}
+		ms->commands = commands;
+		ms->size = size;
+	}
+	if ((argv = copy_args(c)) == NULL) {
+		goto oom;
+	}
+	ms->commands[ms->count].cmd = cmd;
+	ms->commands[ms->count].argc = c->argc;
+	ms->commands[ms->count].argv = argv;
+	ms->count++;
+	ms->cmd_flags |= cmd->flags;
+	addReplyStatus(c, "QUEUED");
+	return;
+
+oom:
+	flag_transaction(c);
+	addReplyError(c, "out of memory queueing the command");
+}
+
+// a command refused inside MULTI makes the whole transaction fail
+void flag_transaction(struct client *c)
+{
+	if (c->flags & CLIENT_MULTI) {
+		c->flags |= CLIENT_DIRTY_EXEC;
+	}
+}
+
+// forget the queued commands and leave MULTI
+void discard_transaction(struct client *c)
+{
+	struct multi_state *ms = c->mstate;
+	int j;
+
+	if (ms != NULL) {
+		for (j = 0; j < ms->count; j++) {
+			zfree(ms->commands[j].argv);
+		}
+		zfree(ms->commands);
+		zfree(ms);
+		c->mstate = NULL;
+	}
+	c->flags &= ~(CLIENT_MULTI | CLIENT_DIRTY_EXEC);
+}
+
+void command_multi(struct client *c)
+{
+	if (c->flags & CLIENT_MULTI) {
+		addReplyError(c, "MULTI calls can not be nested");
+		return;
+	}
+	c->flags |= CLIENT_MULTI;
+	// an AOF cut inside a transaction is truncated back to here
+	if (c->flags & CLIENT_AOF) {
+		g_server.loading_multi = c->input_buf + c->qb_start;
+	}
+	addReplyStatus(c, "OK");
+}
+
+void command_discard(struct client *c)
+{
+	if (!(c->flags & CLIENT_MULTI)) {
+		addReplyError(c, "DISCARD without MULTI");
+		return;
+	}
+	discard_transaction(c);
+	addReplyStatus(c, "OK");
+}
+
+// MULTI or EXEC to the AOF and the replicas
+static void propagate_transaction(char *name, size_t len)
+{
+	struct arg argv[1];
+
+	argv[0].ptr = name;
+	argv[0].len = len;
+	propagate(lookup_command(name, len), 1, argv);
+}
+
+// run the queued commands back to back: nothing else runs on the loop
+// in between, and their replies are one multibulk that goes out with the
+// next write. the AOF and the replicas get the writes between MULTI and
+// EXEC as well, so they apply them as one too. EXEC itself isn't
+// propagated by call_command.
+void command_exec(struct client *c)
+{
+	struct multi_state *ms = c->mstate;
+	struct arg *orig_argv;
+	int orig_argc, j, propagated = 0;
+
+	if (!(c->flags & CLIENT_MULTI)) {
+		addReplyError(c, "EXEC without MULTI");
+		return;
+	}
+	if (c->flags & CLIENT_DIRTY_EXEC) {
+		g_server.stat_error_replies++;
+		addReply(c, "-EXECABORT Transaction discarded because of previous errors.\r\n");
+		discard_transaction(c);
+		return;
+	}
+
+	orig_argc = c->argc;
+	orig_argv = c->argv;
+	addReplyMultiBulkLen(c, ms ? ms->count : 0);
+	for (j = 0; ms && j < ms->count; j++) {
+		if (!propagated && (ms->commands[j].cmd->flags & CMD_WRITE)) {
+			propagate_transaction("MULTI", 5);
+			propagated = 1;
+		}
+		c->argc = ms->commands[j].argc;
+		c->argv = ms->commands[j].argv;
+		call_command(c, ms->commands[j].cmd);
+	}
+	c->argc = orig_argc;
+	c->argv = orig_argv;
+	discard_transaction(c);
+	if (propagated) {
+		propagate_transaction("EXEC", 4);
+	}
+}
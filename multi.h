@@ -0,0 +1,30 @@
+
+#ifndef _MULTI_H
+#define _MULTI_H
+
+#include "client.h"
+#include "command.h"
+
+// a command queued by MULTI. argv is a copy: the request it came from
+// is gone by the time EXEC runs.
+struct multi_cmd{
+	struct command *cmd;
+	int argc;
+	struct arg *argv;		// one malloc with the bytes
+};
+
+struct multi_state{
+	struct multi_cmd *commands;
+	int count;
+	int size;				// allocated slots
+	int cmd_flags;			// CMD_* of the queued commands or'ed, EXEC is checked as them
+};
+
+void queue_multi_command(struct client *c, struct command *cmd);
+void flag_transaction(struct client *c);
+void discard_transaction(struct client *c);
+void command_multi(struct client *c);
+void command_exec(struct client *c);
+void command_discard(struct client *c);
+
+#endif
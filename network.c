@@ -1,12 +1,70 @@
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
 #include <errno.h>
+#include <sys/uio.h>
 #include "network.h"
+#include "zmalloc.h"
 #include "ae.h"
 #include "anet.h"
 #include "areactor.h"
 #include "command.h"
 #include "client.h"
+#include "util.h"
+#include "scan.h"
+#include "multi.h"
+#include "replication.h"
+#include "pubsub.h"
+#include "evict.h"
+
+
+//----------------------------
+// socket options
+
+static void sockopt_failed(struct sockopts *o, char *err)
+{
+	// once per listener, it would fail the same way for every client
+	if (!o->warned) {
+		printf("Setting socket options: %s\n", err);
+		o->warned = 1;
+	}
+}
+
+// options that only make sense on the listening socket
+void apply_listener_options(int fd, struct sockopts *o)
+{
+	char err[ANET_ERR_LEN];
+
+	if (o->defer_accept && anetTcpDeferAccept(err, fd, o->defer_accept) == ANET_ERR) {
+		printf("Setting listener options: %s\n", err);
+	}
+}
+
+// called for every accepted socket, with the options of its listener
+void apply_socket_options(int fd, struct sockopts *o)
+{
+	char err[ANET_ERR_LEN];
+
+	if (anetSetTcpNoDelay(err, fd, o->nodelay) == ANET_ERR) {
+		sockopt_failed(o, err);
+	}
+	if (o->rcvbuf && anetSetReceiveBuffer(err, fd, o->rcvbuf) == ANET_ERR) {
+		sockopt_failed(o, err);
+	}
+	if (o->sndbuf && anetSetSendBuffer(err, fd, o->sndbuf) == ANET_ERR) {
+		sockopt_failed(o, err);
+	}
+	if (o->quickack && anetTcpQuickAck(err, fd, 1) == ANET_ERR) {
+		sockopt_failed(o, err);
+	}
+	if (o->notsent_lowat && anetTcpNotSentLowat(err, fd, o->notsent_lowat) == ANET_ERR) {
+		sockopt_failed(o, err);
+	}
+	if (o->busy_poll && anetSetBusyPoll(err, fd, o->busy_poll) == ANET_ERR) {
+		sockopt_failed(o, err);
+	}
+}
 
 
 //----------------------------
@@ -15,34 +73,65 @@
 // handle for socket connect
 void acceptTcpHandler(aeEventLoop *el, int fd, void *privdata, int mask) 
 {
-    int cport, cfd;
+    int cport, cfd, max = MAX_ACCEPTS_PER_CALL;
     char cip[128];
     NOTUSED(el);
     NOTUSED(mask);
     NOTUSED(privdata);
 
-    // 
-    cfd = anetTcpAccept(g_server.neterr, fd, cip, &cport);
-    if (cfd == AE_ERR) {
-        printf("Accepting client connection: %s", g_server.neterr);
-        return;
-    }
-    printf("Accepted %s:%d\n", cip, cport);
+    // drain the backlog, a retry storm shows up as one event with many
+    // pending connections
+    while (max--) {
+        // 
+        cfd = anetTcpAccept(g_server.neterr, fd, cip, &cport);
+        if (cfd == AE_ERR) {
+            if (errno != EWOULDBLOCK) {
+                printf("Accepting client connection: %s\n", g_server.neterr);
+            }
+            return;
+        }
+        printf("Accepted %s:%d\n", cip, cport);
 
-    // ͻ
-    acceptCommonHandler(cfd, 0);
-    
+        // ͻ
+        acceptCommonHandler(cfd, 0, cip, cport);
+    }
 }
 
 
 // handle for socket firstly readable.
-void acceptCommonHandler(int fd, int flags) 
+void acceptCommonHandler(int fd, int flags, char *ip, int port) 
 {
     struct client *c;
+    struct in_addr addr;
+    char *err;
+
+    inet_aton(ip, &addr);
 
-    if ((c = create_client(fd)) == NULL) {
+    // shed load before any per-client resource is allocated
+    switch (ratelimit_accept(addr.s_addr)) {
+    case RATELIMIT_ERR_CONNS:
+        err = "-ERR too many connections from your IP\r\n";
+        break;
+    case RATELIMIT_ERR_RATE:
+        err = "-ERR connection rate limit exceeded\r\n";
+        break;
+    default:
+        err = NULL;
+        break;
+    }
+    if (err != NULL) {
+        // best effort, the socket is about to be closed anyway
+        if (write(fd, err, strlen(err)) == -1) {
+            /* nothing to do */
+        }
+        close(fd);
+        return;
+    }
+
+    if ((c = create_client(fd, addr.s_addr, port)) == NULL) {
         printf("Error allocating resources for the client\n");
         close(fd); /* May be already closed, just ignore errors */
+        ratelimit_release(addr.s_addr);
         return;
     }
 }
@@ -52,23 +141,19 @@ void readQueryFromClientHandle(aeEventLoop *el, int fd, void *privdata, int mask
 {
     struct client *c = (struct client *)privdata;
     int nread, readlen;
-	char *read_buf = c->input_buf;
-	int i;
 	
     NOTUSED(el);
     NOTUSED(mask);
-    readlen = IOBUF_LEN;
 
- 	for (i=0; i<IOBUF_LEN; i++) {
-		read_buf[i] = 0;
-	}
-	
-    nread = read(fd, read_buf, readlen);
+    // every client reads into the shared buffer, after the LEN bytes kept
+    // in front for the unfinished request of its last read
+    readlen = PROTO_READ_LEN;
+    nread = read(fd, g_server.readbuf + LEN, readlen);
 
     // ֵ EOF ͻѹرգ
     if (nread == -1) {
         if (errno == EAGAIN) {
-            nread = 0;
+            return;
         } else {
             printf("Reading from client: %s\n",strerror(errno));
             freeClient(c);
@@ -79,21 +164,115 @@ void readQueryFromClientHandle(aeEventLoop *el, int fd, void *privdata, int mask
         freeClient(c);
         return;
     }
+    c->lastinteraction = g_server.unixtime;
+
+    // put the unfinished request right before the new data
+    if (c->qb_len) {
+        move_query_buffer(c, g_server.readbuf + LEN - (c->qb_len - c->qb_start));
+        zfree(c->querybuf);
+        c->querybuf = NULL;
+    } else {
+        c->input_buf = g_server.readbuf + LEN;
+    }
+    c->qb_len += nread;
+
+    // linux drops out of quick ack mode by itself, arm it again
+    if (g_server.tcp_opts.quickack) {
+        anetTcpQuickAck(NULL, fd, 1);
+    }
 
 	//analysis and process cmd
     process_input(c);    
+
+    // the shared buffer is reused by the next read, keep a copy of what
+    // is left for this client
+    if (keep_query_buffer(c) == -1) {
+        printf("Out of memory for the query buffer of a client\n");
+        freeClient(c);
+    }
 }
 
 
 //-------------------------
 // functions for reply to client
 //-
+// mark the first nwritten bytes of the output as sent
+static void consume_reply(struct client *c, size_t nwritten)
+{
+	struct reply_block *o;
+	size_t avail;
+
+	if (c->bufpos > 0) {
+		avail = c->bufpos - c->sentlen;
+		if (nwritten < avail) {
+			c->sentlen += nwritten;
+			return;
+		}
+		// buf is empty again, go on with the reply list
+		nwritten -= avail;
+		c->bufpos = 0;
+		c->sentlen = 0;
+		client_release_reply_buffer(c);
+	}
+	// empty blocks are dropped on the way
+	while (listLength(c->reply)) {
+		o = listNodeValue(listFirst(c->reply));
+		avail = o->used - c->sentlen;
+		if (nwritten < avail) {
+			c->sentlen += nwritten;
+			return;
+		}
+		nwritten -= avail;
+		c->reply_bytes -= o->used;
+		listDelNode(c->reply, listFirst(c->reply));
+		c->sentlen = 0;
+	}
+}
+
 void sendReplyToClient(aeEventLoop *el, int fd, void *privdata, int mask) 
 {
-	int nwritten = 0;
+	int nwritten = 0, totwritten = 0;
 	struct client *c = (struct client *)privdata;
-	
-	nwritten = write(fd, c->buf, strlen(c->buf));
+	struct iovec iov[PROTO_IOV_MAX];
+	struct reply_block *o;
+	listNode *ln;
+	int iovcnt, offset;
+
+	NOTUSED(el);
+	NOTUSED(mask);
+
+	flush_before_reply();
+	// buf and the reply blocks go out in one writev, so a pipeline or an
+	// EXEC answer costs one syscall however it was split
+	while (c->bufpos > 0 || listLength(c->reply)) {
+		iovcnt = 0;
+		offset = c->sentlen;
+		if (c->bufpos > 0) {
+			iov[iovcnt].iov_base = c->buf + c->sentlen;
+			iov[iovcnt].iov_len = c->bufpos - c->sentlen;
+			iovcnt++;
+			offset = 0;
+		}
+		for (ln = listFirst(c->reply); ln && iovcnt < PROTO_IOV_MAX; ln = listNextNode(ln)) {
+			o = listNodeValue(ln);
+			if (o->used > (size_t)offset) {
+				iov[iovcnt].iov_base = o->buf + offset;
+				iov[iovcnt].iov_len = o->used - offset;
+				iovcnt++;
+			}
+			offset = 0;
+		}
+		if (iovcnt == 0) {
+			// only empty blocks are left
+			consume_reply(c, 0);
+			continue;
+		}
+
+		nwritten = writev(fd, iov, iovcnt);
+		if (nwritten <= 0) break;
+		totwritten += nwritten;
+		consume_reply(c, nwritten);
+	}
 	
 	// д
     if (nwritten == -1) {
@@ -107,20 +286,609 @@ void sendReplyToClient(aeEventLoop *el, int fd, void *privdata, int mask)
             return;
         }
     }
+	if (totwritten > 0) {
+		c->lastinteraction = g_server.unixtime;
+	}
 	
-	// delete the event which be pressed. 
-	aeDeleteFileEvent(g_server.el, c->fd, AE_WRITABLE);
+	// everything is sent, delete the event which be pressed. 
+	if (c->bufpos == 0 && listLength(c->reply) == 0) {
+		aeDeleteFileEvent(g_server.el, c->fd, AE_WRITABLE);
+		client_release_reply_buffer(c);
+		if (c->flags & CLIENT_CLOSE_AFTER_REPLY) {
+			freeClient(c);
+		}
+	}
 }
 
-// str = NULL  => reply string is ready in c->buf, otherwise copy to c->buf 
-void addReply(struct client *c, char *str) 
+// install the write handler when the first pending reply shows up
+static int prepare_client_to_write(struct client *c)
 {
-	if (str != NULL) {
-		memcpy(c->buf, str, strlen(str)+1);
+	// udp replies are collected and sent by readQueryFromUdpHandle
+	if (c->flags & CLIENT_UDP) {
+		return 0;
 	}
-	
-	if (aeCreateFileEvent(g_server.el, c->fd, AE_WRITABLE, sendReplyToClient, c) == AE_ERR){
+	// nobody is waiting for the replies of a replayed command, nor for
+	// those of the primary's commands. a replica gets the stream only.
+	if (c->flags & (CLIENT_AOF | CLIENT_MASTER | CLIENT_REPLICA)) {
+		return -1;
+	}
+	// about to be closed, see free_client_async
+	if (c->flags & CLIENT_CLOSE_ASAP) {
+		return -1;
+	}
+	if (c->bufpos == 0 && listLength(c->reply) == 0 &&
+		aeCreateFileEvent(g_server.el, c->fd, AE_WRITABLE, sendReplyToClient, c) == AE_ERR) {
 		printf ("create AE_WRITABLE error\n");
+		return -1;
+	}
+	return 0;
+}
+
+static void add_reply_to_list(struct client *c, const char *s, size_t len)
+{
+	struct reply_block *tail = NULL;
+	size_t avail, size;
+
+	if (listLength(c->reply)) {
+		tail = listNodeValue(listLast(c->reply));
+	}
+
+	// fill the last block first. a shared block is full from the start,
+	// see addReplySharedBlock
+	if (tail != NULL) {
+		avail = tail->size - tail->used;
+		if (avail > len) avail = len;
+		memcpy(tail->buf + tail->used, s, avail);
+		tail->used += avail;
+		c->reply_bytes += avail;
+		s += avail;
+		len -= avail;
+	}
+	if (len == 0) {
+		return;
+	}
+
+	size = (len < PROTO_REPLY_CHUNK_BYTES) ? PROTO_REPLY_CHUNK_BYTES : len;
+	tail = (struct reply_block *)zmalloc(sizeof(struct reply_block) + size);
+	if (tail == NULL) {
+		printf ("Out of memory for the reply of a client\n");
+		c->flags |= CLIENT_CLOSE_AFTER_REPLY;
+		return;
+	}
+	tail->size = size;
+	tail->used = len;
+	tail->refcount = 1;
+	memcpy(tail->buf, s, len);
+	listAddNodeTail(c->reply, tail);
+	c->reply_bytes += len;
+}
+
+// a reply_block of len bytes for addReplySharedBlock, the caller holds
+// the only reference. NULL if out of memory.
+struct reply_block *create_shared_reply_block(size_t len)
+{
+	struct reply_block *b;
+
+	b = (struct reply_block *)zmalloc(sizeof(struct reply_block) + len);
+	if (b == NULL) {
+		return NULL;
+	}
+	b->size = len;
+	b->used = len;
+	b->refcount = 1;
+	return b;
+}
+
+// queue b after the pending output of c without copying it: the clients
+// it goes to share one block, each with its own sentlen. nothing is
+// appended to it afterwards, its size is its length.
+void addReplySharedBlock(struct client *c, struct reply_block *b)
+{
+	if (prepare_client_to_write(c) == -1) {
+		return;
+	}
+	if (listAddNodeTail(c->reply, b) == NULL) {
+		printf ("Out of memory for the reply of a client\n");
+		c->flags |= CLIENT_CLOSE_AFTER_REPLY;
+		return;
+	}
+	b->refcount++;
+	c->reply_bytes += b->used;
+}
+
+// append raw protocol bytes to the client output
+void addReplyBinary(struct client *c, const char *s, size_t len)
+{
+	size_t avail;
+
+	if (prepare_client_to_write(c) == -1) {
+		return;
+	}
+
+	// once something is queued in the list, buf can't be used or the
+	// replies would go out of order. without a pooled buffer everything
+	// goes to the list.
+	if (listLength(c->reply) == 0 && client_attach_reply_buffer(c) == 0) {
+		avail = LEN - c->bufpos;
+		if (avail > len) avail = len;
+		memcpy(c->buf + c->bufpos, s, avail);
+		c->bufpos += avail;
+		s += avail;
+		len -= avail;
+	}
+	if (len) {
+		add_reply_to_list(c, s, len);
+	}
+}
+
+// append a protocol string, e.g. "+OK\r\n"
+void addReply(struct client *c, char *str) 
+{
+	addReplyBinary(c, str, strlen(str));
+}
+
+// "+<status>\r\n"
+void addReplyStatus(struct client *c, char *status)
+{
+	addReplyBinary(c, "+", 1);
+	addReplyBinary(c, status, strlen(status));
+	addReplyBinary(c, "\r\n", 2);
+}
+
+// "-ERR <err>\r\n", newlines in err would break the protocol
+void addReplyError(struct client *c, char *err)
+{
+	g_server.stat_error_replies++;
+	addReplyBinary(c, "-ERR ", 5);
+	addReplyBinary(c, err, strlen(err));
+	addReplyBinary(c, "\r\n", 2);
+}
+
+void addReplyErrorFormat(struct client *c, const char *fmt, ...)
+{
+	char msg[PROTO_ERR_LEN];
+	va_list ap;
+	int j;
+
+	va_start(ap, fmt);
+	vsnprintf(msg, sizeof(msg), fmt, ap);
+	va_end(ap);
+
+	for (j = 0; msg[j]; j++) {
+		if (msg[j] == '\r' || msg[j] == '\n') msg[j] = ' ';
+	}
+	addReplyError(c, msg);
+}
+
+// "<prefix><ll>\r\n", e.g. ":12\r\n" or "*3\r\n"
+static void add_reply_ll_with_prefix(struct client *c, char prefix, long long ll)
+{
+	char buf[LONG_STR_SIZE + 3];
+	int len;
+
+	buf[0] = prefix;
+	len = ll2string(buf + 1, sizeof(buf) - 1, ll);
+	buf[len+1] = '\r';
+	buf[len+2] = '\n';
+	addReplyBinary(c, buf, len + 3);
+}
+
+void addReplyLongLong(struct client *c, long long ll)
+{
+	add_reply_ll_with_prefix(c, ':', ll);
+}
+
+void addReplyMultiBulkLen(struct client *c, long length)
+{
+	add_reply_ll_with_prefix(c, '*', length);
+}
+
+// "$<len>\r\n<bytes>\r\n", binary safe
+void addReplyBulk(struct client *c, const char *p, size_t len)
+{
+	add_reply_ll_with_prefix(c, '$', len);
+	addReplyBinary(c, p, len);
+	addReplyBinary(c, "\r\n", 2);
+}
+
+void addReplyBulkString(struct client *c, char *s)
+{
+	addReplyBulk(c, s, strlen(s));
+}
+
+void addReplyNull(struct client *c)
+{
+	addReplyBinary(c, "$-1\r\n", 5);
+}
+
+
+//---------------------------------
+// request parser
+//
+// two request types, like redis:
+//   multibulk  "*<argc>\r\n" then "$<len>\r\n<bytes>\r\n" per argument,
+//              binary safe, length prefixed
+//   inline     "<name> <arg> <arg>\r\n", for telnet and old clients
+// a request may be split over any number of reads: the parser stops with
+// PARSE_AGAIN and goes on from qb_pos when more data arrives.
+
+// forget the request that was just run (or dropped)
+void reset_client(struct client *c)
+{
+	c->reqtype = 0;
+	c->multibulklen = 0;
+	c->bulklen = -1;
+	c->argc = 0;
+}
+
+static int ensure_argv(struct client *c, int argc)
+{
+	struct arg *argv;
+	int size = c->argv_size;
+
+	if (argc <= size) {
+		return 0;
+	}
+	if (size == 0) size = CLIENT_ARGV_INITIAL;
+	while (size < argc) size *= 2;
+	argv = (struct arg *)zrealloc(c->argv, sizeof(struct arg)*size);
+	if (argv == NULL) {
+		return -1;
+	}
+	c->argv = argv;
+	c->argv_size = size;
+	return 0;
+}
+
+static void set_protocol_error(struct client *c, char *err)
+{
+	addReplyErrorFormat(c, "Protocol error: %s", err);
+	c->flags |= CLIENT_CLOSE_AFTER_REPLY;
+}
+
+static int process_inline_buffer(struct client *c)
+{
+	char *p = c->input_buf + c->qb_pos;
+	char *end = c->input_buf + c->qb_len;
+	char *newline, *lineend, *arg;
+
+	newline = scan_byte(p, end, '\n');
+	if (newline == end) {
+		return PARSE_AGAIN;
+	}
+	if (newline + 1 - (c->input_buf + c->qb_start) > PROTO_MAX_REQUEST_LEN) {
+		set_protocol_error(c, "request too big");
+		return PARSE_ERR;
+	}
+	lineend = newline;
+	if (lineend > p && lineend[-1] == '\r') {
+		lineend--;
+	}
+	c->qb_pos = newline + 1 - c->input_buf;
+
+	// split on blanks, every argument ends up null terminated in place
+	c->argc = 0;
+	while (p < lineend) {
+		if (*p == ' ' || *p == '\t') {
+			p++;
+			continue;
+		}
+		arg = p;
+		p = scan_blank(p, lineend);
+		if (ensure_argv(c, c->argc + 1) == -1) {
+			set_protocol_error(c, "too many arguments");
+			return PARSE_ERR;
+		}
+		c->argv[c->argc].ptr = arg;
+		c->argv[c->argc].len = p - arg;
+		c->argc++;
+		*p++ = '\0';
+	}
+	*lineend = '\0';
+	return PARSE_OK;
+}
+
+// parse "<prefix><number>\r\n" at qb_pos
+static int parse_length_line(struct client *c, char prefix, long long *ll)
+{
+	char *p = c->input_buf + c->qb_pos;
+	char *end = c->input_buf + c->qb_len;
+	char *digits, *cr;
+	char err[64];
+
+	if (p == end) {
+		return PARSE_AGAIN;
+	}
+	if (*p != prefix) {
+		snprintf(err, sizeof(err), "expected '%c', got '%c'", prefix, *p);
+		set_protocol_error(c, err);
+		return PARSE_ERR;
+	}
+
+	// the number must be followed by CRLF and nothing else
+	digits = p + 1;
+	if (digits < end && *digits == '-') digits++;
+	cr = scan_nondigit(digits, end);
+	if (cr + 1 >= end) {
+		// a length line is short, if it's still open the client is garbage
+		if (end - p > PROTO_MAX_LENGTH_LINE) {
+			set_protocol_error(c, "too big length line");
+			return PARSE_ERR;
+		}
+		return PARSE_AGAIN;
+	}
+	if (cr[0] != '\r' || cr[1] != '\n' || !string2ll(p + 1, cr - (p + 1), ll)) {
+		set_protocol_error(c, (prefix == '*') ? "invalid multibulk length" : "invalid bulk length");
+		return PARSE_ERR;
+	}
+	c->qb_pos = cr + 2 - c->input_buf;
+	return PARSE_OK;
+}
+
+static int process_multibulk_buffer(struct client *c)
+{
+	long long ll;
+	int ret;
+	char *p;
+
+	if (c->multibulklen == 0) {
+		if ((ret = parse_length_line(c, '*', &ll)) != PARSE_OK) {
+			return ret;
+		}
+		if (ll > PROTO_MAX_ARGC) {
+			set_protocol_error(c, "invalid multibulk length");
+			return PARSE_ERR;
+		}
+		c->argc = 0;
+		if (ll <= 0) {
+			return PARSE_OK;	// empty request, ignored
+		}
+		if (ensure_argv(c, ll) == -1) {
+			set_protocol_error(c, "too many arguments");
+			return PARSE_ERR;
+		}
+		c->multibulklen = ll;
+		c->bulklen = -1;
+	}
+
+	while (c->multibulklen) {
+		if (c->bulklen == -1) {
+			if ((ret = parse_length_line(c, '$', &ll)) != PARSE_OK) {
+				return ret;
+			}
+			if (ll < 0 || ll > PROTO_MAX_BULK_LEN) {
+				set_protocol_error(c, "invalid bulk length");
+				return PARSE_ERR;
+			}
+			// the whole request must fit the query buffer, however the
+			// reads split it. an unfinished one kept between reads is
+			// then always shorter than that.
+			if (c->qb_pos - c->qb_start + ll + 2 > PROTO_MAX_REQUEST_LEN) {
+				set_protocol_error(c, "request too big");
+				return PARSE_ERR;
+			}
+			c->bulklen = ll;
+		}
+
+		// the bulk and its trailing CRLF
+		if (c->qb_len - c->qb_pos < c->bulklen + 2) {
+			return PARSE_AGAIN;
+		}
+		p = c->input_buf + c->qb_pos;
+		if (p[c->bulklen] != '\r' || p[c->bulklen+1] != '\n') {
+			set_protocol_error(c, "bulk not terminated by CRLF");
+			return PARSE_ERR;
+		}
+		p[c->bulklen] = '\0';
+
+		c->argv[c->argc].ptr = p;
+		c->argv[c->argc].len = c->bulklen;
+		c->argc++;
+		c->qb_pos += c->bulklen + 2;
+		c->bulklen = -1;
+		c->multibulklen--;
+	}
+	return PARSE_OK;
+}
+
+// move the unfinished request to dst, which becomes input_buf. argv
+// slices of a half parsed multibulk move with it.
+void move_query_buffer(struct client *c, char *dst)
+{
+	char *src = c->input_buf + c->qb_start;
+	int j;
+
+	memmove(dst, src, c->qb_len - c->qb_start);
+	for (j = 0; j < c->argc; j++) {
+		c->argv[j].ptr = dst + (c->argv[j].ptr - src);
+	}
+	c->input_buf = dst;
+	c->qb_len -= c->qb_start;
+	c->qb_pos -= c->qb_start;
+	c->qb_start = 0;
+}
+
+// after process_input on g_server.readbuf: copy the unfinished request
+// to c->querybuf, sized to fit. most reads end on a request boundary and
+// leave the client with no query buffer at all.
+int keep_query_buffer(struct client *c)
+{
+	int len = c->qb_len - c->qb_start;
+
+	if (len == 0) {
+		c->input_buf = NULL;
+		c->qb_start = c->qb_pos = c->qb_len = 0;
+		return 0;
+	}
+	// still no complete request in PROTO_MAX_REQUEST_LEN bytes, the parser
+	// would refuse it once complete. a blocked client may have many
+	// complete ones waiting.
+	if (len >= PROTO_MAX_REQUEST_LEN && !(c->flags & CLIENT_BLOCKED)) {
+		set_protocol_error(c, "request too big");
+		reset_client(c);
+		c->input_buf = NULL;
+		c->qb_start = c->qb_pos = c->qb_len = 0;
+		return 0;
+	}
+	c->querybuf = (char *)zmalloc(len);
+	if (c->querybuf == NULL) {
+		return -1;
+	}
+	move_query_buffer(c, c->querybuf);
+	return 0;
+}
+
+// run the requests a client sent while it was blocked, they are in
+// c->querybuf. what is left unfinished stays there for the next read,
+// at the start of the buffer as keep_query_buffer leaves it.
+void process_pending_input(struct client *c)
+{
+	int len;
+
+	if (c->qb_len == 0) {
+		return;
+	}
+	process_input(c);
+	len = c->qb_len - c->qb_start;
+	if (len == 0) {
+		zfree(c->querybuf);
+		c->querybuf = NULL;
+		c->input_buf = NULL;
+		c->qb_start = c->qb_pos = c->qb_len = 0;
+		return;
+	}
+	if (c->flags & CLIENT_BLOCKED) {
+		return;
+	}
+	if (len >= PROTO_MAX_REQUEST_LEN) {
+		set_protocol_error(c, "request too big");
+		reset_client(c);
+		zfree(c->querybuf);
+		c->querybuf = NULL;
+		c->input_buf = NULL;
+		c->qb_start = c->qb_pos = c->qb_len = 0;
+		return;
+	}
+	move_query_buffer(c, c->querybuf);
+}
+
+// a refused command fails the transaction it would be queued in, a
+// refused EXEC ends it
+static void reject_in_transaction(struct client *c, struct command *cmd)
+{
+	if (cmd->pro == command_exec) {
+		discard_transaction(c);
+	} else {
+		flag_transaction(c);
+	}
+}
+
+// the command of the parsed request, or NULL if it was refused with an
+// error reply
+static struct command *check_command(struct client *c)
+{
+	struct command *cmd;
+	int flags;
+
+	if (!(c->flags & (CLIENT_AOF | CLIENT_MASTER)) && ratelimit_request(c->ip) != RATELIMIT_OK) {
+		addReplyError(c, "request rate limit exceeded");
+		return NULL;
+	}
+
+	cmd = lookup_command(c->argv[0].ptr, c->argv[0].len);
+	if (cmd == NULL) {
+		flag_transaction(c);
+		addReplyErrorFormat(c, "unknown command '%.64s'", c->argv[0].ptr);
+		return NULL;
+	}
+	if ((cmd->arity > 0 && cmd->arity != c->argc) || (c->argc < -cmd->arity)) {
+		cmd->rejected_calls++;
+		flag_transaction(c);
+		addReplyErrorFormat(c, "wrong number of arguments for '%s' command", cmd->name);
+		return NULL;
+	}
+	// EXEC runs the queued commands, it is a write if one of them is
+	flags = cmd->flags;
+	if (cmd->pro == command_exec && (c->flags & CLIENT_MULTI) && c->mstate != NULL) {
+		flags |= c->mstate->cmd_flags;
+	}
+	// a subscriber's connection carries the messages, only the commands
+	// about subscriptions can go in between
+	if (pubsub_subscribed(c) && !(cmd->flags & CMD_PUBSUB)) {
+		flag_transaction(c);
+		addReplyError(c, "only SUBSCRIBE, UNSUBSCRIBE and QUIT are allowed in this context");
+		return NULL;
+	}
+	// a replica takes writes from its primary only
+	if (g_server.masterhost != NULL && (flags & CMD_WRITE) &&
+		!(c->flags & (CLIENT_AOF | CLIENT_MASTER))) {
+		reject_in_transaction(c, cmd);
+		addReplyError(c, "You can't write against a read only replica");
+		return NULL;
+	}
+	// make room before a write. a replica leaves it to its primary, which
+	// sends the DELs of what it evicts. a DEL still runs when nothing can
+	// be evicted, it frees memory.
+	if (g_server.maxmemory && (flags & (CMD_WRITE | CMD_DENYOOM)) && g_server.masterhost == NULL &&
+		!(c->flags & CLIENT_AOF) && perform_evictions() == EVICT_FAIL &&
+		(flags & CMD_DENYOOM)) {
+		reject_in_transaction(c, cmd);
+		addReplyError(c, "OOM command not allowed when used memory > 'maxmemory'");
+		return NULL;
+	}
+	return cmd;
+}
+
+// run the parsed request, exactly one command per request
+void process_command(struct client *c)
+{
+	struct command *cmd;
+
+	// inside MULTI everything but the transaction commands waits for EXEC
+	if ((cmd = check_command(c)) != NULL && (c->flags & CLIENT_MULTI) &&
+		cmd->pro != command_exec && cmd->pro != command_discard && cmd->pro != command_multi) {
+		queue_multi_command(c, cmd);
+		cmd = NULL;
+	}
+	if (cmd == NULL) {
+		// no command ran, the time spent isn't the next one's
+		g_server.cmd_clock = ustime();
+		return;
+	}
+	call_command(c, cmd);
+}
+
+// run cmd with the arguments in c->argv and account for it
+void call_command(struct client *c, struct command *cmd)
+{
+	long long start = g_server.cmd_clock;
+	long long now, duration, errors, dirty;
+	struct client *prev = g_server.current_client;
+
+	errors = g_server.stat_error_replies;
+	dirty = g_server.dirty;
+	g_server.current_client = c;
+	cmd->pro(c);
+	g_server.current_client = prev;
+
+	// one clock read per command: it started where the last one ended,
+	// so the time includes parsing its request. commands run by EXEC
+	// move the clock too, start keeps the EXEC total right.
+	now = ustime();
+	duration = now - start;
+	g_server.cmd_clock = now;
+	cmd->calls++;
+	cmd->microseconds += duration;
+	hist_record(cmd->latency, duration);
+	slowlog_push(c, duration);
+	if (g_server.stat_error_replies != errors) {
+		cmd->failed_calls++;
+	}
+
+	// what changed the keyspace goes to the append only file and the
+	// replicas. EXEC sends its own commands, wrapped in MULTI/EXEC.
+	if (g_server.dirty != dirty && cmd->pro != command_exec) {
+		propagate(cmd, c->argc, c->argv);
 	}
 }
 
@@ -130,16 +898,50 @@ void addReply(struct client *c, char *str)
 //
 void process_input(struct client *c)
 {
-	CommandProc *pro;
-	char *name;
-	int i;
+	int ret;
+
+	// start of the first command, process_command moves it along
+	g_server.cmd_clock = ustime();
 
-	//it should be analysis here. i not do it ... ugly..
-	for (i=0; i<get_commands_number(); i++) {
-		//printf ("%s & %s\n", get_command_from_index(i)->name, c->input_buf);
-		if (memcmp(get_command_from_index(i)->name, c->input_buf, strlen(get_command_from_index(i)->name)) == 0) {
-			(get_command_from_index(i)->pro)(c);
+	while (c->qb_pos < c->qb_len) {
+		// after quit or a protocol error the rest of the input is ignored
+		if (c->flags & CLIENT_CLOSE_AFTER_REPLY) {
+			break;
+		}
+		// a blocked client goes on once it is unblocked
+		if (c->flags & CLIENT_BLOCKED) {
+			break;
+		}
+
+		if (c->reqtype == 0) {
+			c->reqtype = (c->input_buf[c->qb_pos] == '*') ?
+						 PROTO_REQ_MULTIBULK : PROTO_REQ_INLINE;
+		}
+		if (c->reqtype == PROTO_REQ_INLINE) {
+			ret = process_inline_buffer(c);
+		} else {
+			ret = process_multibulk_buffer(c);
 		}
+		if (ret != PARSE_OK) {
+			break;
+		}
+
+		if (c->argc > 0) {
+			process_command(c);
+		}
+		reset_client(c);
+		// a replica's offset counts the stream bytes applied, not the
+		// ones received: an unfinished command isn't done yet
+		if (c->flags & CLIENT_MASTER) {
+			g_server.master_repl_offset += c->qb_pos - c->qb_start;
+		}
+		c->qb_start = c->qb_pos;
 	}
-}
 
+	// nothing pending, or the client is going away: drop the input.
+	// otherwise the caller keeps [qb_start, qb_len) for the next read.
+	if (c->qb_start == c->qb_len || (c->flags & CLIENT_CLOSE_AFTER_REPLY)) {
+		reset_client(c);
+		c->qb_start = c->qb_pos = c->qb_len = 0;
+	}
+}
@@ -5,16 +5,57 @@
 #include "ae.h"
 #include "client.h"
 
+struct command;
+
 #define NOTUSED(V) ((void) V)
 #define IOBUF_LEN         (1024*16) 
 
+// request types
+#define PROTO_REQ_INLINE	1
+#define PROTO_REQ_MULTIBULK	2
+
+// parser results
+#define PARSE_OK	0		// a complete request is in argv
+#define PARSE_AGAIN	1		// need more data
+#define PARSE_ERR	-1		// protocol error, the client is closed after the reply
+
+#define PROTO_MAX_LENGTH_LINE	32			// "*<n>\r\n" and "$<n>\r\n" lines
+#define PROTO_MAX_REQUEST_LEN	LEN			// a request must fit the query buffer
+#define PROTO_MAX_BULK_LEN		(LEN-64)
+#define PROTO_MAX_ARGC			(LEN/6)		// even "$0\r\n\r\n" takes 6 bytes
+#define PROTO_REPLY_CHUNK_BYTES	(1024*16)	// reply list block size
+#define PROTO_READ_LEN			(1024*64)	// bytes read per call into g_server.readbuf
+#define PROTO_IOV_MAX			16			// buffers gathered by one writev
+#define PROTO_ERR_LEN			256
+
 
+struct sockopts;
+
+void apply_listener_options(int fd, struct sockopts *o);
+void apply_socket_options(int fd, struct sockopts *o);
 void acceptTcpHandler(aeEventLoop *el, int fd, void *privdata, int mask);
-void acceptCommonHandler(int fd, int flags);
+void acceptCommonHandler(int fd, int flags, char *ip, int port);
 void readQueryFromClientHandle(aeEventLoop *el, int fd, void *privdata, int mask) ;
-void addReply(struct client *c, char *str) ;
 void sendReplyToClient(aeEventLoop *el, int fd, void *privdata, int mask);
+struct reply_block *create_shared_reply_block(size_t len);
+void addReplySharedBlock(struct client *c, struct reply_block *b);
+void addReplyBinary(struct client *c, const char *s, size_t len);
+void addReply(struct client *c, char *str) ;
+void addReplyStatus(struct client *c, char *status);
+void addReplyError(struct client *c, char *err);
+void addReplyErrorFormat(struct client *c, const char *fmt, ...);
+void addReplyLongLong(struct client *c, long long ll);
+void addReplyMultiBulkLen(struct client *c, long length);
+void addReplyBulk(struct client *c, const char *p, size_t len);
+void addReplyBulkString(struct client *c, char *s);
+void addReplyNull(struct client *c);
+void reset_client(struct client *c);
+void process_command(struct client *c);
 void process_input(struct client *c);
+void call_command(struct client *c, struct command *cmd);
+void move_query_buffer(struct client *c, char *dst);
+int keep_query_buffer(struct client *c);
+void process_pending_input(struct client *c);
 
 
 #endif
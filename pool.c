@@ -0,0 +1,78 @@
+
+#include <stdlib.h>
+#include "pool.h"
+#include "zmalloc.h"
+
+
+void pool_init(struct pool *p, size_t objsize, int slab_objs, unsigned long max_free)
+{
+	// room for the free list link, and keep objects pointer aligned
+	if (objsize < sizeof(void *)) {
+		objsize = sizeof(void *);
+	}
+	objsize = (objsize + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+	p->objsize = objsize;
+	p->slab_objs = (slab_objs < 1) ? 1 : slab_objs;
+	p->max_free = max_free;
+	p->freelist = NULL;
+	p->used = 0;
+	p->nfree = 0;
+	p->slabs = 0;
+}
+
+// put a new slab in the free list
+static int pool_grow(struct pool *p)
+{
+	char *slab;
+	int j;
+
+	slab = (char *)zmalloc(p->objsize * p->slab_objs);
+	if (slab == NULL) {
+		return -1;
+	}
+	// link the objects so the first one is handed out first
+	for (j = p->slab_objs - 1; j >= 0; j--) {
+		*(void **)(slab + j * p->objsize) = p->freelist;
+		p->freelist = slab + j * p->objsize;
+	}
+	p->nfree += p->slab_objs;
+	p->slabs++;
+	return 0;
+}
+
+void *pool_alloc(struct pool *p)
+{
+	void *obj;
+
+	if (p->freelist == NULL && pool_grow(p) == -1) {
+		return NULL;
+	}
+	obj = p->freelist;
+	p->freelist = *(void **)obj;
+	p->nfree--;
+	p->used++;
+	return obj;
+}
+
+void pool_free(struct pool *p, void *obj)
+{
+	if (obj == NULL) {
+		return;
+	}
+	p->used--;
+	if (p->slab_objs == 1 && p->nfree >= p->max_free) {
+		zfree(obj);
+		p->slabs--;
+		return;
+	}
+	*(void **)obj = p->freelist;
+	p->freelist = obj;
+	p->nfree++;
+}
+
+// bytes taken from malloc, in use or cached
+size_t pool_memory(struct pool *p)
+{
+	return p->slabs * p->slab_objs * p->objsize;
+}
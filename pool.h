@@ -0,0 +1,29 @@
+
+#ifndef _POOL_H
+#define _POOL_H
+
+#include <stddef.h>
+
+// fixed size object allocator with a free list.
+//
+// slab_objs > 1: objects are carved from slabs of slab_objs objects and
+// recycled through the free list, slabs are kept for the process life.
+// slab_objs == 1: every object is its own malloc, the free list caches
+// up to max_free of them and the rest goes back to malloc. good for big
+// buffers that are only needed now and then.
+struct pool{
+	size_t objsize;
+	int slab_objs;
+	unsigned long max_free;		// only used when slab_objs == 1
+	void *freelist;				// singly linked through the first word of each object
+	unsigned long used;			// objects handed out
+	unsigned long nfree;		// objects in the free list
+	unsigned long slabs;		// slabs (or single objects) malloc'ed
+};
+
+void pool_init(struct pool *p, size_t objsize, int slab_objs, unsigned long max_free);
+void *pool_alloc(struct pool *p);
+void pool_free(struct pool *p, void *obj);
+size_t pool_memory(struct pool *p);
+
+#endif
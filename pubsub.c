@@ -0,0 +1,341 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pubsub.h"
+#include "zmalloc.h"
+#include "areactor.h"
+#include "client.h"
+#include "network.h"
+#include "util.h"
+
+
+// pub/sub: g_server.pubsub_channels maps a channel to the list of its
+// subscribers, every subscriber maps its channels to its node in that
+// list, so unsubscribing doesn't walk it. PUBLISH encodes the message
+// once in a shared reply_block that goes in the reply list of every
+// subscriber as it is.
+
+static uint64_t channel_hash(const void *key)
+{
+	const struct arg *k = (const struct arg *)key;
+
+	return dictGenHashFunction(k->ptr, k->len);
+}
+
+static int channel_compare(void *privdata, const void *key1, const void *key2)
+{
+	const struct arg *k1 = (const struct arg *)key1;
+	const struct arg *k2 = (const struct arg *)key2;
+
+	NOTUSED(privdata);
+	return k1->len == k2->len && memcmp(k1->ptr, k2->ptr, k1->len) == 0;
+}
+
+static void channel_free(void *privdata, void *obj)
+{
+	NOTUSED(privdata);
+	zfree(obj);
+}
+
+static void subscribers_free(void *privdata, void *obj)
+{
+	NOTUSED(privdata);
+	listRelease((list *)obj);
+}
+
+// channel -> list of clients, the channel is freed with its last subscriber
+static dictType pubsub_channels_type = {
+	channel_hash,
+	channel_compare,
+	channel_free,
+	subscribers_free
+};
+
+// channel of g_server.pubsub_channels -> listNode of the client
+static dictType client_channels_type = {
+	channel_hash,
+	channel_compare,
+	NULL,
+	NULL
+};
+
+void pubsub_init()
+{
+	g_server.pubsub_channels = dictCreate(&pubsub_channels_type, NULL);
+	if (g_server.pubsub_channels == NULL) {
+		printf ("Can't create the pubsub channels\n");
+		exit(1);
+	}
+}
+
+// copy of a, null terminated, header and bytes in one malloc
+static struct arg *channel_string(struct arg *a)
+{
+	struct arg *s;
+
+	s = (struct arg *)zmalloc(sizeof(struct arg) + a->len + 1);
+	if (s == NULL) {
+		return NULL;
+	}
+	s->ptr = (char *)(s + 1);
+	s->len = a->len;
+	memcpy(s->ptr, a->ptr, a->len);
+	s->ptr[a->len] = '\0';
+	return s;
+}
+
+int pubsub_subscribed(struct client *c)
+{
+	return c->pubsub != NULL && dictSize(c->pubsub->channels) != 0;
+}
+
+// *3 <kind> <channel> <subscriptions left>
+static void add_reply_subscription(struct client *c, char *kind, struct arg *channel)
+{
+	addReplyMultiBulkLen(c, 3);
+	addReplyBulkString(c, kind);
+	if (channel != NULL) {
+		addReplyBulk(c, channel->ptr, channel->len);
+	} else {
+		addReplyNull(c);
+	}
+	addReplyLongLong(c, c->pubsub ? dictSize(c->pubsub->channels) : 0);
+}
+
+// 0 if subscribed, or already was, -1 if out of memory
+static int subscribe(struct client *c, struct arg *channel)
+{
+	struct pubsub_state *ps = c->pubsub;
+	list *subscribers;
+	struct arg *ch;
+	dictEntry *de;
+
+	if (ps == NULL) {
+		if ((ps = (struct pubsub_state *)zmalloc(sizeof(struct pubsub_state))) == NULL) {
+			return -1;
+		}
+		if ((ps->channels = dictCreate(&client_channels_type, NULL)) == NULL) {
+			zfree(ps);
+			return -1;
+		}
+		ps->soft_limit_since = 0;
+		c->pubsub = ps;
+	}
+	if (dictFind(ps->channels, channel) != NULL) {
+		return 0;
+	}
+
+	if ((de = dictFind(g_server.pubsub_channels, channel)) != NULL) {
+		ch = (struct arg *)dictGetKey(de);
+		subscribers = (list *)dictGetVal(de);
+	} else {
+		ch = channel_string(channel);
+		subscribers = listCreate();
+		if (ch == NULL || subscribers == NULL ||
+			dictAdd(g_server.pubsub_channels, ch, subscribers) != DICT_OK) {
+			zfree(ch);
+			if (subscribers) listRelease(subscribers);
+			return -1;
+		}
+	}
+	if (listAddNodeTail(subscribers, c) == NULL) {
+		goto err;
+	}
+	if (dictAdd(ps->channels, ch, listLast(subscribers)) != DICT_OK) {
+		listDelNode(subscribers, listLast(subscribers));
+		goto err;
+	}
+	return 0;
+
+err:
+	if (listLength(subscribers) == 0) {
+		dictDelete(g_server.pubsub_channels, ch);
+	}
+	return -1;
+}
+
+// the reply goes first: the last subscriber frees the channel string
+static void unsubscribe(struct client *c, struct arg *channel, int notify)
+{
+	struct pubsub_state *ps = c->pubsub;
+	list *subscribers;
+	listNode *ln;
+	dictEntry *de;
+
+	if (ps == NULL || (de = dictFind(ps->channels, channel)) == NULL) {
+		if (notify) {
+			add_reply_subscription(c, "unsubscribe", channel);
+		}
+		return;
+	}
+	ln = (listNode *)dictGetVal(de);
+	dictDelete(ps->channels, channel);
+	if (notify) {
+		add_reply_subscription(c, "unsubscribe", channel);
+	}
+
+	de = dictFind(g_server.pubsub_channels, channel);
+	subscribers = (list *)dictGetVal(de);
+	listDelNode(subscribers, ln);
+	if (listLength(subscribers) == 0) {
+		dictDelete(g_server.pubsub_channels, channel);
+	}
+}
+
+static void unsubscribe_all(struct client *c, int notify)
+{
+	dictIterator *di;
+	dictEntry *de;
+
+	if (!pubsub_subscribed(c)) {
+		if (notify) {
+			add_reply_subscription(c, "unsubscribe", NULL);
+		}
+		return;
+	}
+	di = dictGetSafeIterator(c->pubsub->channels);
+	while ((de = dictNext(di)) != NULL) {
+		unsubscribe(c, (struct arg *)dictGetKey(de), notify);
+	}
+	dictReleaseIterator(di);
+}
+
+void pubsub_free_client(struct client *c)
+{
+	if (c->pubsub == NULL) {
+		return;
+	}
+	unsubscribe_all(c, 0);
+	dictRelease(c->pubsub->channels);
+	zfree(c->pubsub);
+	c->pubsub = NULL;
+}
+
+// a subscriber that doesn't read piles up messages: over the hard limit,
+// or over the soft one for too long, it is closed. not right away, the
+// caller is walking the subscribers.
+static void check_output_limits(struct client *c)
+{
+	struct pubsub_state *ps = c->pubsub;
+	unsigned long used = c->reply_bytes;
+
+	// the limits are checked to be positive when the config is loaded
+	if (g_server.pubsub_hard_limit && used >= (unsigned long long)g_server.pubsub_hard_limit) {
+		printf ("Closing a subscriber over the hard output limit, %lu bytes pending\n", used);
+		free_client_async(c);
+	} else if (g_server.pubsub_soft_limit && used >= (unsigned long long)g_server.pubsub_soft_limit) {
+		if (ps->soft_limit_since == 0) {
+			ps->soft_limit_since = g_server.unixtime;
+		} else if (g_server.unixtime - ps->soft_limit_since >= g_server.pubsub_soft_seconds) {
+			printf ("Closing a subscriber over the soft output limit for %d seconds\n",
+					g_server.pubsub_soft_seconds);
+			free_client_async(c);
+		}
+	} else {
+		ps->soft_limit_since = 0;
+	}
+}
+
+// "*3\r\n$7\r\nmessage\r\n$<len>\r\n<channel>\r\n$<len>\r\n<message>\r\n"
+static struct reply_block *create_message(struct arg *channel, struct arg *msg)
+{
+	char chlen[LONG_STR_SIZE], msglen[LONG_STR_SIZE];
+	int chlen_len, msglen_len;
+	struct reply_block *b;
+	char *p;
+
+	chlen_len = ll2string(chlen, sizeof(chlen), channel->len);
+	msglen_len = ll2string(msglen, sizeof(msglen), msg->len);
+	b = create_shared_reply_block(18 + chlen_len + 2 + channel->len +
+								  3 + msglen_len + 2 + msg->len + 2);
+	if (b == NULL) {
+		return NULL;
+	}
+	p = b->buf;
+	memcpy(p, "*3\r\n$7\r\nmessage\r\n$", 18);
+	p += 18;
+	memcpy(p, chlen, chlen_len);
+	p += chlen_len;
+	*p++ = '\r';
+	*p++ = '\n';
+	memcpy(p, channel->ptr, channel->len);
+	p += channel->len;
+	memcpy(p, "\r\n$", 3);
+	p += 3;
+	memcpy(p, msglen, msglen_len);
+	p += msglen_len;
+	*p++ = '\r';
+	*p++ = '\n';
+	memcpy(p, msg->ptr, msg->len);
+	p += msg->len;
+	*p++ = '\r';
+	*p++ = '\n';
+	return b;
+}
+
+// subscribe <channel> [channel ...]
+void command_subscribe(struct client *c)
+{
+	int j;
+
+	// messages need a connection to go to
+	if (c->flags & CLIENT_UDP) {
+		addReplyError(c, "SUBSCRIBE is not supported over UDP");
+		return;
+	}
+	for (j = 1; j < c->argc; j++) {
+		if (subscribe(c, &c->argv[j]) == -1) {
+			addReplyError(c, "out of memory subscribing");
+			return;
+		}
+		add_reply_subscription(c, "subscribe", &c->argv[j]);
+	}
+}
+
+// unsubscribe [channel ...], from all of them without arguments
+void command_unsubscribe(struct client *c)
+{
+	int j;
+
+	if (c->argc == 1) {
+		unsubscribe_all(c, 1);
+		return;
+	}
+	for (j = 1; j < c->argc; j++) {
+		unsubscribe(c, &c->argv[j], 1);
+	}
+}
+
+// publish <channel> <message>: the number of clients it went to
+void command_publish(struct client *c)
+{
+	struct reply_block *b;
+	struct client *sub;
+	long long receivers = 0;
+	listNode *ln;
+	dictEntry *de;
+	listIter li;
+
+	if ((de = dictFind(g_server.pubsub_channels, &c->argv[1])) == NULL) {
+		addReplyLongLong(c, 0);
+		return;
+	}
+	if ((b = create_message(&c->argv[1], &c->argv[2])) == NULL) {
+		addReplyError(c, "out of memory publishing");
+		return;
+	}
+	listRewind((list *)dictGetVal(de), &li);
+	while ((ln = listNext(&li)) != NULL) {
+		sub = (struct client *)ln->value;
+		// over its limits already, it goes away before the loop sleeps
+		if (sub->flags & CLIENT_CLOSE_ASAP) {
+			continue;
+		}
+		addReplySharedBlock(sub, b);
+		check_output_limits(sub);
+		receivers++;
+	}
+	release_reply_block(b);
+	addReplyLongLong(c, receivers);
+}
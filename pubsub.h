@@ -0,0 +1,29 @@
+
+#ifndef _PUBSUB_H
+#define _PUBSUB_H
+
+#include <time.h>
+#include "dict.h"
+
+struct client;
+
+// output limits of a subscriber: over the hard limit, or over the soft
+// limit for soft_seconds in a row, it is closed. 0 = no limit.
+#define DEFAULT_PUBSUB_HARD_LIMIT		(32*1024*1024)
+#define DEFAULT_PUBSUB_SOFT_LIMIT		(8*1024*1024)
+#define DEFAULT_PUBSUB_SOFT_SECONDS		60
+
+// client->pubsub of a client that subscribed once
+struct pubsub_state{
+	dict *channels;			// channel -> its node in the subscriber list
+	time_t soft_limit_since;	// over the soft limit since, 0 = not over
+};
+
+void pubsub_init();
+void pubsub_free_client(struct client *c);
+int pubsub_subscribed(struct client *c);
+void command_subscribe(struct client *c);
+void command_unsubscribe(struct client *c);
+void command_publish(struct client *c);
+
+#endif
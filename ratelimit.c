@@ -0,0 +1,281 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ratelimit.h"
+#include "zmalloc.h"
+#include "areactor.h"
+
+
+//----------------------------
+// ip -> bucket hash table
+
+static unsigned long hash_ip(uint32_t ip)
+{
+	// murmur3 finalizer, spreads the low bits we mask with
+	ip ^= ip >> 16;
+	ip *= 0x85ebca6b;
+	ip ^= ip >> 13;
+	ip *= 0xc2b2ae35;
+	ip ^= ip >> 16;
+	return ip;
+}
+
+static int table_alloc(struct ipbucket_table *t, unsigned long size)
+{
+	t->slots = zcalloc(size * sizeof(struct ipbucket));
+	if (t->slots == NULL) {
+		return -1;
+	}
+	t->size = size;
+	t->used = 0;
+	t->cursor = 0;
+	return 0;
+}
+
+static struct ipbucket *table_find(struct ipbucket_table *t, uint32_t ip)
+{
+	unsigned long mask = t->size - 1;
+	unsigned long i = hash_ip(ip) & mask;
+
+	while (t->slots[i].ip != 0) {
+		if (t->slots[i].ip == ip) {
+			return t->slots + i;
+		}
+		i = (i + 1) & mask;
+	}
+	return NULL;
+}
+
+// the caller makes sure ip is not in the table and there's a free slot
+static struct ipbucket *table_insert(struct ipbucket_table *t, uint32_t ip)
+{
+	unsigned long mask = t->size - 1;
+	unsigned long i = hash_ip(ip) & mask;
+
+	while (t->slots[i].ip != 0) {
+		i = (i + 1) & mask;
+	}
+	t->used++;
+	t->slots[i].ip = ip;
+	return t->slots + i;
+}
+
+static void table_resize(struct ipbucket_table *t, unsigned long size)
+{
+	struct ipbucket_table n;
+	unsigned long j;
+
+	if (table_alloc(&n, size) == -1) {
+		return;		// keep the old table, it still works, only slower
+	}
+	for (j = 0; j < t->size; j++) {
+		if (t->slots[j].ip != 0) {
+			*table_insert(&n, t->slots[j].ip) = t->slots[j];
+		}
+	}
+	zfree(t->slots);
+	*t = n;
+}
+
+// delete by shifting back the following entries of the probe chain,
+// so no tombstones are needed.
+static void table_delete(struct ipbucket_table *t, unsigned long i)
+{
+	unsigned long mask = t->size - 1;
+	unsigned long j = i, home;
+
+	while (1) {
+		j = (j + 1) & mask;
+		if (t->slots[j].ip == 0) {
+			break;
+		}
+		home = hash_ip(t->slots[j].ip) & mask;
+		// move j into the hole at i unless its home slot lies in (i, j]
+		if ((i <= j) ? (i < home && home <= j) : (i < home || home <= j)) {
+			continue;
+		}
+		t->slots[i] = t->slots[j];
+		i = j;
+	}
+	t->slots[i].ip = 0;
+	t->used--;
+}
+
+
+//----------------------------
+// token buckets
+
+static void bucket_refill(struct ipbucket *b, long long now)
+{
+	struct ratelimit_config *cfg = &g_server.ratelimit;
+	long long elapsed = now - b->refill_ms;
+	long long tokens;
+
+	if (elapsed <= 0) {
+		return;
+	}
+	tokens = b->accept_tokens + elapsed * cfg->accept_rate;
+	b->accept_tokens = (tokens > cfg->accept_burst*1000LL) ? cfg->accept_burst*1000LL : tokens;
+	tokens = b->request_tokens + elapsed * cfg->request_rate;
+	b->request_tokens = (tokens > cfg->request_burst*1000LL) ? cfg->request_burst*1000LL : tokens;
+	b->refill_ms = now;
+}
+
+// a full and unused bucket is the same as no bucket at all
+static int bucket_is_idle(struct ipbucket *b)
+{
+	struct ratelimit_config *cfg = &g_server.ratelimit;
+
+	return b->conns == 0 &&
+		   b->accept_tokens == cfg->accept_burst*1000LL &&
+		   b->request_tokens == cfg->request_burst*1000LL;
+}
+
+static struct ipbucket *get_bucket(uint32_t ip)
+{
+	struct ipbucket_table *t = &g_server.ipbuckets;
+	struct ipbucket *b;
+
+	if ((b = table_find(t, ip)) != NULL) {
+		return b;
+	}
+	// keep the load factor under 1/2 so probe chains stay short
+	if ((t->used + 1) * 2 > t->size) {
+		table_resize(t, t->size * 2);
+	}
+	if (t->used + 1 >= t->size) {
+		return NULL;	// the resize failed and the table is full
+	}
+	b = table_insert(t, ip);
+	b->conns = 0;
+	b->accept_tokens = g_server.ratelimit.accept_burst * 1000LL;
+	b->request_tokens = g_server.ratelimit.request_burst * 1000LL;
+	b->refill_ms = mstime();
+	return b;
+}
+
+static int ratelimit_enabled()
+{
+	struct ratelimit_config *cfg = &g_server.ratelimit;
+
+	return cfg->maxconn_per_ip || cfg->accept_rate || cfg->request_rate;
+}
+
+void ratelimit_init()
+{
+	struct ratelimit_config *cfg = &g_server.ratelimit;
+
+	// a burst of at least one token, otherwise nothing would ever pass
+	if (cfg->accept_rate && cfg->accept_burst <= 0) {
+		cfg->accept_burst = cfg->accept_rate;
+	}
+	if (cfg->request_rate && cfg->request_burst <= 0) {
+		cfg->request_burst = cfg->request_rate;
+	}
+
+	if (table_alloc(&g_server.ipbuckets, RATELIMIT_INITIAL_SIZE) == -1) {
+		printf ("Can't allocate the rate limit table\n");
+		exit(1);
+	}
+}
+
+// called for every accepted connection. on RATELIMIT_OK the connection
+// is counted against the ip and must be given back with ratelimit_release.
+int ratelimit_accept(uint32_t ip)
+{
+	struct ratelimit_config *cfg = &g_server.ratelimit;
+	struct ipbucket *b;
+
+	if (!ratelimit_enabled()) {
+		return RATELIMIT_OK;
+	}
+	if ((b = get_bucket(ip)) == NULL) {
+		return RATELIMIT_OK;	// out of memory, fail open
+	}
+
+	if (cfg->maxconn_per_ip && b->conns >= (uint32_t)cfg->maxconn_per_ip) {
+		g_server.stat_rejected_conns++;
+		return RATELIMIT_ERR_CONNS;
+	}
+	if (cfg->accept_rate) {
+		bucket_refill(b, mstime());
+		if (b->accept_tokens < 1000) {
+			g_server.stat_rejected_conns++;
+			return RATELIMIT_ERR_RATE;
+		}
+		b->accept_tokens -= 1000;
+	}
+	b->conns++;
+	return RATELIMIT_OK;
+}
+
+void ratelimit_release(uint32_t ip)
+{
+	struct ipbucket *b;
+
+	if (!ratelimit_enabled()) {
+		return;
+	}
+	if ((b = table_find(&g_server.ipbuckets, ip)) != NULL && b->conns > 0) {
+		b->conns--;
+	}
+}
+
+int ratelimit_request(uint32_t ip)
+{
+	struct ipbucket *b;
+
+	if (g_server.ratelimit.request_rate == 0) {
+		return RATELIMIT_OK;
+	}
+	if ((b = get_bucket(ip)) == NULL) {
+		return RATELIMIT_OK;
+	}
+
+	bucket_refill(b, mstime());
+	if (b->request_tokens < 1000) {
+		g_server.stat_rejected_requests++;
+		return RATELIMIT_ERR_RATE;
+	}
+	b->request_tokens -= 1000;
+	return RATELIMIT_OK;
+}
+
+// drop buckets that went back to the initial state. only a few slots are
+// checked per call, the cursor walks the whole table in a few seconds.
+void ratelimit_cron()
+{
+	struct ipbucket_table *t = &g_server.ipbuckets;
+	long long now = mstime();
+	int slots = RATELIMIT_CRON_SLOTS;
+	struct ipbucket *b;
+
+	if (t->used == 0) {
+		return;
+	}
+
+	while (slots-- && t->used) {
+		t->cursor &= t->size - 1;
+		b = t->slots + t->cursor;
+		if (b->ip != 0) {
+			bucket_refill(b, now);
+			if (bucket_is_idle(b)) {
+				// the shift may move an entry into this slot, look again
+				table_delete(t, t->cursor);
+				continue;
+			}
+		}
+		t->cursor++;
+	}
+
+	// give memory back after a storm is over
+	if (t->size > RATELIMIT_INITIAL_SIZE && t->used * 8 < t->size) {
+		table_resize(t, t->size / 2);
+	}
+}
+
+unsigned long ratelimit_tracked_ips()
+{
+	return g_server.ipbuckets.used;
+}
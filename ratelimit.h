@@ -0,0 +1,48 @@
+
+#ifndef _RATELIMIT_H
+#define _RATELIMIT_H
+
+#include <stdint.h>
+
+#define RATELIMIT_OK			0
+#define RATELIMIT_ERR_RATE		1	// token bucket is empty
+#define RATELIMIT_ERR_CONNS		2	// too many connections from this ip
+
+#define RATELIMIT_INITIAL_SIZE	64	// slots, always a power of two
+#define RATELIMIT_CRON_SLOTS	128	// slots checked for expire per cron call
+#define RATELIMIT_MAX_BURST		1000000	// so burst*1000 tokens fit in 32 bits
+
+// one entry per peer ip. tokens are kept in 1/1000 units so the
+// refill doesn't need floating point.
+struct ipbucket{
+	uint32_t ip;				// IPv4 address in network order, 0 = free slot
+	uint32_t conns;				// open connections from this ip
+	uint32_t accept_tokens;
+	uint32_t request_tokens;
+	long long refill_ms;		// last time the tokens were refilled
+};
+
+// open addressing table with linear probing
+struct ipbucket_table{
+	struct ipbucket *slots;
+	unsigned long size;			// power of two
+	unsigned long used;
+	unsigned long cursor;		// next slot the expire cron looks at
+};
+
+struct ratelimit_config{
+	int maxconn_per_ip;			// 0 = unlimited
+	int accept_rate;			// accepted connections per second, 0 = unlimited
+	int accept_burst;
+	int request_rate;			// requests per second, 0 = unlimited
+	int request_burst;
+};
+
+void ratelimit_init();
+int ratelimit_accept(uint32_t ip);
+void ratelimit_release(uint32_t ip);
+int ratelimit_request(uint32_t ip);
+void ratelimit_cron();
+unsigned long ratelimit_tracked_ips();
+
+#endif
@@ -0,0 +1,537 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include "rdb.h"
+#include "zmalloc.h"
+#include "areactor.h"
+#include "client.h"
+#include "network.h"
+#include "db.h"
+#include "bio.h"
+#include "util.h"
+#include "replication.h"
+
+
+// snapshots: SAVE writes the keyspace in the main process, BGSAVE forks
+// and the child writes it while the parent goes on serving, sharing the
+// memory copy on write. the child reports its progress through a pipe.
+// at startup the file is mapped and loaded straight into the tables.
+
+struct rdb_writer{
+	int fd;
+	size_t len;
+	char buf[RDB_BUF_LEN];
+};
+
+static int writer_flush(struct rdb_writer *w)
+{
+	if (w->len && write_all(w->fd, w->buf, w->len) != (ssize_t)w->len) {
+		return -1;
+	}
+	w->len = 0;
+	return 0;
+}
+
+static int writer_append(struct rdb_writer *w, const void *p, size_t len)
+{
+	if (w->len + len > RDB_BUF_LEN) {
+		if (writer_flush(w) == -1) {
+			return -1;
+		}
+		// a big value goes out as it is
+		if (len > RDB_BUF_LEN) {
+			return write_all(w->fd, p, len) == (ssize_t)len ? 0 : -1;
+		}
+	}
+	memcpy(w->buf + w->len, p, len);
+	w->len += len;
+	return 0;
+}
+
+static int write_byte(struct rdb_writer *w, unsigned char b)
+{
+	return writer_append(w, &b, 1);
+}
+
+static int write_varint(struct rdb_writer *w, uint64_t v)
+{
+	unsigned char buf[10];
+	int n = 0;
+
+	while (v >= 0x80) {
+		buf[n++] = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	buf[n++] = v;
+	return writer_append(w, buf, n);
+}
+
+static int write_int64(struct rdb_writer *w, long long v)
+{
+	unsigned char buf[8];
+	int j;
+
+	for (j = 0; j < 8; j++) {
+		buf[j] = ((uint64_t)v >> (8 * j)) & 0xff;
+	}
+	return writer_append(w, buf, 8);
+}
+
+static int write_string(struct rdb_writer *w, struct arg *s)
+{
+	if (write_varint(w, s->len) == -1) {
+		return -1;
+	}
+	return writer_append(w, s->ptr, s->len);
+}
+
+static void rdb_temp_filename(char *buf, size_t len, char *filename, pid_t pid)
+{
+	// next to the file, so the rename is atomic
+	snprintf(buf, len, "%s.tmp.%d", filename, (int)pid);
+}
+
+#if defined(__linux__)
+// bytes of this process that are no longer shared with its parent, -1
+// if unknown
+static long long get_private_dirty()
+{
+	char line[256];
+	long long kb, total = 0;
+	FILE *fp;
+
+	fp = fopen("/proc/self/smaps_rollup", "r");
+	if (fp == NULL) {
+		return -1;
+	}
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (strncmp(line, "Private_Dirty:", 14) == 0) {
+			kb = strtoll(line + 14, NULL, 10);
+			total += kb * 1024;
+		}
+	}
+	fclose(fp);
+	return total;
+}
+#else
+// no /proc to read it from
+static long long get_private_dirty()
+{
+	return -1;
+}
+#endif
+
+static void send_child_info(int fd, int type, long long keys, long long total)
+{
+	struct rdb_child_info info;
+
+	info.type = type;
+	info.keys = keys;
+	info.total = total;
+	info.cow = (type == RDB_CHILD_DONE) ? get_private_dirty() : -1;
+	// less than PIPE_BUF, the write is atomic. if the parent can't keep
+	// up the progress is lost, nothing else
+	if (write(fd, &info, sizeof(info)) != sizeof(info)) {
+		return;
+	}
+}
+
+// write the keyspace to a temp file and rename it to filename. in a
+// child, pipe_fd gets the progress. 0 if saved.
+static int rdb_save_to(char *filename, int pipe_fd)
+{
+	char tmpfile[256];
+	struct rdb_writer *w;
+	struct arg *key, *val;
+	dictIterator *di = NULL;
+	dictEntry *de;
+	long long now = mstime(), last_report = now, expire, keys = 0;
+	long long total = dictSize(g_server.db);
+
+	rdb_temp_filename(tmpfile, sizeof(tmpfile), filename, getpid());
+	if ((w = (struct rdb_writer *)zmalloc(sizeof(struct rdb_writer))) == NULL) {
+		printf ("Out of memory saving the snapshot\n");
+		return -1;
+	}
+	w->len = 0;
+	w->fd = open(tmpfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (w->fd == -1) {
+		printf ("Can't open %s to save the snapshot: %s\n", tmpfile, strerror(errno));
+		zfree(w);
+		return -1;
+	}
+
+	if (writer_append(w, RDB_MAGIC, RDB_MAGIC_LEN) == -1 ||
+		write_byte(w, RDB_OPCODE_RESIZE) == -1 ||
+		write_varint(w, dictSize(g_server.db)) == -1 ||
+		write_varint(w, dictSize(g_server.expires)) == -1) {
+		goto werr;
+	}
+	// a safe iterator: db_get_expire must not move the db entries around
+	if ((di = dictGetSafeIterator(g_server.db)) == NULL) {
+		goto werr;
+	}
+	while ((de = dictNext(di)) != NULL) {
+		key = (struct arg *)dictGetKey(de);
+		val = (struct arg *)dictGetVal(de);
+		expire = db_get_expire(key);
+		if (expire != -1 && expire < now) {
+			continue;
+		}
+		if (expire != -1) {
+			if (write_byte(w, RDB_OPCODE_EXPIRE_KV) == -1 || write_int64(w, expire) == -1) {
+				goto werr;
+			}
+		} else if (write_byte(w, RDB_OPCODE_KV) == -1) {
+			goto werr;
+		}
+		if (write_string(w, key) == -1 || write_string(w, val) == -1) {
+			goto werr;
+		}
+
+		keys++;
+		if (pipe_fd != -1 && (keys % RDB_PROGRESS_KEYS) == 0 && mstime() - last_report >= 1000) {
+			send_child_info(pipe_fd, RDB_CHILD_PROGRESS, keys, total);
+			last_report = mstime();
+		}
+	}
+	dictReleaseIterator(di);
+	di = NULL;
+
+	if (write_byte(w, RDB_OPCODE_EOF) == -1 || write_varint(w, keys) == -1 ||
+		writer_flush(w) == -1 || data_fsync(w->fd) == -1) {
+		goto werr;
+	}
+	if (close(w->fd) == -1) {
+		w->fd = -1;
+		goto werr;
+	}
+	w->fd = -1;
+	if (rename(tmpfile, filename) == -1) {
+		goto werr;
+	}
+	zfree(w);
+	if (pipe_fd != -1) {
+		send_child_info(pipe_fd, RDB_CHILD_DONE, keys, total);
+	}
+	return 0;
+
+werr:
+	printf ("Error saving the snapshot to %s: %s\n", tmpfile, strerror(errno));
+	if (di) dictReleaseIterator(di);
+	if (w->fd != -1) close(w->fd);
+	unlink(tmpfile);
+	zfree(w);
+	return -1;
+}
+
+// save in the main process, nothing else runs meanwhile
+int rdb_save(char *filename)
+{
+	if (rdb_save_to(filename, -1) == -1) {
+		return -1;
+	}
+	g_server.dirty = 0;
+	g_server.lastsave = time(NULL);
+	g_server.lastbgsave_ok = 1;
+	return 0;
+}
+
+static void read_child_info()
+{
+	struct rdb_child_info info;
+	ssize_t n;
+
+	while ((n = read(g_server.rdb_child_pipe, &info, sizeof(info))) == sizeof(info)) {
+		g_server.rdb_child_keys = info.keys;
+		g_server.rdb_child_total = info.total;
+		if (info.type == RDB_CHILD_DONE) {
+			g_server.rdb_child_cow = info.cow;
+		} else {
+			printf ("Background saving: %lld of %lld keys\n", info.keys, info.total);
+		}
+	}
+	// the child closed its end, it's exiting: stop watching until
+	// rdb_cron reaps it
+	if (n == 0) {
+		aeDeleteFileEvent(g_server.el, g_server.rdb_child_pipe, AE_READABLE);
+	}
+}
+
+static void rdb_child_info_handler(aeEventLoop *el, int fd, void *privdata, int mask)
+{
+	NOTUSED(el);
+	NOTUSED(fd);
+	NOTUSED(privdata);
+	NOTUSED(mask);
+
+	read_child_info();
+}
+
+// fork a child that saves the keyspace. -1 if a child is already
+// running or it can't be started.
+int rdb_save_background()
+{
+	int pipefds[2];
+	pid_t pid;
+
+	if (has_active_child_process()) {
+		return -1;
+	}
+	if (pipe(pipefds) == -1) {
+		printf ("Can't save in the background, pipe: %s\n", strerror(errno));
+		return -1;
+	}
+	pid = fork();
+	if (pid == 0) {
+		close(pipefds[0]);
+		_exit(rdb_save_to(g_server.rdb_filename, pipefds[1]) == 0 ? 0 : 1);
+	}
+	close(pipefds[1]);
+	if (pid == -1) {
+		printf ("Can't save in the background, fork: %s\n", strerror(errno));
+		close(pipefds[0]);
+		return -1;
+	}
+
+	printf ("Background saving started by pid %d\n", (int)pid);
+	g_server.rdb_child_pid = pid;
+	g_server.rdb_child_pipe = pipefds[0];
+	g_server.rdb_child_keys = 0;
+	g_server.rdb_child_total = 0;
+	g_server.rdb_child_cow = -1;
+	g_server.dirty_before_bgsave = g_server.dirty;
+	anetNonBlock(NULL, pipefds[0]);
+	// without the event the save still works, only the progress is lost
+	if (aeCreateFileEvent(g_server.el, pipefds[0], AE_READABLE, rdb_child_info_handler, NULL) == AE_ERR) {
+		printf ("Can't watch the progress of the background save\n");
+	}
+	// resizing would copy the whole table on write in the parent
+	dictDisableResize();
+	return 0;
+}
+
+void background_save_done_handler(int exitcode, int bysignal)
+{
+	char tmpfile[256];
+
+	// what the child wrote before it exited
+	read_child_info();
+	aeDeleteFileEvent(g_server.el, g_server.rdb_child_pipe, AE_READABLE);
+	close(g_server.rdb_child_pipe);
+	g_server.rdb_child_pipe = -1;
+
+	if (!bysignal && exitcode == 0) {
+		if (g_server.rdb_child_cow >= 0) {
+			printf ("Background saving terminated with success, %lld keys, %lld MB copied on write\n",
+					g_server.rdb_child_keys, g_server.rdb_child_cow / (1024*1024));
+		} else {
+			printf ("Background saving terminated with success, %lld keys\n",
+					g_server.rdb_child_keys);
+		}
+		g_server.dirty -= g_server.dirty_before_bgsave;
+		g_server.lastsave = time(NULL);
+		g_server.lastbgsave_ok = 1;
+	} else {
+		printf ("Background saving failed, %s %d\n",
+				bysignal ? "signal" : "exit code", bysignal ? bysignal : exitcode);
+		// a killed child leaves its temp file behind
+		rdb_temp_filename(tmpfile, sizeof(tmpfile), g_server.rdb_filename, g_server.rdb_child_pid);
+		unlink(tmpfile);
+		g_server.lastbgsave_ok = 0;
+	}
+	g_server.rdb_child_pid = -1;
+	dictEnableResize();
+	// replicas waiting for this snapshot
+	replication_bgsave_done(!bysignal && exitcode == 0);
+}
+
+// reap the saving child
+void rdb_cron()
+{
+	int statloc;
+
+	if (g_server.rdb_child_pid != -1 &&
+		waitpid(g_server.rdb_child_pid, &statloc, WNOHANG) == g_server.rdb_child_pid) {
+		background_save_done_handler(WIFEXITED(statloc) ? WEXITSTATUS(statloc) : -1,
+									 WIFSIGNALED(statloc) ? WTERMSIG(statloc) : 0);
+	}
+}
+
+static int read_varint(const unsigned char **p, const unsigned char *end, uint64_t *v)
+{
+	unsigned char b;
+	int shift = 0;
+
+	*v = 0;
+	while (*p < end && shift < 64) {
+		b = *(*p)++;
+		*v |= (uint64_t)(b & 0x7f) << shift;
+		if (!(b & 0x80)) {
+			return 0;
+		}
+		shift += 7;
+	}
+	return -1;
+}
+
+static int read_string(const unsigned char **p, const unsigned char *end, struct arg *s)
+{
+	uint64_t len;
+
+	if (read_varint(p, end, &len) == -1 || len > (uint64_t)(end - *p)) {
+		return -1;
+	}
+	s->ptr = (char *)*p;
+	s->len = len;
+	*p += len;
+	return 0;
+}
+
+// load the snapshot in filename into the empty keyspace. the file is
+// mapped, the tables are sized from its header and every pair is added
+// as it is, no command runs. keys already expired are skipped. 0 if
+// loaded or there is no file, -1 if it is unreadable or corrupt.
+int rdb_load(char *filename)
+{
+	long long start = ustime(), now = mstime(), expire;
+	const unsigned char *base, *p, *end;
+	uint64_t nkeys, nexpires, count, loaded = 0;
+	struct arg key, val;
+	struct stat sb;
+	int fd, opcode, j;
+
+	fd = open(filename, O_RDONLY);
+	if (fd == -1) {
+		if (errno == ENOENT) {
+			return 0;
+		}
+		printf ("Can't open the snapshot %s: %s\n", filename, strerror(errno));
+		return -1;
+	}
+	if (fstat(fd, &sb) == -1 || sb.st_size < RDB_MAGIC_LEN) {
+		printf ("Can't read the snapshot %s\n", filename);
+		close(fd);
+		return -1;
+	}
+	base = (const unsigned char *)mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (base == MAP_FAILED) {
+		printf ("Can't map the snapshot %s: %s\n", filename, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	madvise((void *)base, sb.st_size, MADV_SEQUENTIAL);
+	p = base;
+	end = base + sb.st_size;
+
+	if (memcmp(p, RDB_MAGIC, RDB_MAGIC_LEN) != 0) {
+		printf ("%s is not a snapshot of this version\n", filename);
+		goto err;
+	}
+	p += RDB_MAGIC_LEN;
+
+	while (1) {
+		if (p == end) {
+			printf ("The snapshot %s is truncated\n", filename);
+			goto err;
+		}
+		opcode = *p++;
+		if (opcode == RDB_OPCODE_RESIZE) {
+			if (read_varint(&p, end, &nkeys) == -1 || read_varint(&p, end, &nexpires) == -1) {
+				goto bad;
+			}
+			// no rehash while loading
+			if (nkeys) dictExpand(g_server.db, nkeys);
+			if (nexpires) dictExpand(g_server.expires, nexpires);
+		} else if (opcode == RDB_OPCODE_KV || opcode == RDB_OPCODE_EXPIRE_KV) {
+			expire = -1;
+			if (opcode == RDB_OPCODE_EXPIRE_KV) {
+				if (end - p < 8) {
+					goto bad;
+				}
+				expire = 0;
+				for (j = 0; j < 8; j++) {
+					expire |= (long long)((uint64_t)p[j] << (8 * j));
+				}
+				p += 8;
+			}
+			if (read_string(&p, end, &key) == -1 || read_string(&p, end, &val) == -1) {
+				goto bad;
+			}
+			loaded++;
+			if (expire != -1 && expire < now) {
+				continue;
+			}
+			if (db_add(&key, &val) == -1 ||
+				(expire != -1 && db_set_expire(&key, expire) == -1)) {
+				printf ("Can't add a key of the snapshot, duplicated or out of memory\n");
+				goto err;
+			}
+		} else if (opcode == RDB_OPCODE_EOF) {
+			if (read_varint(&p, end, &count) == -1 || count != loaded) {
+				goto bad;
+			}
+			break;
+		} else {
+			goto bad;
+		}
+	}
+
+	munmap((void *)base, sb.st_size);
+	close(fd);
+	g_server.lastsave = time(NULL);
+	printf ("Snapshot loaded: %lu keys in %.3f seconds\n",
+			dictSize(g_server.db), (double)(ustime() - start) / 1000000);
+	return 0;
+
+bad:
+	printf ("Bad snapshot %s at offset %ld\n", filename, (long)(p - base));
+err:
+	munmap((void *)base, sb.st_size);
+	close(fd);
+	return -1;
+}
+
+void command_save(struct client *c)
+{
+	if (g_server.rdb_child_pid != -1) {
+		addReplyError(c, "Background save already in progress");
+		return;
+	}
+	if (rdb_save(g_server.rdb_filename) == -1) {
+		addReplyError(c, "Can't save the snapshot, see the log");
+		return;
+	}
+	addReplyStatus(c, "OK");
+}
+
+void command_bgsave(struct client *c)
+{
+	if (g_server.rdb_child_pid != -1) {
+		addReplyError(c, "Background save already in progress");
+		return;
+	}
+	if (g_server.aof_child_pid != -1) {
+		addReplyError(c, "Can't BGSAVE while AOF log rewriting is in progress");
+		return;
+	}
+	if (rdb_save_background() == -1) {
+		addReplyError(c, "Can't start the background save, see the log");
+		return;
+	}
+	addReplyStatus(c, "Background saving started");
+}
+
+// unix time of the last successful save
+void command_lastsave(struct client *c)
+{
+	addReplyLongLong(c, g_server.lastsave);
+}
@@ -0,0 +1,53 @@
+
+#ifndef _RDB_H
+#define _RDB_H
+
+#include <stdint.h>
+
+struct client;
+
+// snapshot file, all integers little endian:
+//
+//   "ARDB0001"
+//   RDB_OPCODE_RESIZE <keys> <keys with a ttl>	sizes the tables before loading
+//   RDB_OPCODE_KV <key> <value>
+//   RDB_OPCODE_EXPIRE_KV <unix ms, 8 bytes> <key> <value>
+//   ...
+//   RDB_OPCODE_EOF <keys>
+//
+// counts and lengths are varints (7 bits per byte, low first), a string
+// is its length and the bytes.
+
+#define RDB_MAGIC		"ARDB0001"
+#define RDB_MAGIC_LEN	8
+
+#define RDB_OPCODE_KV			0
+#define RDB_OPCODE_EXPIRE_KV	1
+#define RDB_OPCODE_RESIZE		0xfb
+#define RDB_OPCODE_EOF			0xff
+
+#define DEFAULT_RDB_FILENAME	"dump.rdb"
+#define RDB_BUF_LEN			(64*1024)	// the child writes in blocks of this
+#define RDB_PROGRESS_KEYS	1024		// keys saved between two looks at the clock
+
+// what the saving child tells the parent through the pipe
+#define RDB_CHILD_PROGRESS	0
+#define RDB_CHILD_DONE		1
+
+struct rdb_child_info{
+	int type;				// RDB_CHILD_*
+	long long keys;			// saved so far
+	long long total;		// to save
+	long long cow;			// bytes copied on write, -1 if unknown
+};
+
+int rdb_save(char *filename);
+int rdb_save_background();
+void background_save_done_handler(int exitcode, int bysignal);
+int rdb_load(char *filename);
+void rdb_cron();
+void command_save(struct client *c);
+void command_bgsave(struct client *c);
+void command_lastsave(struct client *c);
+
+#endif
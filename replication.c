@@ -0,0 +1,676 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include "replication.h"
+#include "zmalloc.h"
+#include "areactor.h"
+#include "client.h"
+#include "network.h"
+#include "db.h"
+#include "bio.h"
+#include "util.h"
+
+
+// replication, primary side: what propagate() sends to the AOF also goes
+// to one ring buffer, the backlog. a replica that sent SYNC gets a
+// snapshot made by a BGSAVE, then the stream from the offset the backlog
+// had when the child forked. every replica writes from the backlog at its
+// own offset, a replica that falls more than the backlog behind is
+// closed and syncs again.
+//
+// replica side (--replicaof): server_cron connects, sends SYNC, the
+// snapshot replaces the keyspace and the socket becomes the master
+// client, whose commands run like any other but without replies.
+
+static char sync_header[REPL_HEADER_MAX];	// FULLRESYNC and $<size> lines read so far
+static int sync_header_len;
+static long long sync_offset;				// from FULLRESYNC
+static char sync_tmpfile[256];
+
+// the command as the AOF and the replicas get it, see cat_propagated_command
+void propagate(struct command *cmd, int argc, struct arg *argv)
+{
+	static struct aof_buffer b;
+
+	if (g_server.aof_fd == -1 && g_server.repl_backlog == NULL) {
+		return;
+	}
+	b.len = 0;
+	cat_propagated_command(&b, cmd, argc, argv);
+	if (g_server.aof_fd != -1) {
+		feed_append_only_file(b.data, b.len);
+	}
+	if (g_server.repl_backlog != NULL) {
+		feed_replication_backlog(b.data, b.len);
+	}
+}
+
+
+//-------------------------
+// primary
+//-
+static void create_replication_backlog()
+{
+	g_server.repl_backlog = (char *)zmalloc(g_server.repl_backlog_size);
+	if (g_server.repl_backlog == NULL) {
+		printf ("Out of memory creating the replication backlog\n");
+		exit(1);
+	}
+	g_server.repl_backlog_histlen = 0;
+}
+
+static void send_to_replica(aeEventLoop *el, int fd, void *privdata, int mask);
+
+static void wake_replica(struct client *c)
+{
+	if (c->repl->writing) {
+		return;
+	}
+	if (aeCreateFileEvent(g_server.el, c->fd, AE_WRITABLE, send_to_replica, c) == AE_ERR) {
+		printf ("Can't write to the replica on fd %d, closing it\n", c->fd);
+		freeClient(c);
+		return;
+	}
+	c->repl->writing = 1;
+}
+
+// byte i of the stream is at i % repl_backlog_size
+void feed_replication_backlog(const char *p, size_t len)
+{
+	long long pos, n;
+	struct client *c;
+	listNode *ln;
+	listIter li;
+
+	g_server.repl_backlog_histlen += len;
+	if (g_server.repl_backlog_histlen > g_server.repl_backlog_size) {
+		g_server.repl_backlog_histlen = g_server.repl_backlog_size;
+	}
+	while (len) {
+		pos = g_server.master_repl_offset % g_server.repl_backlog_size;
+		n = g_server.repl_backlog_size - pos;
+		if (n > (long long)len) {
+			n = len;
+		}
+		memcpy(g_server.repl_backlog + pos, p, n);
+		g_server.master_repl_offset += n;
+		p += n;
+		len -= n;
+	}
+
+	listRewind(g_server.replicas, &li);
+	while ((ln = listNext(&li)) != NULL) {
+		c = (struct client *)ln->value;
+		if (c->repl->state == REPLICA_STATE_ONLINE) {
+			wake_replica(c);
+		}
+	}
+}
+
+// writable handler of a replica: the snapshot, then the backlog from its
+// offset on, as much as the socket takes
+static void send_to_replica(aeEventLoop *el, int fd, void *privdata, int mask)
+{
+	struct client *c = (struct client *)privdata;
+	struct replica *r = c->repl;
+	char buf[IOBUF_LEN];
+	ssize_t nread, nwritten;
+	long long pos, len;
+
+	NOTUSED(mask);
+
+	if (r->state == REPLICA_STATE_SEND_BULK) {
+		if (r->preamble_pos < r->preamble_len) {
+			nwritten = write(fd, r->preamble + r->preamble_pos, r->preamble_len - r->preamble_pos);
+			if (nwritten == -1) {
+				goto werr;
+			}
+			r->preamble_pos += nwritten;
+			return;
+		}
+		if (lseek(r->dbfd, r->dboff, SEEK_SET) == -1 ||
+			(nread = read(r->dbfd, buf, sizeof(buf))) <= 0) {
+			printf ("Can't read the snapshot for the replica on fd %d\n", fd);
+			freeClient(c);
+			return;
+		}
+		if ((nwritten = write(fd, buf, nread)) == -1) {
+			goto werr;
+		}
+		r->dboff += nwritten;
+		if (r->dboff < r->dbsize) {
+			return;
+		}
+		close(r->dbfd);
+		r->dbfd = -1;
+		r->state = REPLICA_STATE_ONLINE;
+		r->ack_time = g_server.unixtime;
+		printf ("Snapshot sent to the replica on fd %d, streaming from offset %lld\n", fd, r->offset);
+	}
+
+	while (r->offset < g_server.master_repl_offset) {
+		if (r->offset < g_server.master_repl_offset - g_server.repl_backlog_histlen) {
+			printf ("The replica on fd %d fell out of the backlog, closing it\n", fd);
+			freeClient(c);
+			return;
+		}
+		pos = r->offset % g_server.repl_backlog_size;
+		len = g_server.master_repl_offset - r->offset;
+		if (len > g_server.repl_backlog_size - pos) {
+			len = g_server.repl_backlog_size - pos;
+		}
+		if ((nwritten = write(fd, g_server.repl_backlog + pos, len)) == -1) {
+			goto werr;
+		}
+		r->offset += nwritten;
+		// the socket is full
+		if (nwritten < len) {
+			return;
+		}
+	}
+	aeDeleteFileEvent(el, fd, AE_WRITABLE);
+	r->writing = 0;
+	return;
+
+werr:
+	if (errno == EAGAIN) {
+		return;
+	}
+	printf ("Error writing to the replica on fd %d: %s\n", fd, strerror(errno));
+	freeClient(c);
+}
+
+// one BGSAVE serves every replica waiting for a snapshot
+static void start_bgsave_for_replication()
+{
+	struct client *c;
+	listNode *ln;
+	listIter li;
+	int waiting = 0;
+
+	listRewind(g_server.replicas, &li);
+	while ((ln = listNext(&li)) != NULL) {
+		c = (struct client *)ln->value;
+		waiting += (c->repl->state == REPLICA_STATE_WAIT_BGSAVE_START);
+	}
+	if (!waiting || has_active_child_process() || rdb_save_background() == -1) {
+		return;
+	}
+
+	// the snapshot has the keyspace as it is now, the stream goes on
+	// from here
+	listRewind(g_server.replicas, &li);
+	while ((ln = listNext(&li)) != NULL) {
+		c = (struct client *)ln->value;
+		if (c->repl->state == REPLICA_STATE_WAIT_BGSAVE_START) {
+			c->repl->state = REPLICA_STATE_WAIT_BGSAVE_END;
+			c->repl->offset = g_server.master_repl_offset;
+		}
+	}
+}
+
+// called when a background save ended, ok if it succeeded
+void replication_bgsave_done(int ok)
+{
+	struct replica *r;
+	struct client *c;
+	struct stat sb;
+	listNode *ln;
+	listIter li;
+
+	listRewind(g_server.replicas, &li);
+	while ((ln = listNext(&li)) != NULL) {
+		c = (struct client *)ln->value;
+		r = c->repl;
+		if (r->state != REPLICA_STATE_WAIT_BGSAVE_END) {
+			continue;
+		}
+		if (!ok) {
+			printf ("Background save for the replica on fd %d failed, closing it\n", c->fd);
+			freeClient(c);
+			continue;
+		}
+		// opened now, the next save may replace the file meanwhile
+		if ((r->dbfd = open(g_server.rdb_filename, O_RDONLY)) == -1 || fstat(r->dbfd, &sb) == -1) {
+			printf ("Can't open the snapshot for the replica on fd %d: %s\n", c->fd, strerror(errno));
+			freeClient(c);
+			continue;
+		}
+		r->dboff = 0;
+		r->dbsize = sb.st_size;
+		r->preamble_len = snprintf(r->preamble, sizeof(r->preamble), "+FULLRESYNC %lld\r\n$%lld\r\n",
+								   r->offset, (long long)sb.st_size);
+		r->preamble_pos = 0;
+		r->state = REPLICA_STATE_SEND_BULK;
+		wake_replica(c);
+	}
+	start_bgsave_for_replication();
+}
+
+void replication_free_client(struct client *c)
+{
+	listNode *ln;
+
+	if (c == g_server.master) {
+		printf ("Connection with the primary lost\n");
+		g_server.master = NULL;
+		g_server.repl_state = REPL_STATE_CONNECT;
+	}
+	if (c->repl == NULL) {
+		return;
+	}
+	if ((ln = listSearchKey(g_server.replicas, c)) != NULL) {
+		listDelNode(g_server.replicas, ln);
+	}
+	if (c->repl->dbfd != -1) {
+		close(c->repl->dbfd);
+	}
+	zfree(c->repl);
+	c->repl = NULL;
+}
+
+// SYNC: the client becomes a replica, see replication.h
+void command_sync(struct client *c)
+{
+	struct replica *r;
+
+	if (c->repl != NULL) {
+		return;
+	}
+	if (c->flags & (CLIENT_UDP | CLIENT_AOF | CLIENT_MULTI)) {
+		addReplyError(c, "SYNC needs a connection of its own");
+		return;
+	}
+	if (g_server.masterhost != NULL) {
+		addReplyError(c, "a replica can't have replicas");
+		return;
+	}
+	// the stream starts right after the SYNC reply
+	if (c->bufpos || listLength(c->reply)) {
+		addReplyError(c, "SYNC is invalid with pending output");
+		return;
+	}
+	if ((r = (struct replica *)zcalloc(sizeof(struct replica))) == NULL ||
+		listAddNodeTail(g_server.replicas, c) == NULL) {
+		zfree(r);
+		addReplyError(c, "out of memory adding the replica");
+		return;
+	}
+	r->state = REPLICA_STATE_WAIT_BGSAVE_START;
+	r->dbfd = -1;
+	r->ack_time = g_server.unixtime;
+	c->repl = r;
+	// replies would go in the middle of the stream
+	c->flags |= CLIENT_REPLICA;
+	if (g_server.repl_backlog == NULL) {
+		create_replication_backlog();
+	}
+	printf ("Replica on fd %d asks for a full sync\n", c->fd);
+	start_bgsave_for_replication();
+}
+
+// REPLCONF ACK <offset>: how far the replica got. REPLCONF PING: the
+// primary is alive, sent in the stream when there's nothing else. no
+// reply to either.
+void command_replconf(struct client *c)
+{
+	long long offset;
+
+	if (strcasecmp(c->argv[1].ptr, "ping") == 0) {
+		return;
+	}
+	if (strcasecmp(c->argv[1].ptr, "ack") != 0 || c->argc != 3) {
+		addReplyErrorFormat(c, "unknown REPLCONF option '%.64s'", c->argv[1].ptr);
+		return;
+	}
+	if (c->repl == NULL || !string2ll(c->argv[2].ptr, c->argv[2].len, &offset)) {
+		return;
+	}
+	c->repl->ack_offset = offset;
+	c->repl->ack_time = g_server.unixtime;
+}
+
+
+//-------------------------
+// replica
+//-
+static void cancel_sync()
+{
+	aeDeleteFileEvent(g_server.el, g_server.repl_transfer_s, AE_READABLE | AE_WRITABLE);
+	close(g_server.repl_transfer_s);
+	g_server.repl_transfer_s = -1;
+	if (g_server.repl_transfer_fd != -1) {
+		close(g_server.repl_transfer_fd);
+		unlink(sync_tmpfile);
+		g_server.repl_transfer_fd = -1;
+	}
+	g_server.repl_state = REPL_STATE_CONNECT;
+}
+
+// the whole snapshot is in sync_tmpfile: it replaces the keyspace and the
+// socket carries the stream from now on
+static void finish_sync(int fd)
+{
+	struct sockaddr_in sa;
+	socklen_t salen = sizeof(sa);
+	struct client *c;
+
+	if (data_fsync(g_server.repl_transfer_fd) == -1 ||
+		rename(sync_tmpfile, g_server.rdb_filename) == -1) {
+		printf ("Can't store the snapshot from the primary: %s\n", strerror(errno));
+		cancel_sync();
+		return;
+	}
+	close(g_server.repl_transfer_fd);
+	g_server.repl_transfer_fd = -1;
+
+	dictEmpty(g_server.expires);
+	dictEmpty(g_server.db);
+	if (rdb_load(g_server.rdb_filename) == -1) {
+		printf ("Can't load the snapshot from the primary\n");
+		cancel_sync();
+		return;
+	}
+
+	aeDeleteFileEvent(g_server.el, fd, AE_READABLE);
+	memset(&sa, 0, sizeof(sa));
+	getpeername(fd, (struct sockaddr *)&sa, &salen);
+	if ((c = create_client(fd, sa.sin_addr.s_addr, g_server.masterport)) == NULL) {
+		printf ("Can't create the client for the primary\n");
+		close(fd);
+		g_server.repl_transfer_s = -1;
+		g_server.repl_state = REPL_STATE_CONNECT;
+		return;
+	}
+	c->flags |= CLIENT_MASTER;
+	g_server.master = c;
+	g_server.master_repl_offset = sync_offset;
+	g_server.repl_transfer_s = -1;
+	g_server.repl_state = REPL_STATE_CONNECTED;
+	printf ("Synced with the primary %s:%d, %lld keys, offset %lld\n", g_server.masterhost,
+			g_server.masterport, (long long)dictSize(g_server.db), sync_offset);
+
+	// the old file doesn't lead to the new keyspace
+	if (g_server.aof_fd != -1) {
+		restart_aof_rewrite();
+	}
+}
+
+// read the FULLRESYNC and $<size> lines a byte at a time, the snapshot
+// follows right after them. 0 once the size is known, -1 on error.
+static int read_sync_header(int fd)
+{
+	ssize_t nread;
+	char ch;
+
+	while (g_server.repl_transfer_size == -1) {
+		if ((nread = read(fd, &ch, 1)) == -1 && errno == EAGAIN) {
+			return 0;
+		}
+		if (nread <= 0) {
+			printf ("Error reading from the primary: %s\n", nread ? strerror(errno) : "connection lost");
+			return -1;
+		}
+		// the primary's keepalive while the snapshot is being saved
+		if (ch == '\n' && sync_header_len == 0) {
+			g_server.repl_transfer_lastio = g_server.unixtime;
+			continue;
+		}
+		if (sync_header_len == REPL_HEADER_MAX - 1) {
+			printf ("Bad SYNC reply from the primary\n");
+			return -1;
+		}
+		sync_header[sync_header_len++] = ch;
+		if (ch != '\n') {
+			continue;
+		}
+		sync_header[sync_header_len] = '\0';
+		sync_header_len = 0;
+
+		if (sync_header[0] == '-') {
+			printf ("The primary refused SYNC: %s", sync_header + 1);
+			return -1;
+		} else if (strncmp(sync_header, "+FULLRESYNC ", 12) == 0) {
+			sync_offset = strtoll(sync_header + 12, NULL, 10);
+		} else if (sync_header[0] == '$') {
+			g_server.repl_transfer_size = strtoll(sync_header + 1, NULL, 10);
+			g_server.repl_transfer_read = 0;
+			snprintf(sync_tmpfile, sizeof(sync_tmpfile), "%s.sync.%d", g_server.rdb_filename, (int)getpid());
+			g_server.repl_transfer_fd = open(sync_tmpfile, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+			if (g_server.repl_transfer_fd == -1) {
+				printf ("Can't create %s: %s\n", sync_tmpfile, strerror(errno));
+				return -1;
+			}
+			printf ("Receiving a %lld bytes snapshot from the primary\n", g_server.repl_transfer_size);
+		} else {
+			printf ("Bad SYNC reply from the primary\n");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// the socket to the primary until the snapshot is loaded
+static void sync_with_master(aeEventLoop *el, int fd, void *privdata, int mask)
+{
+	char *buf = g_server.readbuf;
+	long long left;
+	ssize_t nread;
+	int err = 0;
+	socklen_t errlen = sizeof(err);
+
+	NOTUSED(privdata);
+	NOTUSED(mask);
+
+	// a non blocking connect is done when the socket is writable
+	if (g_server.repl_state == REPL_STATE_CONNECTING) {
+		if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen) == -1) {
+			err = errno;
+		}
+		if (err) {
+			printf ("Can't connect to the primary %s:%d: %s\n", g_server.masterhost,
+					g_server.masterport, strerror(err));
+			cancel_sync();
+			return;
+		}
+		aeDeleteFileEvent(el, fd, AE_WRITABLE);
+		if (write(fd, "*1\r\n$4\r\nSYNC\r\n", 14) != 14) {
+			printf ("Can't send SYNC to the primary: %s\n", strerror(errno));
+			cancel_sync();
+			return;
+		}
+		g_server.repl_state = REPL_STATE_TRANSFER;
+		g_server.repl_transfer_size = -1;
+		g_server.repl_transfer_lastio = g_server.unixtime;
+		sync_header_len = 0;
+		return;
+	}
+
+	if (g_server.repl_transfer_size == -1) {
+		if (read_sync_header(fd) == -1) {
+			cancel_sync();
+			return;
+		}
+		g_server.repl_transfer_lastio = g_server.unixtime;
+		if (g_server.repl_transfer_size == -1) {
+			return;
+		}
+	}
+
+	// no more than the snapshot, what follows is the stream
+	left = g_server.repl_transfer_size - g_server.repl_transfer_read;
+	if (left) {
+		nread = read(fd, buf, left < PROTO_READ_LEN ? left : PROTO_READ_LEN);
+		if (nread == -1 && errno == EAGAIN) {
+			return;
+		}
+		if (nread <= 0) {
+			printf ("Error reading the snapshot from the primary: %s\n",
+					nread ? strerror(errno) : "connection lost");
+			cancel_sync();
+			return;
+		}
+		if (write_all(g_server.repl_transfer_fd, buf, nread) != nread) {
+			printf ("Can't write the snapshot from the primary: %s\n", strerror(errno));
+			cancel_sync();
+			return;
+		}
+		g_server.repl_transfer_read += nread;
+		g_server.repl_transfer_lastio = g_server.unixtime;
+	}
+	if (g_server.repl_transfer_read == g_server.repl_transfer_size) {
+		finish_sync(fd);
+	}
+}
+
+static void connect_to_master()
+{
+	int fd;
+
+	fd = anetTcpNonBlockConnect(g_server.neterr, g_server.masterhost, g_server.masterport);
+	if (fd == ANET_ERR) {
+		printf ("Can't connect to the primary %s:%d: %s\n", g_server.masterhost,
+				g_server.masterport, g_server.neterr);
+		return;
+	}
+	if (aeCreateFileEvent(g_server.el, fd, AE_READABLE | AE_WRITABLE, sync_with_master, NULL) == AE_ERR) {
+		printf ("Can't watch the connection to the primary\n");
+		close(fd);
+		return;
+	}
+	g_server.repl_transfer_s = fd;
+	g_server.repl_transfer_lastio = g_server.unixtime;
+	g_server.repl_state = REPL_STATE_CONNECTING;
+}
+
+// tell the primary how far the stream was applied
+static void send_ack()
+{
+	char offset[LONG_STR_SIZE], buf[64];
+	int len, olen;
+
+	olen = ll2string(offset, sizeof(offset), g_server.master_repl_offset);
+	len = snprintf(buf, sizeof(buf), "*3\r\n$8\r\nREPLCONF\r\n$3\r\nACK\r\n$%d\r\n%s\r\n", olen, offset);
+	// a few bytes in a socket that only carries these, a short write
+	// means the link is broken
+	if (write(g_server.master->fd, buf, len) != len) {
+		printf ("Can't send ACK to the primary, reconnecting\n");
+		freeClient(g_server.master);
+	}
+}
+
+// replicas waiting for their snapshot get nothing else: a newline now and
+// then keeps them from timing out however long the save takes. the
+// replica skips it, see read_sync_header.
+static void ping_waiting_replicas()
+{
+	struct client *c;
+	listNode *ln;
+	listIter li;
+
+	listRewind(g_server.replicas, &li);
+	while ((ln = listNext(&li)) != NULL) {
+		c = (struct client *)ln->value;
+		if (c->repl->state == REPLICA_STATE_WAIT_BGSAVE_START ||
+			c->repl->state == REPLICA_STATE_WAIT_BGSAVE_END) {
+			if (write(c->fd, "\n", 1) == -1) {
+				// a broken link shows up when its snapshot is sent
+			}
+		}
+	}
+}
+
+// called once a second by server_cron
+void replication_cron()
+{
+	if (g_server.masterhost != NULL) {
+		if ((g_server.repl_state == REPL_STATE_CONNECTING || g_server.repl_state == REPL_STATE_TRANSFER) &&
+			g_server.unixtime - g_server.repl_transfer_lastio > REPL_TIMEOUT) {
+			printf ("Timeout syncing with the primary\n");
+			cancel_sync();
+		}
+		if (g_server.repl_state == REPL_STATE_CONNECT) {
+			connect_to_master();
+		} else if (g_server.repl_state == REPL_STATE_CONNECTED) {
+			send_ack();
+		}
+	}
+
+	if (listLength(g_server.replicas)) {
+		// keeps the lag of an idle link at a second
+		feed_replication_backlog(REPL_PING, sizeof(REPL_PING) - 1);
+		ping_waiting_replicas();
+		// replicas waiting for an AOF rewrite or a save to end
+		start_bgsave_for_replication();
+	}
+}
+
+static char *replica_state_name(int state)
+{
+	switch (state) {
+	case REPLICA_STATE_WAIT_BGSAVE_START:
+	case REPLICA_STATE_WAIT_BGSAVE_END:	return "wait_bgsave";
+	case REPLICA_STATE_SEND_BULK:		return "send_bulk";
+	default:							return "online";
+	}
+}
+
+static char *repl_state_name(int state)
+{
+	switch (state) {
+	case REPL_STATE_CONNECT:	return "connect";
+	case REPL_STATE_CONNECTING:	return "connecting";
+	case REPL_STATE_TRANSFER:	return "sync";
+	default:					return "connected";
+	}
+}
+
+// ROLE, on a primary: master <offset> [[<ip> <port> <state> <acked offset> <lag>] ...]
+// on a replica: slave <host> <port> <state> <offset> <lag>. lag is in
+// seconds since the last ack or the last data from the primary, -1 if
+// there is no link.
+void command_role(struct client *c)
+{
+	char ip[INET_ADDRSTRLEN];
+	struct in_addr addr;
+	struct client *r;
+	listNode *ln;
+	listIter li;
+
+	if (g_server.masterhost != NULL) {
+		addReplyMultiBulkLen(c, 6);
+		addReplyBulkString(c, "slave");
+		addReplyBulkString(c, g_server.masterhost);
+		addReplyLongLong(c, g_server.masterport);
+		addReplyBulkString(c, repl_state_name(g_server.repl_state));
+		addReplyLongLong(c, g_server.master_repl_offset);
+		addReplyLongLong(c, g_server.master ? g_server.unixtime - g_server.master->lastinteraction : -1);
+		return;
+	}
+
+	addReplyMultiBulkLen(c, 3);
+	addReplyBulkString(c, "master");
+	addReplyLongLong(c, g_server.master_repl_offset);
+	addReplyMultiBulkLen(c, listLength(g_server.replicas));
+	listRewind(g_server.replicas, &li);
+	while ((ln = listNext(&li)) != NULL) {
+		r = (struct client *)ln->value;
+		addr.s_addr = r->ip;
+		inet_ntop(AF_INET, &addr, ip, sizeof(ip));
+		addReplyMultiBulkLen(c, 5);
+		addReplyBulkString(c, ip);
+		addReplyLongLong(c, r->port);
+		addReplyBulkString(c, replica_state_name(r->repl->state));
+		addReplyLongLong(c, r->repl->ack_offset);
+		addReplyLongLong(c, g_server.unixtime - r->repl->ack_time);
+	}
+}
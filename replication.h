@@ -0,0 +1,65 @@
+
+#ifndef _REPLICATION_H
+#define _REPLICATION_H
+
+#include <time.h>
+#include <sys/types.h>
+
+struct command;
+struct arg;
+struct client;
+
+// replication: a replica sends SYNC, the primary answers
+//
+//   +FULLRESYNC <offset>\r\n
+//   $<size>\r\n
+//   <size bytes of snapshot>
+//
+// followed by every write command from <offset> on, as the requests the
+// AOF has, and a REPLCONF PING every second. once a second the replica
+// sends REPLCONF ACK <offset>.
+
+#define DEFAULT_REPL_BACKLOG_SIZE	(1024*1024)
+#define REPL_TIMEOUT		60		// seconds without data while syncing
+#define REPL_HEADER_MAX		128		// bytes of the FULLRESYNC and $<size> lines
+#define REPL_PING	"*2\r\n$8\r\nREPLCONF\r\n$4\r\nPING\r\n"	// the primary's once a second
+
+// the replica's side of the link, in g_server.repl_state
+#define REPL_STATE_NONE			0	// not a replica
+#define REPL_STATE_CONNECT		1	// must connect to the primary
+#define REPL_STATE_CONNECTING	2	// connect in progress
+#define REPL_STATE_TRANSFER		3	// receiving the snapshot
+#define REPL_STATE_CONNECTED	4	// applying the stream
+
+// a replica as the primary sees it, in replica->state
+#define REPLICA_STATE_WAIT_BGSAVE_START	0	// a child is busy, no snapshot for it yet
+#define REPLICA_STATE_WAIT_BGSAVE_END	1	// its snapshot is being saved
+#define REPLICA_STATE_SEND_BULK			2	// sending the snapshot
+#define REPLICA_STATE_ONLINE			3	// sending the stream
+
+// client->repl of a client that sent SYNC. the stream is not copied per
+// replica: offset is where the replica is in the shared backlog.
+struct replica{
+	int state;				// REPLICA_STATE_*
+	int dbfd;				// snapshot being sent, -1 if none
+	off_t dboff;			// bytes of it sent
+	off_t dbsize;
+	char preamble[64];		// FULLRESYNC and $<size>, before the snapshot
+	int preamble_len;
+	int preamble_pos;		// bytes of it sent
+	long long offset;		// next byte of the stream to send
+	long long ack_offset;	// last REPLCONF ACK
+	time_t ack_time;
+	int writing;			// the writable event is installed
+};
+
+void propagate(struct command *cmd, int argc, struct arg *argv);
+void feed_replication_backlog(const char *p, size_t len);
+void replication_bgsave_done(int ok);
+void replication_free_client(struct client *c);
+void replication_cron();
+void command_sync(struct client *c);
+void command_replconf(struct client *c);
+void command_role(struct client *c);
+
+#endif
@@ -0,0 +1,204 @@
+
+#include <string.h>
+#include "scan.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define HAVE_X86_SIMD	1
+#include <immintrin.h>
+#endif
+
+
+//----------------------------
+// plain C, also used for the tail shorter than a vector
+
+// the libc memchr is vectorized on most targets, arm64 included
+static char *scalar_byte(const char *p, const char *end, int c)
+{
+	char *q;
+
+	if (p >= end) return (char *)end;
+	q = memchr(p, c, end - p);
+	return q ? q : (char *)end;
+}
+
+static char *scalar_blank(const char *p, const char *end)
+{
+	while (p < end && *p != ' ' && *p != '\t') p++;
+	return (char *)p;
+}
+
+static char *scalar_nondigit(const char *p, const char *end)
+{
+	while (p < end && *p >= '0' && *p <= '9') p++;
+	return (char *)p;
+}
+
+
+#ifdef HAVE_X86_SIMD
+//----------------------------
+// sse2, 16 bytes per step. unaligned loads never cross end.
+
+__attribute__((target("sse2")))
+static char *sse2_byte(const char *p, const char *end, int c)
+{
+	__m128i needle = _mm_set1_epi8((char)c);
+	__m128i v;
+	int m;
+
+	while (end - p >= 16) {
+		v = _mm_loadu_si128((const __m128i *)p);
+		m = _mm_movemask_epi8(_mm_cmpeq_epi8(v, needle));
+		if (m) return (char *)p + __builtin_ctz(m);
+		p += 16;
+	}
+	return scalar_byte(p, end, c);
+}
+
+__attribute__((target("sse2")))
+static char *sse2_blank(const char *p, const char *end)
+{
+	__m128i space = _mm_set1_epi8(' ');
+	__m128i tab = _mm_set1_epi8('\t');
+	__m128i v;
+	int m;
+
+	while (end - p >= 16) {
+		v = _mm_loadu_si128((const __m128i *)p);
+		m = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, space),
+										   _mm_cmpeq_epi8(v, tab)));
+		if (m) return (char *)p + __builtin_ctz(m);
+		p += 16;
+	}
+	return scalar_blank(p, end);
+}
+
+// b is a digit when (b - '0') as unsigned is at most 9
+__attribute__((target("sse2")))
+static char *sse2_nondigit(const char *p, const char *end)
+{
+	__m128i zero = _mm_set1_epi8('0');
+	__m128i nine = _mm_set1_epi8(9);
+	__m128i v, d;
+	int m;
+
+	while (end - p >= 16) {
+		v = _mm_loadu_si128((const __m128i *)p);
+		d = _mm_sub_epi8(v, zero);
+		m = ~_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(d, nine), d)) & 0xffff;
+		if (m) return (char *)p + __builtin_ctz(m);
+		p += 16;
+	}
+	return scalar_nondigit(p, end);
+}
+
+
+//----------------------------
+// avx2, 32 bytes per step, then sse2 for a tail of 16 or more
+
+__attribute__((target("avx2")))
+static char *avx2_byte(const char *p, const char *end, int c)
+{
+	__m256i needle = _mm256_set1_epi8((char)c);
+	__m256i v;
+	unsigned int m;
+
+	while (end - p >= 32) {
+		v = _mm256_loadu_si256((const __m256i *)p);
+		m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, needle));
+		if (m) return (char *)p + __builtin_ctz(m);
+		p += 32;
+	}
+	return sse2_byte(p, end, c);
+}
+
+__attribute__((target("avx2")))
+static char *avx2_blank(const char *p, const char *end)
+{
+	__m256i space = _mm256_set1_epi8(' ');
+	__m256i tab = _mm256_set1_epi8('\t');
+	__m256i v;
+	unsigned int m;
+
+	while (end - p >= 32) {
+		v = _mm256_loadu_si256((const __m256i *)p);
+		m = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, space),
+												 _mm256_cmpeq_epi8(v, tab)));
+		if (m) return (char *)p + __builtin_ctz(m);
+		p += 32;
+	}
+	return sse2_blank(p, end);
+}
+
+#endif
+
+
+//----------------------------
+// runtime dispatch
+
+struct scan_impl{
+	const char *name;
+	ScanByteProc *byte;
+	ScanProc *blank;
+	ScanProc *nondigit;
+};
+
+// length fields are a few digits long, a 32 byte load doesn't pay off for
+// them (scan-benchmark shows avx2 losing to sse2 there), so avx2 keeps
+// the sse2 digit scan.
+static struct scan_impl impls[] = {
+#ifdef HAVE_X86_SIMD
+	{"avx2", avx2_byte, avx2_blank, sse2_nondigit},
+	{"sse2", sse2_byte, sse2_blank, sse2_nondigit},
+#endif
+	{"scalar", scalar_byte, scalar_blank, scalar_nondigit},
+};
+
+static const char *current = "scalar";
+
+ScanByteProc *scan_byte = scalar_byte;
+ScanProc *scan_blank = scalar_blank;
+ScanProc *scan_nondigit = scalar_nondigit;
+
+static int impl_supported(const char *name)
+{
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (strcmp(name, "avx2") == 0) return __builtin_cpu_supports("avx2");
+	if (strcmp(name, "sse2") == 0) return __builtin_cpu_supports("sse2");
+#endif
+	return strcmp(name, "scalar") == 0;
+}
+
+// use the named implementation, -1 if it's unknown or the cpu lacks it
+int scan_set_impl(const char *name)
+{
+	unsigned int j;
+
+	for (j = 0; j < sizeof(impls)/sizeof(impls[0]); j++) {
+		if (strcmp(impls[j].name, name) == 0 && impl_supported(name)) {
+			scan_byte = impls[j].byte;
+			scan_blank = impls[j].blank;
+			scan_nondigit = impls[j].nondigit;
+			current = impls[j].name;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+// the table is ordered fastest first
+void scan_init()
+{
+	unsigned int j;
+
+	for (j = 0; j < sizeof(impls)/sizeof(impls[0]); j++) {
+		if (scan_set_impl(impls[j].name) == 0) {
+			return;
+		}
+	}
+}
+
+const char *scan_impl_name()
+{
+	return current;
+}
@@ -0,0 +1,21 @@
+
+#ifndef _SCAN_H
+#define _SCAN_H
+
+// delimiter scanning for the request parser. every function looks at
+// [p, end) and returns a pointer to the first match, or end if none.
+// scan_init picks the widest implementation the cpu runs: avx2, sse2,
+// or plain C everywhere else.
+
+typedef char *ScanByteProc(const char *p, const char *end, int c);
+typedef char *ScanProc(const char *p, const char *end);
+
+extern ScanByteProc *scan_byte;		// first byte equal to c
+extern ScanProc *scan_blank;		// first ' ' or '\t'
+extern ScanProc *scan_nondigit;		// first byte not in '0'..'9'
+
+void scan_init();
+int scan_set_impl(const char *name);
+const char *scan_impl_name();
+
+#endif
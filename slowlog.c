@@ -0,0 +1,167 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <arpa/inet.h>
+#include "slowlog.h"
+#include "zmalloc.h"
+#include "areactor.h"
+#include "client.h"
+#include "network.h"
+#include "util.h"
+
+
+void slowlog_init()
+{
+	struct slowlog *sl = &g_server.slowlog;
+
+	sl->max_len = g_server.slowlog_max_len;
+	sl->len = 0;
+	sl->next = 0;
+	sl->next_id = 0;
+	sl->entries = NULL;
+	if (sl->max_len > 0) {
+		sl->entries = (struct slowlog_entry *)zcalloc(sl->max_len * sizeof(struct slowlog_entry));
+		if (sl->entries == NULL) {
+			printf ("Can't allocate the slowlog\n");
+			exit(1);
+		}
+	}
+}
+
+// copy the arguments of c, truncated like redis does: a long argument
+// ends with "... (N more bytes)", the last kept one says how many
+// arguments were left out. one malloc for the array and the bytes.
+static struct arg *slowlog_copy_args(struct client *c, int *argc)
+{
+	char note[64];
+	struct arg *argv;
+	char *p;
+	size_t bytes = 0, len;
+	int j, n = c->argc;
+
+	if (n > SLOWLOG_ENTRY_MAX_ARGC) n = SLOWLOG_ENTRY_MAX_ARGC;
+	for (j = 0; j < n; j++) {
+		bytes += SLOWLOG_ENTRY_MAX_STRING + sizeof(note) + 1;
+	}
+	argv = (struct arg *)zmalloc(sizeof(struct arg) * n + bytes);
+	if (argv == NULL) {
+		return NULL;
+	}
+	p = (char *)(argv + n);
+
+	for (j = 0; j < n; j++) {
+		argv[j].ptr = p;
+		if (j == n - 1 && n < c->argc) {
+			len = snprintf(p, sizeof(note), "... (%d more arguments)", c->argc - n + 1);
+		} else if (c->argv[j].len > SLOWLOG_ENTRY_MAX_STRING) {
+			memcpy(p, c->argv[j].ptr, SLOWLOG_ENTRY_MAX_STRING);
+			len = SLOWLOG_ENTRY_MAX_STRING;
+			len += snprintf(p + len, sizeof(note), "... (%lu more bytes)",
+							(unsigned long)(c->argv[j].len - SLOWLOG_ENTRY_MAX_STRING));
+		} else {
+			memcpy(p, c->argv[j].ptr, c->argv[j].len);
+			len = c->argv[j].len;
+		}
+		p[len] = '\0';
+		argv[j].len = len;
+		p += len + 1;
+	}
+	*argc = n;
+	return argv;
+}
+
+// log the command c just ran if it took long enough. the oldest entry
+// is overwritten once the ring is full.
+void slowlog_push(struct client *c, long long duration)
+{
+	struct slowlog *sl = &g_server.slowlog;
+	struct slowlog_entry *e;
+	struct arg *argv;
+	int argc;
+
+	if (g_server.slowlog_log_slower_than < 0 || sl->max_len == 0 ||
+		duration < g_server.slowlog_log_slower_than) {
+		return;
+	}
+	if ((argv = slowlog_copy_args(c, &argc)) == NULL) {
+		return;
+	}
+
+	e = sl->entries + sl->next;
+	zfree(e->argv);
+	e->id = sl->next_id++;
+	e->time = g_server.unixtime;
+	e->duration = duration;
+	e->ip = c->ip;
+	e->port = c->port;
+	e->argc = argc;
+	e->argv = argv;
+
+	sl->next = (sl->next + 1) % sl->max_len;
+	if (sl->len < sl->max_len) sl->len++;
+}
+
+void slowlog_reset()
+{
+	struct slowlog *sl = &g_server.slowlog;
+	int j;
+
+	for (j = 0; j < sl->max_len; j++) {
+		zfree(sl->entries[j].argv);
+		sl->entries[j].argv = NULL;
+	}
+	sl->len = 0;
+	sl->next = 0;
+}
+
+static void add_reply_slowlog_entry(struct client *c, struct slowlog_entry *e)
+{
+	char addr[INET_ADDRSTRLEN + 8];
+	struct in_addr in;
+	int j;
+
+	addReplyMultiBulkLen(c, 5);
+	addReplyLongLong(c, e->id);
+	addReplyLongLong(c, e->time);
+	addReplyLongLong(c, e->duration);
+	addReplyMultiBulkLen(c, e->argc);
+	for (j = 0; j < e->argc; j++) {
+		addReplyBulk(c, e->argv[j].ptr, e->argv[j].len);
+	}
+	in.s_addr = e->ip;
+	inet_ntop(AF_INET, &in, addr, INET_ADDRSTRLEN);
+	snprintf(addr + strlen(addr), 8, ":%d", e->port);
+	addReplyBulkString(c, addr);
+}
+
+// slowlog get [count]: newest first, 10 by default, -1 for all
+// slowlog len
+// slowlog reset
+void command_slowlog(struct client *c)
+{
+	struct slowlog *sl = &g_server.slowlog;
+	long long count = 10;
+	int j, idx;
+
+	if (strcasecmp(c->argv[1].ptr, "get") == 0 && c->argc <= 3) {
+		if (c->argc == 3 && !string2ll(c->argv[2].ptr, c->argv[2].len, &count)) {
+			addReplyError(c, "value is not an integer or out of range");
+			return;
+		}
+		if (count < 0 || count > sl->len) count = sl->len;
+		addReplyMultiBulkLen(c, count);
+		for (j = 0; j < count; j++) {
+			idx = (sl->next - 1 - j + sl->max_len) % sl->max_len;
+			add_reply_slowlog_entry(c, sl->entries + idx);
+		}
+	} else if (strcasecmp(c->argv[1].ptr, "len") == 0 && c->argc == 2) {
+		addReplyLongLong(c, sl->len);
+	} else if (strcasecmp(c->argv[1].ptr, "reset") == 0 && c->argc == 2) {
+		slowlog_reset();
+		addReplyStatus(c, "OK");
+	} else {
+		addReplyError(c, "unknown subcommand or wrong number of arguments, try SLOWLOG GET|LEN|RESET");
+	}
+}
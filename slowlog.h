@@ -0,0 +1,43 @@
+
+#ifndef _SLOWLOG_H
+#define _SLOWLOG_H
+
+#include <time.h>
+#include <stdint.h>
+
+struct client;
+struct arg;
+
+#define DEFAULT_SLOWLOG_LOG_SLOWER_THAN	10000	// microseconds, -1 = off, 0 = every command
+#define DEFAULT_SLOWLOG_MAX_LEN	128				// entries kept
+
+// an entry keeps at most SLOWLOG_ENTRY_MAX_ARGC arguments of at most
+// SLOWLOG_ENTRY_MAX_STRING bytes each, so its size is bounded
+#define SLOWLOG_ENTRY_MAX_ARGC		32
+#define SLOWLOG_ENTRY_MAX_STRING	128
+
+struct slowlog_entry{
+	long long id;			// unique, grows by one per entry
+	time_t time;			// unix time the command ran
+	long long duration;		// microseconds
+	uint32_t ip;			// client address, network order
+	int port;
+	int argc;				// arguments kept
+	struct arg *argv;		// one malloc with the (truncated) copies
+};
+
+// ring of max_len entries, written only by the event loop
+struct slowlog{
+	struct slowlog_entry *entries;
+	int max_len;
+	int len;				// entries in use
+	int next;				// slot the next entry goes to
+	long long next_id;
+};
+
+void slowlog_init();
+void slowlog_push(struct client *c, long long duration);
+void slowlog_reset();
+void command_slowlog(struct client *c);
+
+#endif
@@ -0,0 +1,255 @@
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE		// recvmmsg/sendmmsg
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "udp.h"
+#include "zmalloc.h"
+#include "areactor.h"
+#include "network.h"
+#include "client.h"
+#include "multi.h"
+
+#if defined(__linux__)
+#define HAVE_MMSG	1
+#endif
+
+// one slot per datagram of a batch. requests and replies are kept apart
+// so the whole batch of replies goes out with a single sendmmsg.
+struct udp_batch{
+	struct sockaddr_in addr[UDP_BATCH];		// request sources, reply targets
+	int in_len[UDP_BATCH];
+	struct iovec in_iov[UDP_BATCH];
+	struct iovec out_iov[UDP_BATCH];
+	struct sockaddr_in *out_addr[UDP_BATCH];
+#ifdef HAVE_MMSG
+	struct mmsghdr in_msgs[UDP_BATCH];
+	struct mmsghdr out_msgs[UDP_BATCH];
+#endif
+	char in_buf[UDP_BATCH][UDP_DGRAM_LEN];
+	char out_buf[UDP_BATCH][UDP_DGRAM_LEN];
+};
+
+
+void udp_init()
+{
+	struct udp_batch *b;
+	int j;
+
+	g_server.udp_fd = anetUdpServer(g_server.neterr, g_server.udp_port, g_server.bindaddr);
+	if (g_server.udp_fd == ANET_ERR) {
+		printf ("udp socket error: %s\n", g_server.neterr);
+		exit(1);
+	}
+	anetNonBlock(NULL, g_server.udp_fd);
+	if (g_server.udp_opts.rcvbuf &&
+		anetSetReceiveBuffer(g_server.neterr, g_server.udp_fd, g_server.udp_opts.rcvbuf) == ANET_ERR) {
+		printf ("Setting udp socket options: %s\n", g_server.neterr);
+	}
+	if (g_server.udp_opts.sndbuf &&
+		anetSetSendBuffer(g_server.neterr, g_server.udp_fd, g_server.udp_opts.sndbuf) == ANET_ERR) {
+		printf ("Setting udp socket options: %s\n", g_server.neterr);
+	}
+	if (g_server.udp_opts.busy_poll &&
+		anetSetBusyPoll(g_server.neterr, g_server.udp_fd, g_server.udp_opts.busy_poll) == ANET_ERR) {
+		printf ("Setting udp socket options: %s\n", g_server.neterr);
+	}
+
+	b = (struct udp_batch *)zmalloc(sizeof(struct udp_batch));
+	if (b == NULL) {
+		printf ("Can't allocate the udp batch buffers\n");
+		exit(1);
+	}
+	memset(b, 0, sizeof(*b));
+	for (j = 0; j < UDP_BATCH; j++) {
+		b->in_iov[j].iov_base = b->in_buf[j];
+		b->in_iov[j].iov_len = UDP_DGRAM_LEN;
+#ifdef HAVE_MMSG
+		b->in_msgs[j].msg_hdr.msg_name = &b->addr[j];
+		b->in_msgs[j].msg_hdr.msg_iov = &b->in_iov[j];
+		b->in_msgs[j].msg_hdr.msg_iovlen = 1;
+		b->out_msgs[j].msg_hdr.msg_iov = &b->out_iov[j];
+		b->out_msgs[j].msg_hdr.msg_iovlen = 1;
+#endif
+	}
+	g_server.udp_batch = b;
+
+	// every datagram is run by this one client, it never owns a socket
+	g_server.udp_client = create_pseudo_client(CLIENT_UDP);
+	if (g_server.udp_client == NULL) {
+		printf ("Can't create the udp client\n");
+		exit(1);
+	}
+
+	if (aeCreateFileEvent(g_server.el, g_server.udp_fd, AE_READABLE, readQueryFromUdpHandle, NULL) == AE_ERR) {
+		printf ("Unrecoverable error creating server.udp_fd file event\n");
+		exit(1);
+	}
+}
+
+// fill the batch, return the number of datagrams received
+static int udp_recv_batch(int fd, struct udp_batch *b)
+{
+	int n;
+
+#ifdef HAVE_MMSG
+	int j;
+
+	for (j = 0; j < UDP_BATCH; j++) {
+		b->in_msgs[j].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+		b->in_msgs[j].msg_hdr.msg_flags = 0;
+	}
+	n = recvmmsg(fd, b->in_msgs, UDP_BATCH, MSG_DONTWAIT, NULL);
+	g_server.stat_udp_syscalls++;
+	for (j = 0; j < n; j++) {
+		b->in_len[j] = (b->in_msgs[j].msg_hdr.msg_flags & MSG_TRUNC) ?
+					   UDP_DGRAM_LEN : (int)b->in_msgs[j].msg_len;
+	}
+#else
+	socklen_t alen;
+
+	for (n = 0; n < UDP_BATCH; n++) {
+		alen = sizeof(struct sockaddr_in);
+		b->in_len[n] = recvfrom(fd, b->in_buf[n], UDP_DGRAM_LEN, MSG_DONTWAIT,
+								(struct sockaddr *)&b->addr[n], &alen);
+		g_server.stat_udp_syscalls++;
+		if (b->in_len[n] == -1) {
+			break;
+		}
+	}
+	if (n == 0) {
+		n = -1;
+	}
+#endif
+	if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+		printf("Reading from udp socket: %s\n", strerror(errno));
+	}
+	return n;
+}
+
+// send the first nout replies of the batch, whatever can't be sent now
+// is dropped like any other lost datagram.
+static void udp_send_batch(int fd, struct udp_batch *b, int nout)
+{
+	int sent = 0, n;
+
+	if (nout != 0) {
+		flush_before_reply();
+	}
+#ifdef HAVE_MMSG
+	while (sent < nout) {
+		n = sendmmsg(fd, b->out_msgs + sent, nout - sent, MSG_DONTWAIT);
+		g_server.stat_udp_syscalls++;
+		if (n == -1) {
+			break;
+		}
+		sent += n;
+	}
+#else
+	for (; sent < nout; sent++) {
+		n = sendto(fd, b->out_iov[sent].iov_base, b->out_iov[sent].iov_len, MSG_DONTWAIT,
+				   (struct sockaddr *)b->out_addr[sent], sizeof(struct sockaddr_in));
+		g_server.stat_udp_syscalls++;
+		if (n == -1) {
+			break;
+		}
+	}
+#endif
+	g_server.stat_udp_dropped += nout - sent;
+}
+
+// run one datagram through the command table, return the reply length.
+// a datagram is a whole frame: a request can't continue in the next one.
+// the parser works in place on req, which has room for one more byte.
+static int udp_process(struct client *c, char *req, int len, char *out)
+{
+	int replylen;
+
+	c->input_buf = req;
+	c->qb_len = len;
+	// inline requests don't need the newline in a datagram
+	if (len > 0 && req[len-1] != '\n') {
+		c->input_buf[c->qb_len++] = '\n';
+	}
+
+	process_input(c);
+
+	replylen = c->bufpos;
+	if (listLength(c->reply) || replylen >= UDP_DGRAM_LEN) {
+		replylen = sprintf(out, "-ERR reply too large for UDP\r\n");
+	} else if (replylen) {
+		memcpy(out, c->buf, replylen);
+	}
+
+	// forget whatever is left for the next datagram, a MULTI too. the
+	// reply buffer goes back to the pool, input_buf belongs to the batch.
+	discard_transaction(c);
+	c->flags &= ~CLIENT_CLOSE_AFTER_REPLY;
+	c->input_buf = NULL;
+	c->qb_len = c->qb_start = c->qb_pos = 0;
+	reset_client(c);
+	c->bufpos = 0;
+	client_release_reply_buffer(c);
+	while (listLength(c->reply)) {
+		listDelNode(c->reply, listFirst(c->reply));
+	}
+	c->reply_bytes = 0;
+	return replylen;
+}
+
+// handle for udp socket readable
+void readQueryFromUdpHandle(aeEventLoop *el, int fd, void *privdata, int mask)
+{
+	struct udp_batch *b = g_server.udp_batch;
+	struct client *c = g_server.udp_client;
+	int rounds = UDP_MAX_ROUNDS;
+	int n, j, nout, len;
+
+	NOTUSED(el);
+	NOTUSED(mask);
+	NOTUSED(privdata);
+
+	while (rounds--) {
+		n = udp_recv_batch(fd, b);
+		if (n <= 0) {
+			break;
+		}
+		g_server.stat_udp_datagrams += n;
+
+		nout = 0;
+		for (j = 0; j < n; j++) {
+			if (b->in_len[j] >= UDP_DGRAM_LEN) {
+				g_server.stat_udp_dropped++;	// truncated, can't be parsed
+				continue;
+			}
+
+			c->ip = b->addr[j].sin_addr.s_addr;
+			c->port = ntohs(b->addr[j].sin_port);
+			c->lastinteraction = g_server.unixtime;
+			len = udp_process(c, b->in_buf[j], b->in_len[j], b->out_buf[nout]);
+			if (len == 0) {
+				continue;
+			}
+
+			b->out_iov[nout].iov_base = b->out_buf[nout];
+			b->out_iov[nout].iov_len = len;
+			b->out_addr[nout] = &b->addr[j];
+#ifdef HAVE_MMSG
+			b->out_msgs[nout].msg_hdr.msg_name = &b->addr[j];
+			b->out_msgs[nout].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+#endif
+			nout++;
+		}
+		udp_send_batch(fd, b, nout);
+
+		// a short batch means the socket is drained
+		if (n < UDP_BATCH) {
+			break;
+		}
+	}
+}
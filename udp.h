@@ -0,0 +1,16 @@
+
+#ifndef _UDP_H
+#define _UDP_H
+
+#include "ae.h"
+
+#define UDP_BATCH			64		// datagrams per recvmmsg/sendmmsg call
+#define UDP_MAX_ROUNDS		16		// batches handled per readable event
+#define UDP_DGRAM_LEN		4096	// larger requests are dropped, larger replies refused
+
+struct udp_batch;
+
+void udp_init();
+void readQueryFromUdpHandle(aeEventLoop *el, int fd, void *privdata, int mask);
+
+#endif
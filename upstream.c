@@ -0,0 +1,423 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include "upstream.h"
+#include "zmalloc.h"
+#include "areactor.h"
+#include "network.h"
+#include "util.h"
+
+
+// SA forwards its payload to the upstream. the same payloads come again
+// and again and the answers rarely change, so an answer is kept for
+// sa_cache_ttl ms and the next requests with the same bytes are served
+// from memory without a round trip.
+//
+// a miss doesn't wait on the event loop: the request goes out on a non
+// blocking socket and the client is blocked until the answer comes. the
+// clients asking the same meanwhile join the call in flight, one round
+// trip answers them all with one shared reply block.
+
+static uint64_t request_hash(const void *key)
+{
+	const struct arg *k = (const struct arg *)key;
+
+	return dictGenHashFunction(k->ptr, k->len);
+}
+
+static int request_compare(void *privdata, const void *key1, const void *key2)
+{
+	const struct arg *k1 = (const struct arg *)key1;
+	const struct arg *k2 = (const struct arg *)key2;
+
+	NOTUSED(privdata);
+	return k1->len == k2->len && memcmp(k1->ptr, k2->ptr, k1->len) == 0;
+}
+
+// the key is inside the entry, it goes with it
+static void entry_free(void *privdata, void *obj)
+{
+	struct sa_cache_entry *e = (struct sa_cache_entry *)obj;
+
+	NOTUSED(privdata);
+	g_server.sa_cache_bytes -= zmalloc_size(e);
+	ilistDelNode(&g_server.sa_cache_order, &e->node);
+	zfree(e);
+}
+
+// &entry->request -> entry
+static dictType sa_cache_type = {
+	request_hash,
+	request_compare,
+	NULL,
+	entry_free
+};
+
+// &call->request -> call, freed by upstream_call_done
+static dictType upstream_calls_type = {
+	request_hash,
+	request_compare,
+	NULL,
+	NULL
+};
+
+void upstream_init()
+{
+	ilistInit(&g_server.sa_cache_order);
+	g_server.sa_cache = dictCreate(&sa_cache_type, NULL);
+	g_server.upstream_calls = dictCreate(&upstream_calls_type, NULL);
+	if (g_server.sa_cache == NULL || g_server.upstream_calls == NULL) {
+		printf ("Can't create the sa cache\n");
+		exit(1);
+	}
+}
+
+static int sa_cache_enabled()
+{
+	return g_server.sa_cache_ttl > 0 && g_server.sa_cache_max_bytes > 0;
+}
+
+// the cached answer to request, NULL if none or it expired
+static struct sa_cache_entry *sa_cache_lookup(struct arg *request)
+{
+	struct sa_cache_entry *e;
+
+	e = (struct sa_cache_entry *)dictFetchValue(g_server.sa_cache, request);
+	if (e != NULL && e->expire <= mstime()) {
+		dictDelete(g_server.sa_cache, request);
+		return NULL;
+	}
+	return e;
+}
+
+// keep reply as the answer to request, the oldest entries are dropped
+// until it fits. not stored if out of memory or larger than the cache.
+// an empty answer, the upstream closed without replying, or one that
+// filled the IOBUF_LEN read buffer and may be cut short is passed on to
+// the clients that asked but not kept for the others.
+static void sa_cache_store(struct arg *request, char *reply, size_t reply_len)
+{
+	struct sa_cache_entry *e;
+	size_t size;
+
+	if (reply_len == 0 || reply_len >= IOBUF_LEN) {
+		return;
+	}
+	e = (struct sa_cache_entry *)zmalloc(sizeof(struct sa_cache_entry) + request->len + reply_len);
+	if (e == NULL) {
+		return;
+	}
+	size = zmalloc_size(e);
+	if ((long long)size > g_server.sa_cache_max_bytes) {
+		zfree(e);
+		return;
+	}
+	// read the clock: an answer stored when the upstream replies would
+	// otherwise lose the time the call took from its ttl
+	e->expire = mstime() + g_server.sa_cache_ttl;
+	e->request.ptr = e->data;
+	e->request.len = request->len;
+	memcpy(e->request.ptr, request->ptr, request->len);
+	e->reply = e->data + request->len;
+	e->reply_len = reply_len;
+	memcpy(e->reply, reply, reply_len);
+
+	// an expired answer may still be there
+	dictDelete(g_server.sa_cache, request);
+	while (g_server.sa_cache_bytes + (long long)size > g_server.sa_cache_max_bytes) {
+		dictDelete(g_server.sa_cache,
+				   &ilistEntry(ilistFirst(&g_server.sa_cache_order), struct sa_cache_entry, node)->request);
+		g_server.stat_sa_cache_evictions++;
+	}
+	if (dictAdd(g_server.sa_cache, &e->request, e) != DICT_OK) {
+		zfree(e);
+		return;
+	}
+	ilistAddNodeTail(&g_server.sa_cache_order, &e->node);
+	g_server.sa_cache_bytes += size;
+}
+
+// "$<len>\r\n<reply>\r\n" in a block the waiters of a call share
+static struct reply_block *create_bulk_block(char *reply, size_t len)
+{
+	char lenstr[LONG_STR_SIZE];
+	struct reply_block *b;
+	int lenlen;
+
+	lenlen = ll2string(lenstr, sizeof(lenstr), len);
+	if ((b = create_shared_reply_block(1 + lenlen + 2 + len + 2)) == NULL) {
+		return NULL;
+	}
+	b->buf[0] = '$';
+	memcpy(b->buf + 1, lenstr, lenlen);
+	memcpy(b->buf + 1 + lenlen, "\r\n", 2);
+	memcpy(b->buf + 1 + lenlen + 2, reply, len);
+	memcpy(b->buf + 1 + lenlen + 2 + len, "\r\n", 2);
+	return b;
+}
+
+// the call is over: the answer, or err, goes to every waiter, which
+// then runs the requests it sent meanwhile. the call is out of the table
+// first, so an SA among those starts a new one or hits the cache.
+static void upstream_call_done(struct upstream_call *call, char *err)
+{
+	struct reply_block *b = NULL;
+	struct client *c;
+	listNode *ln;
+
+	dictDelete(g_server.upstream_calls, &call->request);
+	aeDeleteFileEvent(g_server.el, call->fd, AE_READABLE | AE_WRITABLE);
+	close(call->fd);
+
+	if (err == NULL) {
+		if (sa_cache_enabled()) {
+			sa_cache_store(&call->request, call->reply, call->nread);
+		}
+		if ((b = create_bulk_block(call->reply, call->nread)) == NULL) {
+			err = "out of memory for the upstream answer";
+		}
+	}
+	while (listLength(call->waiters)) {
+		ln = listFirst(call->waiters);
+		c = (struct client *)listNodeValue(ln);
+		listDelNode(call->waiters, ln);
+		c->upstream_call = NULL;
+		c->upstream_node = NULL;
+		if (err != NULL) {
+			addReplyError(c, err);
+		} else {
+			addReplySharedBlock(c, b);
+		}
+		unblock_client(c);
+	}
+	if (b != NULL) {
+		release_reply_block(b);
+	}
+	listRelease(call->waiters);
+	zfree(call);
+}
+
+// the upstream answers and closes, or the answer fills the buffer
+static void upstream_read_handler(aeEventLoop *el, int fd, void *privdata, int mask)
+{
+	struct upstream_call *call = (struct upstream_call *)privdata;
+	ssize_t nread;
+
+	NOTUSED(el);
+	NOTUSED(mask);
+	nread = read(fd, call->reply + call->nread, IOBUF_LEN - call->nread);
+	if (nread == -1) {
+		if (errno == EAGAIN) {
+			return;
+		}
+		upstream_call_done(call, "upstream read error");
+		return;
+	}
+	call->nread += nread;
+	if (nread == 0 || call->nread == IOBUF_LEN) {
+		upstream_call_done(call, NULL);
+	}
+}
+
+// writable once connected: send the request, then wait for the answer.
+// a refused connect shows up as the write failing.
+static void upstream_write_handler(aeEventLoop *el, int fd, void *privdata, int mask)
+{
+	struct upstream_call *call = (struct upstream_call *)privdata;
+	ssize_t nwritten;
+
+	NOTUSED(mask);
+	nwritten = write(fd, call->request.ptr + call->sent, call->request.len - call->sent);
+	if (nwritten == -1) {
+		if (errno == EAGAIN) {
+			return;
+		}
+		printf ("Writing to the upstream: %s\n", strerror(errno));
+		upstream_call_done(call, "upstream unavailable");
+		return;
+	}
+	call->sent += nwritten;
+	if (call->sent < call->request.len) {
+		return;
+	}
+	aeDeleteFileEvent(el, fd, AE_WRITABLE);
+	if (aeCreateFileEvent(el, fd, AE_READABLE, upstream_read_handler, call) == AE_ERR) {
+		upstream_call_done(call, "upstream unavailable");
+	}
+}
+
+// connect and put a call for request in the table, NULL if it can't
+// be started
+static struct upstream_call *upstream_call_create(struct arg *request)
+{
+	struct upstream_call *call;
+	char err[ANET_ERR_LEN];
+
+	call = (struct upstream_call *)zmalloc(sizeof(struct upstream_call) + request->len);
+	if (call == NULL) {
+		return NULL;
+	}
+	if ((call->waiters = listCreate()) == NULL) {
+		zfree(call);
+		return NULL;
+	}
+	call->request.ptr = call->data;
+	call->request.len = request->len;
+	memcpy(call->request.ptr, request->ptr, request->len);
+	call->start = mstime();
+	call->sent = 0;
+	call->nread = 0;
+
+	call->fd = anetTcpNonBlockConnect(err, g_server.upstream_host, g_server.upstream_port);
+	if (call->fd == ANET_ERR) {
+		printf ("%s\n", err);
+		listRelease(call->waiters);
+		zfree(call);
+		return NULL;
+	}
+	if (aeCreateFileEvent(g_server.el, call->fd, AE_WRITABLE, upstream_write_handler, call) == AE_ERR ||
+		dictAdd(g_server.upstream_calls, &call->request, call) != DICT_OK) {
+		aeDeleteFileEvent(g_server.el, call->fd, AE_WRITABLE);
+		close(call->fd);
+		listRelease(call->waiters);
+		zfree(call);
+		return NULL;
+	}
+	return call;
+}
+
+// c goes away while blocked, the call goes on for the others and the
+// cache
+void upstream_free_client(struct client *c)
+{
+	if (c->upstream_call == NULL) {
+		return;
+	}
+	listDelNode(c->upstream_call->waiters, c->upstream_node);
+	c->upstream_call = NULL;
+	c->upstream_node = NULL;
+}
+
+// free the expired entries from the oldest on, the ones left over are
+// freed by the next cron or when they are looked up. calls the upstream
+// didn't answer in time fail.
+void upstream_cron()
+{
+	struct upstream_call *call;
+	struct sa_cache_entry *e;
+	long long now = mstime();
+	dictIterator *di;
+	dictEntry *de;
+	int j;
+
+	for (j = 0; j < SA_CACHE_EXPIRE_PER_CRON && ilistLength(&g_server.sa_cache_order); j++) {
+		e = ilistEntry(ilistFirst(&g_server.sa_cache_order), struct sa_cache_entry, node);
+		if (e->expire > now) {
+			break;
+		}
+		dictDelete(g_server.sa_cache, &e->request);
+	}
+
+	if (dictSize(g_server.upstream_calls) == 0) {
+		return;
+	}
+	di = dictGetSafeIterator(g_server.upstream_calls);
+	while ((de = dictNext(di)) != NULL) {
+		call = (struct upstream_call *)dictGetVal(de);
+		if (now - call->start > g_server.upstream_timeout) {
+			upstream_call_done(call, "upstream timeout");
+		}
+	}
+	dictReleaseIterator(di);
+}
+
+// the old way, for clients that can't wait: connect, send and read on
+// the event loop
+static void sa_call_blocking(struct client *c)
+{
+	int sa_fd, nread;
+	char err_buf[ANET_ERR_LEN];
+	char reply[IOBUF_LEN];
+
+	sa_fd = anetTcpConnect(err_buf, g_server.upstream_host, g_server.upstream_port);
+	if (sa_fd == ANET_ERR) {
+		printf("%s\n", err_buf);
+		addReplyError(c, "upstream unavailable");
+		return;
+	}
+
+	anetWrite(sa_fd, c->argv[1].ptr, c->argv[1].len);
+	nread = anetRead(sa_fd, reply, IOBUF_LEN);
+	close(sa_fd);
+
+	if (nread == -1) {
+		addReplyError(c, "upstream read error");
+		return;
+	}
+	if (sa_cache_enabled()) {
+		sa_cache_store(&c->argv[1], reply, nread);
+	}
+	addReplyBulk(c, reply, nread);
+}
+
+// sa <payload>: forward the payload upstream, reply with its answer
+void command_sa(struct client *c)
+{
+	struct upstream_call *call;
+	struct sa_cache_entry *e;
+
+	if (sa_cache_enabled()) {
+		if ((e = sa_cache_lookup(&c->argv[1])) != NULL) {
+			g_server.stat_sa_cache_hits++;
+			addReplyBulk(c, e->reply, e->reply_len);
+			return;
+		}
+		g_server.stat_sa_cache_misses++;
+	}
+
+	// a datagram has no connection to wait on, and EXEC runs its
+	// commands back to back
+	if (c->flags & (CLIENT_UDP | CLIENT_MULTI | CLIENT_AOF | CLIENT_MASTER)) {
+		sa_call_blocking(c);
+		return;
+	}
+	if ((call = (struct upstream_call *)dictFetchValue(g_server.upstream_calls, &c->argv[1])) != NULL) {
+		g_server.stat_sa_coalesced++;
+	} else if ((call = upstream_call_create(&c->argv[1])) == NULL) {
+		addReplyError(c, "upstream unavailable");
+		return;
+	}
+	if (listAddNodeTail(call->waiters, c) == NULL) {
+		addReplyError(c, "out of memory waiting for the upstream");
+		return;
+	}
+	c->upstream_call = call;
+	c->upstream_node = listLast(call->waiters);
+	block_client(c);
+}
+
+// upstream: the sa cache and call counters, one per line
+void command_upstream(struct client *c)
+{
+	char line[128];
+	int len;
+
+	addReplyMultiBulkLen(c, 7);
+	len = snprintf(line, sizeof(line), "sa_cache_hits:%lld", g_server.stat_sa_cache_hits);
+	addReplyBulk(c, line, len);
+	len = snprintf(line, sizeof(line), "sa_cache_misses:%lld", g_server.stat_sa_cache_misses);
+	addReplyBulk(c, line, len);
+	len = snprintf(line, sizeof(line), "sa_cache_evictions:%lld", g_server.stat_sa_cache_evictions);
+	addReplyBulk(c, line, len);
+	len = snprintf(line, sizeof(line), "sa_cache_entries:%lu", dictSize(g_server.sa_cache));
+	addReplyBulk(c, line, len);
+	len = snprintf(line, sizeof(line), "sa_cache_bytes:%lld", g_server.sa_cache_bytes);
+	addReplyBulk(c, line, len);
+	len = snprintf(line, sizeof(line), "sa_inflight_calls:%lu", dictSize(g_server.upstream_calls));
+	addReplyBulk(c, line, len);
+	len = snprintf(line, sizeof(line), "sa_coalesced:%lld", g_server.stat_sa_coalesced);
+	addReplyBulk(c, line, len);
+}
@@ -0,0 +1,54 @@
+
+#ifndef _UPSTREAM_H
+#define _UPSTREAM_H
+
+#include <stddef.h>
+#include "adlist.h"
+#include "client.h"
+#include "network.h"
+
+// the server SA forwards to: it reads the request, writes one answer
+// and closes the connection
+#define DEFAULT_UPSTREAM_HOST	"192.168.1.109"
+#define DEFAULT_UPSTREAM_PORT	5566
+
+// answers of the upstream are reused for the same request bytes during
+// sa_cache_ttl ms. the entries take sa_cache_max_bytes at most, the
+// oldest go first to make room.
+#define DEFAULT_SA_CACHE_TTL		1000			// ms, 0 = no cache
+#define DEFAULT_SA_CACHE_MAX_BYTES	(16*1024*1024)	// 0 = no cache
+#define SA_CACHE_EXPIRE_PER_CRON	1000	// expired entries freed per server_cron at most
+
+#define DEFAULT_UPSTREAM_TIMEOUT	5000	// ms for the upstream to answer
+
+// request and answer in one allocation. entries have the same ttl, so
+// the order they were stored in is the order they expire in.
+struct sa_cache_entry{
+	ilistNode node;		// in g_server.sa_cache_order, oldest first
+	long long expire;	// unix time in ms
+	struct arg request;	// the dict key
+	char *reply;
+	size_t reply_len;
+	char data[];		// request bytes, then reply bytes
+};
+
+// a request to the upstream in flight. clients that ask the same while
+// it is wait for it too instead of sending their own.
+struct upstream_call{
+	int fd;				// non blocking socket to the upstream
+	long long start;	// unix time in ms it was sent
+	size_t sent;		// request bytes written
+	size_t nread;		// answer bytes read
+	list *waiters;		// blocked clients, in the order they asked
+	struct arg request;	// the key in g_server.upstream_calls
+	char reply[IOBUF_LEN];	// the answer, cut at IOBUF_LEN as it always was
+	char data[];		// request bytes
+};
+
+void upstream_init();
+void upstream_cron();
+void upstream_free_client(struct client *c);
+void command_sa(struct client *c);
+void command_upstream(struct client *c);
+
+#endif
@@ -0,0 +1,137 @@
+
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include "util.h"
+
+
+// convert a string into a long long, the whole string must be a valid
+// number without spaces or a leading '+'. returns 1 on success, 0 on error.
+// the string doesn't need to be null terminated, only slen bytes are used.
+int string2ll(const char *s, size_t slen, long long *value)
+{
+	const char *p = s;
+	size_t plen = 0;
+	int negative = 0;
+	unsigned long long v;
+
+	if (plen == slen) {
+		return 0;
+	}
+
+	// special case: first and only digit is 0
+	if (slen == 1 && p[0] == '0') {
+		if (value != NULL) *value = 0;
+		return 1;
+	}
+
+	if (p[0] == '-') {
+		negative = 1;
+		p++; plen++;
+
+		// abort on only a negative sign
+		if (plen == slen) {
+			return 0;
+		}
+	}
+
+	// first digit should be 1-9, otherwise the string should just be 0
+	if (p[0] >= '1' && p[0] <= '9') {
+		v = p[0]-'0';
+		p++; plen++;
+	} else {
+		return 0;
+	}
+
+	while (plen < slen && p[0] >= '0' && p[0] <= '9') {
+		if (v > (ULLONG_MAX / 10)) {	// overflow
+			return 0;
+		}
+		v *= 10;
+
+		if (v > (ULLONG_MAX - (p[0]-'0'))) {	// overflow
+			return 0;
+		}
+		v += p[0]-'0';
+
+		p++; plen++;
+	}
+
+	// return if not all bytes were used
+	if (plen < slen) {
+		return 0;
+	}
+
+	if (negative) {
+		if (v > ((unsigned long long)(-(LLONG_MIN+1))+1)) {	// overflow
+			return 0;
+		}
+		if (value != NULL) *value = -v;
+	} else {
+		if (v > LLONG_MAX) {	// overflow
+			return 0;
+		}
+		if (value != NULL) *value = v;
+	}
+	return 1;
+}
+
+// convert a long long into a string, return the length of the string or
+// 0 if the buffer is too small.
+int ll2string(char *dst, size_t dstlen, long long svalue)
+{
+	char buf[LONG_STR_SIZE];
+	unsigned long long value;
+	int negative = 0;
+	size_t len = 0, j;
+
+	if (svalue < 0) {
+		if (svalue != LLONG_MIN) {
+			value = -svalue;
+		} else {
+			value = ((unsigned long long) LLONG_MAX)+1;
+		}
+		negative = 1;
+	} else {
+		value = svalue;
+	}
+
+	// digits come out in reverse order
+	do {
+		buf[len++] = '0' + (value % 10);
+		value /= 10;
+	} while (value);
+	if (negative) {
+		buf[len++] = '-';
+	}
+
+	if (len + 1 > dstlen) {
+		return 0;
+	}
+	for (j = 0; j < len; j++) {
+		dst[j] = buf[len-1-j];
+	}
+	dst[len] = '\0';
+	return len;
+}
+
+// write all of buf to a blocking fd, retrying on EINTR. returns the
+// bytes written, less than len only if an error stopped it, or -1 if
+// nothing could be written.
+ssize_t write_all(int fd, const char *buf, size_t len)
+{
+	ssize_t nwritten, totwritten = 0;
+
+	while (len) {
+		nwritten = write(fd, buf, len);
+		if (nwritten < 0) {
+			if (errno == EINTR) continue;
+			return totwritten ? totwritten : -1;
+		}
+		len -= nwritten;
+		buf += nwritten;
+		totwritten += nwritten;
+	}
+	return totwritten;
+}
@@ -0,0 +1,14 @@
+
+#ifndef _UTIL_H
+#define _UTIL_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define LONG_STR_SIZE	21		// "-9223372036854775808" plus the null term
+
+int string2ll(const char *s, size_t slen, long long *value);
+int ll2string(char *dst, size_t dstlen, long long svalue);
+ssize_t write_all(int fd, const char *buf, size_t len);
+
+#endif
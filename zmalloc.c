@@ -0,0 +1,167 @@
+/* zmalloc - total amount of allocated memory aware version of malloc()
+ *
+ * Every block allocated through these functions is added to used_memory
+ * with its real size, so maxmemory can be enforced against it. The counter
+ * is updated with atomics: the background threads free memory too.
+ *
+ * Based on the Redis zmalloc by Salvatore Sanfilippo.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "zmalloc.h"
+
+#ifdef HAVE_MALLOC_SIZE
+#define PREFIX_SIZE (0)
+#else
+/* size_t keeps the block after it aligned for anything up to a long */
+#define PREFIX_SIZE (sizeof(size_t))
+#endif
+
+#define update_zmalloc_stat_alloc(__n) \
+    __atomic_add_fetch(&used_memory, (__n), __ATOMIC_RELAXED)
+#define update_zmalloc_stat_free(__n) \
+    __atomic_sub_fetch(&used_memory, (__n), __ATOMIC_RELAXED)
+
+static size_t used_memory = 0;
+
+void *zmalloc(size_t size) {
+    void *ptr = malloc(size+PREFIX_SIZE);
+
+    if (!ptr) return NULL;
+#ifdef HAVE_MALLOC_SIZE
+    update_zmalloc_stat_alloc(zmalloc_size(ptr));
+    return ptr;
+#else
+    *((size_t*)ptr) = size;
+    update_zmalloc_stat_alloc(size+PREFIX_SIZE);
+    return (char*)ptr+PREFIX_SIZE;
+#endif
+}
+
+void *zcalloc(size_t size) {
+    void *ptr = calloc(1, size+PREFIX_SIZE);
+
+    if (!ptr) return NULL;
+#ifdef HAVE_MALLOC_SIZE
+    update_zmalloc_stat_alloc(zmalloc_size(ptr));
+    return ptr;
+#else
+    *((size_t*)ptr) = size;
+    update_zmalloc_stat_alloc(size+PREFIX_SIZE);
+    return (char*)ptr+PREFIX_SIZE;
+#endif
+}
+
+/* Like realloc(): on failure ptr is left alone and still counted. */
+void *zrealloc(void *ptr, size_t size) {
+#ifndef HAVE_MALLOC_SIZE
+    void *realptr;
+#endif
+    size_t oldsize;
+    void *newptr;
+
+    if (ptr == NULL) return zmalloc(size);
+#ifdef HAVE_MALLOC_SIZE
+    oldsize = zmalloc_size(ptr);
+    newptr = realloc(ptr,size);
+    if (!newptr) return NULL;
+
+    update_zmalloc_stat_free(oldsize);
+    update_zmalloc_stat_alloc(zmalloc_size(newptr));
+    return newptr;
+#else
+    realptr = (char*)ptr-PREFIX_SIZE;
+    oldsize = *((size_t*)realptr);
+    newptr = realloc(realptr,size+PREFIX_SIZE);
+    if (!newptr) return NULL;
+
+    *((size_t*)newptr) = size;
+    update_zmalloc_stat_free(oldsize+PREFIX_SIZE);
+    update_zmalloc_stat_alloc(size+PREFIX_SIZE);
+    return (char*)newptr+PREFIX_SIZE;
+#endif
+}
+
+#ifndef HAVE_MALLOC_SIZE
+/* The size the block was asked with, plus the header, as it was counted. */
+size_t zmalloc_size(void *ptr) {
+    void *realptr = (char*)ptr-PREFIX_SIZE;
+
+    return *((size_t*)realptr)+PREFIX_SIZE;
+}
+#endif
+
+void zfree(void *ptr) {
+#ifndef HAVE_MALLOC_SIZE
+    void *realptr;
+    size_t oldsize;
+#endif
+
+    if (ptr == NULL) return;
+#ifdef HAVE_MALLOC_SIZE
+    update_zmalloc_stat_free(zmalloc_size(ptr));
+    free(ptr);
+#else
+    realptr = (char*)ptr-PREFIX_SIZE;
+    oldsize = *((size_t*)realptr);
+    update_zmalloc_stat_free(oldsize+PREFIX_SIZE);
+    free(realptr);
+#endif
+}
+
+char *zstrdup(const char *s) {
+    size_t l = strlen(s)+1;
+    char *p = zmalloc(l);
+
+    if (p) memcpy(p,s,l);
+    return p;
+}
+
+size_t zmalloc_used_memory(void) {
+    return __atomic_load_n(&used_memory, __ATOMIC_RELAXED);
+}
+
+#if defined(__linux__)
+/* The resident set size from /proc: the 24th field of /proc/self/stat is
+ * in pages. Reading a file is slow, this is for reports, not hot paths. */
+size_t zmalloc_get_rss(void) {
+    int page = sysconf(_SC_PAGESIZE);
+    size_t rss;
+    char buf[4096];
+    char *p, *x;
+    int fd, count;
+    ssize_t nread;
+
+    if ((fd = open("/proc/self/stat",O_RDONLY)) == -1) return 0;
+    nread = read(fd,buf,sizeof(buf)-1);
+    close(fd);
+    if (nread <= 0) return 0;
+    buf[nread] = '\0';
+
+    p = buf;
+    count = 23; /* RSS is the 24th field in /proc/<pid>/stat */
+    while(p && count--) {
+        p = strchr(p,' ');
+        if (p) p++;
+    }
+    if (!p) return 0;
+    x = strchr(p,' ');
+    if (!x) return 0;
+    *x = '\0';
+
+    rss = strtoll(p,NULL,10);
+    rss *= page;
+    return rss;
+}
+#else
+/* No portable way to get the RSS: the best we can do is what we
+ * allocated ourselves. */
+size_t zmalloc_get_rss(void) {
+    return zmalloc_used_memory();
+}
+#endif
@@ -0,0 +1,38 @@
+/* zmalloc - total amount of allocated memory aware version of malloc()
+ *
+ * Based on the Redis zmalloc by Salvatore Sanfilippo.
+ */
+
+#ifndef __ZMALLOC_H
+#define __ZMALLOC_H
+
+#include <stddef.h>
+
+/* The allocator is asked how big every block really is, so the counter
+ * includes the rounding of the size classes and matches what the heap
+ * takes. Without a way to ask, a size header is stored before the block. */
+#if defined(__APPLE__)
+#include <malloc/malloc.h>
+#define HAVE_MALLOC_SIZE 1
+#define zmalloc_size(p) malloc_size(p)
+#elif defined(__GLIBC__)
+#include <malloc.h>
+#define HAVE_MALLOC_SIZE 1
+#define zmalloc_size(p) malloc_usable_size(p)
+#endif
+
+/* Unlike the Redis ones these return NULL when out of memory, the callers
+ * handle it as they did with malloc(). */
+void *zmalloc(size_t size);
+void *zcalloc(size_t size);
+void *zrealloc(void *ptr, size_t size);
+void zfree(void *ptr);
+char *zstrdup(const char *s);
+size_t zmalloc_used_memory(void);
+size_t zmalloc_get_rss(void);
+
+#ifndef HAVE_MALLOC_SIZE
+size_t zmalloc_size(void *ptr);
+#endif
+
+#endif /* __ZMALLOC_H */